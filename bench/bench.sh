@@ -0,0 +1,79 @@
+#!/bin/bash
+
+INCLUDE_DIR="../include"
+ENGINE_DIR="../nvm_engine"
+g++ -pthread -o micro_bench micro_bench.cpp $ENGINE_DIR/*.cpp \
+	-I $INCLUDE_DIR \
+	-I $ENGINE_DIR \
+	  -lpmem \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
+
+g++ -pthread -o crash_bench crash_bench.cpp $ENGINE_DIR/*.cpp \
+	-I $INCLUDE_DIR \
+	-I $ENGINE_DIR \
+	  -lpmem \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
+
+g++ -pthread -o sweep_bench sweep_bench.cpp $ENGINE_DIR/*.cpp \
+	-I $INCLUDE_DIR \
+	-I $ENGINE_DIR \
+	  -lpmem \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
+
+g++ -pthread -o kv_server ../server/kv_server.cpp $ENGINE_DIR/*.cpp \
+	-I $INCLUDE_DIR \
+	-I $ENGINE_DIR \
+	  -lpmem \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
+
+g++ -pthread -o server_bench server_bench.cpp \
+	-I $INCLUDE_DIR \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
+
+g++ -pthread -o trace_replay trace_replay.cpp $ENGINE_DIR/*.cpp \
+	-I $INCLUDE_DIR \
+	-I $ENGINE_DIR \
+	  -lpmem \
+    -O2 \
+    -g \
+    -std=c++11
+
+if [ $? -ne 0 ]; then
+    echo "Compile Error"
+    exit 7
+fi
@@ -0,0 +1,346 @@
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nvm_engine.hpp"
+
+using namespace std;
+
+typedef unsigned long long ull;
+
+// A child process writes to the pool through StorageCrash and dies, killed
+// after a random delay or torn in the middle of a copy to the pool. It sends
+// every acknowledged Set to the parent, which then reopens the pool, times
+// the recovery and checks each key against this shadow log.
+
+// config for bench
+string POOL_PATH = "/dev/shm/crash_bench_pool";
+int NUM_KEYS = 200000;
+int NUM_THREADS = 4;
+int NUM_ROUNDS = 10;
+// kill, tear or mixed
+string MODE = "mixed";
+// percent of values above VALUE_MAX_LEN, written as chunks
+int LARGE_PERCENT = 2;
+// the child is killed after up to this many ms
+int MAX_DELAY_MS = 500;
+ull SEED = 1;
+Config config;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double ElapsedNs() const {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// xorshift generator
+class Random {
+ public:
+  explicit Random(ull _seed) : state_(_seed * 2654435761ULL + 1) {}
+  ull Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+
+ private:
+  ull state_;
+};
+
+// Set of key _key to its _seq-th value, acknowledged to the parent
+struct Ack {
+  uint32_t key_;
+  uint32_t seq_;
+};
+
+void MakeKey(uint32_t _key, char* _buf) {
+  memset(_buf, 0, KEY_LEN);
+  memcpy(_buf, "crash", 5);
+  memcpy(_buf + 8, &_key, sizeof(uint32_t));
+}
+
+// The value is a function of key and sequence number, so that any other
+// content is caught: the two numbers, then bytes derived from them
+void MakeValue(uint32_t _key, uint32_t _seq, string* _value) {
+  Random random(((ull)_key << 32) | _seq);
+  size_t len = random.Next() % 100 < (ull)LARGE_PERCENT
+                   ? 2000 + random.Next() % 20000
+                   : 16 + random.Next() % 1000;
+  _value->resize(len);
+  memcpy(&(*_value)[0], &_key, sizeof(uint32_t));
+  memcpy(&(*_value)[4], &_seq, sizeof(uint32_t));
+  for (size_t i = 8; i < len; i++) {
+    (*_value)[i] = (char)(_key * 31 + _seq * 7 + i);
+  }
+}
+
+// Write the keys of each thread round after round until the process dies,
+// starting after the sequence numbers found by the parent
+void RunChild(int _ack_fd, const vector<uint32_t>& _durable, ull _crash_after,
+              ull _seed) {
+  // the engine's messages would bury the report
+  if (freopen("/dev/null", "w", stdout) == nullptr) _exit(1);
+  Config child_config = config;
+  child_config.storage_ = StorageCrash;
+  child_config.crash_after_copies_ = _crash_after;
+  child_config.crash_seed_ = _seed;
+  DB* db;
+  DB::CreateOrOpen(POOL_PATH, &child_config, &db);
+  vector<thread> writers;
+  for (int t = 0; t < NUM_THREADS; t++) {
+    writers.emplace_back([&, t]() {
+      vector<uint32_t> seqs;
+      for (uint32_t key = t; key < (uint32_t)NUM_KEYS; key += NUM_THREADS) {
+        seqs.push_back(_durable[key]);
+      }
+      char key_buf[KEY_LEN];
+      string value;
+      for (;;) {
+        for (uint32_t key = t, i = 0; key < (uint32_t)NUM_KEYS;
+             key += NUM_THREADS, i++) {
+          MakeKey(key, key_buf);
+          MakeValue(key, seqs[i] + 1, &value);
+          // a failed Set is retried with the same sequence number
+          if (db->Set(Slice(key_buf, KEY_LEN),
+                      Slice(&value[0], value.size())) != Ok) {
+            continue;
+          }
+          Ack ack{key, ++seqs[i]};
+          if (write(_ack_fd, &ack, sizeof(Ack)) != sizeof(Ack)) _exit(1);
+        }
+      }
+    });
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+}
+
+struct RoundResult {
+  ull acked_ = 0;
+  ull keys_ = 0;
+  ull lost_ = 0;
+  ull corrupt_ = 0;
+  double recovery_s_ = 0;
+  double data_gb_ = 0;
+};
+
+// Whole value of _key read chunk by chunk through DB::GetReader
+Status ReadChunks(DB* _db, const Slice& _key, string* _value) {
+  std::unique_ptr<ValueReader> reader;
+  Status s = _db->GetReader(_key, &reader);
+  if (s != Ok) return s;
+  _value->clear();
+  Slice chunk;
+  while (reader->NextChunk(&chunk)) {
+    _value->append(chunk.data(), chunk.size());
+  }
+  return _value->size() == reader->size() ? Ok : IOError;
+}
+
+// Reopen the pool and check every key: it holds the last acknowledged value
+// or the one written after it, which may have become durable unacknowledged.
+// GetReader has to agree with Get.
+RoundResult Verify(vector<uint32_t>* _durable, const vector<uint32_t>& _acked) {
+  RoundResult result;
+  Config open_config = config;
+  open_config.storage_ = StorageMmap;
+  DB* db;
+  Timer timer;
+  DB::CreateOrOpen(POOL_PATH, &open_config, &db);
+  result.recovery_s_ = timer.ElapsedNs() / 1e9;
+  result.data_gb_ =
+      (double)AepMemoryController::global_memory_->allocated_size() /
+      (1UL << 30);
+  char key_buf[KEY_LEN];
+  string got;
+  string want;
+  string chunks;
+  for (uint32_t key = 0; key < (uint32_t)NUM_KEYS; key++) {
+    uint32_t expected = std::max((*_durable)[key], _acked[key]);
+    MakeKey(key, key_buf);
+    Status s = db->Get(Slice(key_buf, KEY_LEN), &got);
+    if (ReadChunks(db, Slice(key_buf, KEY_LEN), &chunks) != s ||
+        (s == Ok && chunks != got)) {
+      result.keys_++;
+      result.corrupt_++;
+      continue;
+    }
+    if (s == NotFound) {
+      if (expected != 0) result.lost_++;
+      continue;
+    }
+    result.keys_++;
+    uint32_t seq = 0;
+    if (s == Ok && got.size() >= 8) {
+      memcpy(&seq, &got[4], sizeof(uint32_t));
+    }
+    MakeValue(key, seq, &want);
+    if (s != Ok || seq < expected || seq > expected + 1 || got != want) {
+      if (s == Ok && got == want && seq < expected) {
+        result.lost_++;
+      } else {
+        result.corrupt_++;
+      }
+      continue;
+    }
+    (*_durable)[key] = seq;
+  }
+  delete db;
+  return result;
+}
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hf:n:t:r:m:l:d:s:p:y:i")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-f :pool file, tmpfs or regular file. \n"
+            "-n :keys. \n"
+            "-t :writer threads of the child.\n"
+            "-r :crash rounds.\n"
+            "-m :crash mode (kill, tear, mixed).\n"
+            "-l :percent of large values.\n"
+            "-d :max ms before the child is killed.\n"
+            "-s :seed.\n"
+            "-p :pool size in MB.\n"
+            "-y :block per segment.\n"
+            "-i :keep the key index in the pool.\n");
+        exit(0);
+      }
+      case 'f':
+        POOL_PATH = optarg;
+        break;
+      case 'n':
+        NUM_KEYS = atoi(optarg);
+        break;
+      case 't':
+        NUM_THREADS = atoi(optarg);
+        break;
+      case 'r':
+        NUM_ROUNDS = atoi(optarg);
+        break;
+      case 'm':
+        MODE = optarg;
+        break;
+      case 'l':
+        LARGE_PERCENT = atoi(optarg);
+        break;
+      case 'd':
+        MAX_DELAY_MS = atoi(optarg);
+        break;
+      case 's':
+        SEED = atoll(optarg);
+        break;
+      case 'p':
+        config.pool_size_ = atoll(optarg) << 20;
+        break;
+      case 'y':
+        config.block_per_segment_ = atoi(optarg);
+        break;
+      case 'i':
+        config.pmem_index_ = true;
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config.pool_size_ = 1024UL << 20;
+  config.block_per_segment_ = 4096;
+  config_parse(argc, argv);
+  config.max_keys_ = std::max(NUM_KEYS * 2, 1024);
+  // always start from a new pool
+  unlink(POOL_PATH.c_str());
+  printf("Pool %s keys:%d threads:%d rounds:%d mode:%s large:%d%%\n",
+         POOL_PATH.c_str(), NUM_KEYS, NUM_THREADS, NUM_ROUNDS, MODE.c_str(),
+         LARGE_PERCENT);
+
+  Random random(SEED);
+  vector<uint32_t> durable(NUM_KEYS, 0);
+  ull failures = 0;
+  double total_s = 0;
+  double total_gb = 0;
+  ull total_keys = 0;
+  for (int round = 0; round < NUM_ROUNDS; round++) {
+    bool tear = MODE == "tear" || (MODE == "mixed" && round % 2 == 1);
+    // copies of the child, its own open and format included
+    ull crash_after = tear ? 1 + random.Next() % (4ULL * NUM_KEYS) : 0;
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+      close(fds[0]);
+      RunChild(fds[1], durable, crash_after, random.Next());
+      _exit(0);
+    }
+    close(fds[1]);
+    vector<uint32_t> acked(NUM_KEYS, 0);
+    ull acks = 0;
+    thread reader([&]() {
+      Ack ack;
+      // ends when the child is gone
+      while (read(fds[0], &ack, sizeof(Ack)) == sizeof(Ack)) {
+        acked[ack.key_] = std::max(acked[ack.key_], ack.seq_);
+        acks++;
+      }
+    });
+    // a torn child dies by itself, unless its copies run out first
+    int delay_ms = tear ? 10000 : 1 + random.Next() % MAX_DELAY_MS;
+    for (int waited = 0; waited < delay_ms; waited++) {
+      if (waitpid(child, nullptr, WNOHANG) == child) {
+        child = 0;
+        break;
+      }
+      usleep(1000);
+    }
+    if (child != 0) {
+      kill(child, SIGKILL);
+      waitpid(child, nullptr, 0);
+    }
+    reader.join();
+    close(fds[0]);
+
+    RoundResult result = Verify(&durable, acked);
+    result.acked_ = acks;
+    failures += result.lost_ + result.corrupt_;
+    total_s += result.recovery_s_;
+    total_gb += result.data_gb_;
+    total_keys += result.keys_;
+    printf(
+        "round %2d %-4s acked %8llu keys %8llu lost %llu corrupt %llu "
+        "recovery %.3lf s %.3lf GB %.2lf s/GB %.0lf keys/s\n",
+        round, tear ? "tear" : "kill", result.acked_, result.keys_,
+        result.lost_, result.corrupt_, result.recovery_s_, result.data_gb_,
+        result.recovery_s_ / std::max(result.data_gb_, 1e-9),
+        result.keys_ / std::max(result.recovery_s_, 1e-9));
+  }
+  printf("failures %llu recovery %.2lf s/GB %.0lf keys/s\n", failures,
+         total_s / std::max(total_gb, 1e-9),
+         total_keys / std::max(total_s, 1e-9));
+  return failures == 0 ? 0 : 1;
+}
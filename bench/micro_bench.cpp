@@ -0,0 +1,495 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nvm_engine.hpp"
+
+using namespace std;
+
+typedef unsigned long long ull;
+
+// config for bench
+string POOL_PATH = "/dev/shm/micro_bench_pool";
+int NUM_OPS = 1000000;
+int NUM_THREADS = 4;
+string CASES =
+    "hash,find,filter,encode,persist,alloc,set,large,inline,recovery";
+Config config;
+
+char* BASE = nullptr;
+StorageBackend* STORAGE = nullptr;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double ElapsedNs() const {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// xorshift generator, cheap enough not to show up in the numbers
+class KeyGen {
+ public:
+  explicit KeyGen(ull _seed) : state_(_seed * 2654435761ULL + 1) {}
+  ull Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+  void Fill(char* _buf, size_t _size) {
+    for (size_t i = 0; i < _size; i += sizeof(ull)) {
+      ull v = Next();
+      memcpy(_buf + i, &v, std::min(sizeof(ull), _size - i));
+    }
+  }
+
+ private:
+  ull state_;
+};
+
+bool enabled(const char* _name) { return CASES.find(_name) != string::npos; }
+
+void bench_hash() {
+  std::cout << "---------------DJBHash-------------" << std::endl;
+  KeyGen gen(1);
+  vector<char> keys((size_t)NUM_OPS * KEY_LEN);
+  gen.Fill(keys.data(), keys.size());
+  HASH_VALUE sink = 0;
+  Timer timer;
+  for (int i = 0; i < NUM_OPS; i++) {
+    sink ^= DJBHash(keys.data() + (size_t)i * KEY_LEN);
+  }
+  double ns = timer.ElapsedNs();
+  printf("hash 16B key: %.2lf ns/op (sink %u)\n", ns / NUM_OPS, sink);
+}
+
+void bench_find() {
+  std::cout << "---------------KVStore::Find-------------" << std::endl;
+  KVStore kv_store(BASE, STORAGE);
+  KeyGen gen(2);
+  char value_buf[80];
+  gen.Fill(value_buf, sizeof(value_buf));
+  Slice value(value_buf, sizeof(value_buf));
+  for (int chain_len = 1; chain_len <= 64; chain_len *= 2) {
+    Entry entry;
+    vector<char> keys((size_t)chain_len * KEY_LEN);
+    gen.Fill(keys.data(), keys.size());
+    for (int i = 0; i < chain_len; i++) {
+      kv_store.Write(Slice(keys.data() + (size_t)i * KEY_LEN, KEY_LEN), value,
+                     &entry);
+    }
+    KEY_INDEX_TYPE sink = 0;
+    Timer timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Slice key(keys.data() + (size_t)(i % chain_len) * KEY_LEN, KEY_LEN);
+      sink ^= kv_store.Find(key, entry.GetHead());
+    }
+    double hit_ns = timer.ElapsedNs();
+
+    char miss_buf[KEY_LEN];
+    gen.Fill(miss_buf, KEY_LEN);
+    Slice miss(miss_buf, KEY_LEN);
+    Timer miss_timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      sink ^= kv_store.Find(miss, entry.GetHead());
+    }
+    double miss_ns = miss_timer.ElapsedNs();
+    printf("chain %2d: hit %.2lf ns/op miss %.2lf ns/op (sink %u)\n",
+           chain_len, hit_ns / NUM_OPS, miss_ns / NUM_OPS, sink);
+  }
+}
+
+void bench_filter() {
+  std::cout << "---------------KeyFilter-------------" << std::endl;
+  KeyGen gen(6);
+  vector<char> keys((size_t)NUM_OPS * KEY_LEN);
+  gen.Fill(keys.data(), keys.size());
+  vector<char> misses((size_t)NUM_OPS * KEY_LEN);
+  gen.Fill(misses.data(), misses.size());
+  for (double fp_rate : {0.1, 0.01, 0.001}) {
+    KeyFilter filter(KeyFilter::Size(NUM_OPS, fp_rate), fp_rate);
+    Timer add_timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      filter.Add(keys.data() + (size_t)i * KEY_LEN);
+    }
+    double add_ns = add_timer.ElapsedNs();
+    int positives = 0;
+    Timer miss_timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      positives += filter.MayContain(misses.data() + (size_t)i * KEY_LEN);
+    }
+    double miss_ns = miss_timer.ElapsedNs();
+    printf("fp %.3lf: %.2lf bytes/key probes %d add %.2lf ns/op miss %.2lf "
+           "ns/op measured fp %.4lf\n",
+           fp_rate, (double)filter.size() / NUM_OPS, filter.probes(),
+           add_ns / NUM_OPS, miss_ns / NUM_OPS, (double)positives / NUM_OPS);
+  }
+}
+
+void bench_encode() {
+  std::cout << "---------------Record encoding-------------" << std::endl;
+  KeyGen gen(3);
+  char key_buf[KEY_LEN];
+  char value_buf[VALUE_MAX_LEN];
+  char record_buf[RECORD_FIX_LEN + VALUE_MAX_LEN];
+  gen.Fill(key_buf, KEY_LEN);
+  gen.Fill(value_buf, VALUE_MAX_LEN);
+  const size_t sizes[] = {80, 256, 512, 1024};
+  for (size_t size : sizes) {
+    Slice key(key_buf, KEY_LEN);
+    Slice value(value_buf, size);
+    size_t sink = 0;
+    Timer timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      sink += KVStore::EncodeRecord(key, value, i, i, record_buf);
+    }
+    double ns = timer.ElapsedNs();
+    printf("value %4zu B: %.2lf ns/op (sink %zu)\n", size, ns / NUM_OPS,
+           sink);
+  }
+}
+
+void bench_persist() {
+  std::cout << "---------------MemcpyPersist-------------" << std::endl;
+  const size_t region_size = 64UL << 20;
+  BLOCK_INDEX_TYPE block_index;
+  if (!AepMemoryController::global_memory_->New(&block_index, region_size)) {
+    std::cout << "skip: no space for persist region" << std::endl;
+    return;
+  }
+  char* region = BASE + (uint64_t)block_index * CONFIG.block_size_;
+  KeyGen gen(4);
+  char src[4096];
+  gen.Fill(src, sizeof(src));
+  const size_t sizes[] = {64, 128, 256, 512, 1024, 4096};
+  for (size_t size : sizes) {
+    size_t offset = 0;
+    Timer timer;
+    for (int i = 0; i < NUM_OPS; i++) {
+      if (offset + size > region_size) offset = 0;
+      STORAGE->MemcpyPersist(region + offset, src, size);
+      offset += size;
+    }
+    double ns = timer.ElapsedNs();
+    printf("%4zu B: %.2lf ns/op %.2lf MB/s\n", size, ns / NUM_OPS,
+           (double)size * NUM_OPS / (ns / 1e9) / (1 << 20));
+  }
+  AepMemoryController::global_memory_->Delete(block_index, region_size);
+}
+
+void* alloc_worker(void* _arg) {
+  int ops = *(int*)_arg;
+  const int batch = 64;
+  BLOCK_INDEX_TYPE indexes[batch];
+  for (int i = 0; i < ops; i += batch) {
+    for (int j = 0; j < batch; j++) {
+      thread_local_aep_controller->New(2, indexes + j);
+    }
+    for (int j = 0; j < batch; j++) {
+      thread_local_aep_controller->Delete(2, indexes[j]);
+    }
+  }
+  return nullptr;
+}
+
+void bench_alloc() {
+  std::cout << "---------------AepMemoryController::New/Delete-------------"
+            << std::endl;
+  for (int threads = 1; threads <= NUM_THREADS; threads *= 2) {
+    vector<pthread_t> tids(threads);
+    int ops = NUM_OPS / threads;
+    Timer timer;
+    for (int i = 0; i < threads; i++) {
+      pthread_create(&tids[i], nullptr, alloc_worker, &ops);
+    }
+    for (int i = 0; i < threads; i++) {
+      pthread_join(tids[i], nullptr);
+    }
+    double ns = timer.ElapsedNs();
+    printf("threads %2d: %.2lf Mops/s (New+Delete pairs)\n", threads,
+           (double)ops * threads / (ns / 1e3));
+  }
+}
+
+struct SetArg {
+  HashMap* hash_map_;
+  int ops_;
+  ull seed_;
+};
+
+void* set_worker(void* _arg) {
+  SetArg* arg = (SetArg*)_arg;
+  KeyGen gen(arg->seed_);
+  char key_buf[KEY_LEN];
+  char value_buf[80];
+  gen.Fill(value_buf, sizeof(value_buf));
+  for (int i = 0; i < arg->ops_; i++) {
+    gen.Fill(key_buf, KEY_LEN);
+    arg->hash_map_->Set(Slice(key_buf, KEY_LEN),
+                        Slice(value_buf, sizeof(value_buf)));
+  }
+  return nullptr;
+}
+
+void bench_set() {
+  std::cout << "---------------HashMap::Set-------------" << std::endl;
+  auto* hash_map = new HashMap(BASE, STORAGE);
+  PersistExecutor* persist = nullptr;
+  if (CONFIG.persist_threads_ > 0) {
+    persist = new PersistExecutor(STORAGE, CONFIG.persist_threads_);
+    hash_map->kv_store_->set_persist_executor(persist);
+  }
+  for (int threads = 1; threads <= NUM_THREADS; threads *= 2) {
+    vector<pthread_t> tids(threads);
+    vector<SetArg> args(threads);
+    Timer timer;
+    for (int i = 0; i < threads; i++) {
+      args[i] = {hash_map, NUM_OPS / threads, (ull)threads * 1000 + i};
+      pthread_create(&tids[i], nullptr, set_worker, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+      pthread_join(tids[i], nullptr);
+    }
+    double ns = timer.ElapsedNs();
+    printf("threads %2d persist threads %d: %.2lf Mops/s\n", threads,
+           CONFIG.persist_threads_,
+           (double)(NUM_OPS / threads) * threads / (ns / 1e3));
+  }
+  delete persist;
+  delete hash_map;
+}
+
+void bench_large() {
+  std::cout << "---------------HashMap::Set/Get of large values-------------"
+            << std::endl;
+  auto* hash_map = new HashMap(BASE, STORAGE);
+  KeyGen gen(7);
+  // a few keys overwritten in turn keep the pool from filling up
+  const int keys = 16;
+  vector<char> key_bufs(keys * KEY_LEN);
+  gen.Fill(key_bufs.data(), key_bufs.size());
+  size_t sizes[] = {4 << 10, 64 << 10, 1 << 20};
+  for (size_t size : sizes) {
+    if (size > LargeValue::MaxLen()) continue;
+    string value(size, 0);
+    gen.Fill(&value[0], size);
+    int ops = std::max<uint64_t>(keys, (256ULL << 20) / size);
+    Timer set_timer;
+    for (int i = 0; i < ops; i++) {
+      hash_map->Set(Slice(key_bufs.data() + i % keys * KEY_LEN, KEY_LEN),
+                    Slice(&value[0], size));
+    }
+    double set_ns = set_timer.ElapsedNs();
+    string got;
+    Timer get_timer;
+    for (int i = 0; i < ops; i++) {
+      hash_map->Get(Slice(key_bufs.data() + i % keys * KEY_LEN, KEY_LEN),
+                    &got);
+    }
+    double get_ns = get_timer.ElapsedNs();
+    // 4 KB at a random offset through a reader, no copy of the whole value
+    char range[4096];
+    Timer range_timer;
+    for (int i = 0; i < ops; i++) {
+      std::unique_ptr<ValueReader> reader;
+      hash_map->GetReader(
+          Slice(key_bufs.data() + i % keys * KEY_LEN, KEY_LEN), &reader);
+      reader->Read(gen.Next() % size, sizeof(range), range);
+    }
+    double range_ns = range_timer.ElapsedNs();
+    double mb = (double)size * ops / (1 << 20);
+    printf("value %7zu: set %.0lf MB/s get %.0lf MB/s 4KB range %.0lf ns\n",
+           size, mb / (set_ns / 1e9), mb / (get_ns / 1e9), range_ns / ops);
+  }
+  delete hash_map;
+}
+
+void bench_inline() {
+  std::cout << "---------------HashMap::Get of 16 byte values-------------"
+            << std::endl;
+  uint32_t inline_value_len = CONFIG.inline_value_len_;
+  uint64_t max_keys = CONFIG.max_keys_;
+  // the copies are sized by the key index
+  CONFIG.max_keys_ = NUM_OPS;
+  for (uint32_t len : {0u, 32u}) {
+    CONFIG.inline_value_len_ = len;
+    auto* hash_map = new HashMap(BASE, STORAGE);
+    KeyGen gen(8);
+    vector<char> keys((size_t)NUM_OPS * KEY_LEN);
+    gen.Fill(keys.data(), keys.size());
+    char value_buf[16];
+    gen.Fill(value_buf, sizeof(value_buf));
+    for (int i = 0; i < NUM_OPS; i++) {
+      hash_map->Set(Slice(keys.data() + (size_t)i * KEY_LEN, KEY_LEN),
+                    Slice(value_buf, sizeof(value_buf)));
+    }
+    vector<double> latencies(NUM_OPS);
+    string value;
+    for (int i = 0; i < NUM_OPS; i++) {
+      Slice key(keys.data() + gen.Next() % NUM_OPS * KEY_LEN, KEY_LEN);
+      Timer timer;
+      hash_map->Get(key, &value);
+      latencies[i] = timer.ElapsedNs();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (double ns : latencies) sum += ns;
+    printf("inline value len %2u: avg %.0lf ns p50 %.0lf ns p99 %.0lf ns\n",
+           len, sum / NUM_OPS, latencies[NUM_OPS / 2],
+           latencies[(size_t)NUM_OPS * 99 / 100]);
+    delete hash_map;
+  }
+  CONFIG.inline_value_len_ = inline_value_len;
+  CONFIG.max_keys_ = max_keys;
+}
+
+void bench_recovery() {
+  std::cout << "---------------HashMap::Recovery-------------" << std::endl;
+  auto* writer = new HashMap(BASE, STORAGE);
+  KeyGen gen(5);
+  char key_buf[KEY_LEN];
+  char value_buf[80];
+  gen.Fill(value_buf, sizeof(value_buf));
+  for (int i = 0; i < NUM_OPS; i++) {
+    gen.Fill(key_buf, KEY_LEN);
+    writer->Set(Slice(key_buf, KEY_LEN), Slice(value_buf, sizeof(value_buf)));
+  }
+  uint64_t scan_size = AepMemoryController::global_memory_->allocated_size();
+  delete writer;
+
+  auto* reader = new HashMap(BASE, STORAGE);
+  Timer timer;
+  reader->Recovery(BASE, scan_size);
+  double s = timer.ElapsedNs() / 1e9;
+  double gb = (double)scan_size / (1UL << 30);
+  printf("scanned %.2lf GB in %.2lf s: %.2lf s/GB, %.0lf keys/s\n", gb, s,
+         s / gb, NUM_OPS / s);
+  delete reader;
+}
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hf:n:t:c:x:k:y:p:b:l:w:d:")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-f :pool file, tmpfs or regular file. \n"
+            "-n :ops per case. \n"
+            "-t :max threads for allocator contention.\n"
+            "-c :comma separated cases (hash,find,filter,encode,persist,"
+            "alloc,set,large,inline,recovery).\n"
+            "-x :block size.\n"
+            "-k :block size classes.\n"
+            "-y :block per segment.\n"
+            "-p :pool size in MB.\n"
+            "-b :storage backend (pmem, mmap, msync, dram).\n"
+            "-l :dram backend write latency in ns.\n"
+            "-w :dram backend bandwidth in MB/s.\n"
+            "-d :persist threads for the set case, 0 stores inline.\n");
+        exit(0);
+      }
+      case 'f':
+        POOL_PATH = optarg;
+        break;
+      case 'n':
+        NUM_OPS = atoi(optarg);
+        break;
+      case 't':
+        NUM_THREADS = atoi(optarg);
+        break;
+      case 'c':
+        CASES = optarg;
+        break;
+      case 'x':
+        config.block_size_ = atoi(optarg);
+        break;
+      case 'k':
+        config.block_size_classes_ = atoi(optarg);
+        break;
+      case 'y':
+        config.block_per_segment_ = atoi(optarg);
+        break;
+      case 'p':
+        config.pool_size_ = atoll(optarg) << 20;
+        break;
+      case 'b':
+        if (strcmp(optarg, "mmap") == 0) {
+          config.storage_ = StorageMmap;
+        } else if (strcmp(optarg, "msync") == 0) {
+          config.storage_ = StorageMmap;
+          config.msync_ = true;
+        } else if (strcmp(optarg, "dram") == 0) {
+          config.storage_ = StorageDram;
+        } else {
+          config.storage_ = StoragePmem;
+        }
+        break;
+      case 'l':
+        config.emulated_write_latency_ns_ = atoll(optarg);
+        break;
+      case 'w':
+        config.emulated_bandwidth_mb_ = atoll(optarg);
+        break;
+      case 'd':
+        config.persist_threads_ = atoi(optarg);
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config_parse(argc, argv);
+  CONFIG = config;
+  CONFIG.block_size_classes_ =
+      std::min(std::max(1, CONFIG.block_size_classes_), MAX_SIZE_CLASSES);
+  if (CONFIG.max_keys_ == 0) CONFIG.max_keys_ = DEFAULT_MAX_KEYS;
+  CONFIG.max_keys_ = std::min<uint64_t>(CONFIG.max_keys_, UINT32_MAX - 1);
+
+  STORAGE = StorageBackend::Create(CONFIG);
+  if ((BASE = STORAGE->Map(POOL_PATH, CONFIG.pool_size_)) == nullptr) {
+    perror("Pmem map file failed");
+    exit(1);
+  }
+  // always start from a freshly formatted pool
+  AepMemoryController::global_memory_ =
+      new GlobalMemoryController(BASE, STORAGE, CONFIG.pool_size_);
+  AepMemoryController::global_memory_->Open(false);
+  std::cout << "Pool " << POOL_PATH << " is_pmem:" << STORAGE->is_pmem()
+            << " storage:" << (int)CONFIG.storage_
+            << " pool size:" << CONFIG.pool_size_
+            << " block size:" << CONFIG.block_size_
+            << " size classes:" << CONFIG.block_size_classes_
+            << " block per segments:" << CONFIG.block_per_segment_ << std::endl;
+
+  if (enabled("hash")) bench_hash();
+  if (enabled("find")) bench_find();
+  if (enabled("filter")) bench_filter();
+  if (enabled("encode")) bench_encode();
+  if (enabled("persist")) bench_persist();
+  if (enabled("alloc")) bench_alloc();
+  if (enabled("set")) bench_set();
+  if (enabled("large")) bench_large();
+  if (enabled("inline")) bench_inline();
+  if (enabled("recovery")) bench_recovery();
+
+  // the main thread's controller must not touch the pool after it is gone
+  AepMemoryController::ResetAll();
+  delete AepMemoryController::global_memory_;
+  AepMemoryController::global_memory_ = nullptr;
+  delete STORAGE;
+  return 0;
+}
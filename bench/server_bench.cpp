@@ -0,0 +1,338 @@
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../server/protocol.h"
+#include "db.hpp"
+
+using namespace std;
+
+typedef unsigned long long ull;
+
+// Load generator for kv_server. Every thread opens one connection and keeps
+// a window of requests in flight: it writes the whole window, then reads
+// the responses, so the server sees batches of the window size.
+
+// config for bench
+string SOCKET_PATH = "/tmp/kv_server.sock";
+int NUM_CONNECTIONS = 4;
+int DEPTH = 32;
+int NUM_KEYS = 1000000;
+int NUM_OPS = 1000000;
+int VALUE_SIZE = 80;
+int READ_PERCENT = 90;
+bool LOAD = true;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double ElapsedNs() const {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// xorshift generator
+class Random {
+ public:
+  explicit Random(ull _seed) : state_(_seed * 2654435761ULL + 1) {}
+  ull Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+
+ private:
+  ull state_;
+};
+
+void make_key(ull _i, char* _buf) {
+  memset(_buf, 0, PROTOCOL_KEY_LEN);
+  memcpy(_buf, "srv", 3);
+  memcpy(_buf + 8, &_i, sizeof(ull));
+}
+
+class Client {
+ public:
+  bool Connect() {
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, SOCKET_PATH.c_str(), sizeof(addr.sun_path) - 1);
+    return fd_ >= 0 && connect(fd_, (sockaddr*)&addr, sizeof(addr)) == 0;
+  }
+
+  ~Client() {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  // Write _requests and buffer the responses arriving meanwhile: the
+  // server stops reading a connection whose responses are not read
+  bool Send(const std::string& _requests) {
+    size_t sent = 0;
+    while (sent < _requests.size()) {
+      pollfd poll_fd{fd_, POLLIN | POLLOUT, 0};
+      if (poll(&poll_fd, 1, -1) < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      if (poll_fd.revents & POLLIN) {
+        size_t size = buffer_.size();
+        buffer_.resize(size + (64 << 10));
+        ssize_t n = recv(fd_, &buffer_[size], 64 << 10, MSG_DONTWAIT);
+        buffer_.resize(size + std::max<ssize_t>(n, 0));
+        if (n == 0 || (n < 0 && errno != EAGAIN)) return false;
+      }
+      if (poll_fd.revents & POLLOUT) {
+        ssize_t n = send(fd_, _requests.data() + sent, _requests.size() - sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN) return false;
+        sent += std::max<ssize_t>(n, 0);
+      }
+      if (poll_fd.revents & (POLLERR | POLLHUP)) return false;
+    }
+    return true;
+  }
+
+  // Read the next response, its value into *_value
+  bool Receive(ResponseHeader* _header, std::string* _value) {
+    if (!Fill(sizeof(ResponseHeader))) return false;
+    memcpy(_header, buffer_.data() + offset_, sizeof(ResponseHeader));
+    offset_ += sizeof(ResponseHeader);
+    if (!Fill(_header->value_len_)) return false;
+    _value->assign(buffer_.data() + offset_, _header->value_len_);
+    offset_ += _header->value_len_;
+    return true;
+  }
+
+ private:
+  // Have at least _n unread bytes in buffer_
+  bool Fill(size_t _n) {
+    if (buffer_.size() - offset_ >= _n) return true;
+    buffer_.erase(0, offset_);
+    offset_ = 0;
+    while (buffer_.size() < _n) {
+      size_t size = buffer_.size();
+      buffer_.resize(size + std::max<size_t>(_n - size, 64 << 10));
+      ssize_t n = read(fd_, &buffer_[size], buffer_.size() - size);
+      buffer_.resize(size + std::max<ssize_t>(n, 0));
+      if (n <= 0) return false;
+    }
+    return true;
+  }
+
+  int fd_ = -1;
+  std::string buffer_;
+  size_t offset_ = 0;
+};
+
+struct Worker {
+  // latency of each window divided by its size
+  vector<float> op_ns_;
+  ull ops_ = 0;
+  ull errors_ = 0;
+};
+
+double percentile(const vector<float>& _sorted, double _p) {
+  if (_sorted.empty()) return 0;
+  size_t i = std::min(_sorted.size() - 1, (size_t)(_sorted.size() * _p));
+  return _sorted[i];
+}
+
+// Set the keys of connection _t, DEPTH at a time
+bool load(Client* _client, int _t, const vector<char>& _values) {
+  Random gen(_t + 1);
+  char key[PROTOCOL_KEY_LEN];
+  std::string requests;
+  std::string value;
+  ResponseHeader header;
+  ull i = _t;
+  while (i < (ull)NUM_KEYS) {
+    requests.clear();
+    int n = 0;
+    for (; n < DEPTH && i < (ull)NUM_KEYS; n++, i += NUM_CONNECTIONS) {
+      make_key(i, key);
+      EncodeRequest(OpSet, key, _values.data() + gen.Next() % 4096,
+                    VALUE_SIZE, &requests);
+    }
+    if (!_client->Send(requests)) return false;
+    for (int j = 0; j < n; j++) {
+      if (!_client->Receive(&header, &value) || header.status_ != Ok) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void run(Client* _client, int _t, const vector<char>& _values,
+         Worker* _worker) {
+  Random gen((ull)_t * 7919 + 17);
+  char key[PROTOCOL_KEY_LEN];
+  std::string requests;
+  std::string value;
+  ResponseHeader header;
+  vector<uint8_t> ops(DEPTH);
+  _worker->op_ns_.reserve(NUM_OPS / DEPTH + 1);
+  for (int done = 0; done < NUM_OPS; done += DEPTH) {
+    int n = std::min(DEPTH, NUM_OPS - done);
+    requests.clear();
+    for (int j = 0; j < n; j++) {
+      make_key(gen.Next() % NUM_KEYS, key);
+      if ((int)(gen.Next() % 100) < READ_PERCENT) {
+        ops[j] = OpGet;
+        EncodeRequest(OpGet, key, nullptr, 0, &requests);
+      } else {
+        ops[j] = OpSet;
+        EncodeRequest(OpSet, key, _values.data() + gen.Next() % 4096,
+                      VALUE_SIZE, &requests);
+      }
+    }
+    Timer timer;
+    if (!_client->Send(requests)) {
+      _worker->errors_ += n;
+      return;
+    }
+    for (int j = 0; j < n; j++) {
+      if (!_client->Receive(&header, &value)) {
+        _worker->errors_ += n - j;
+        return;
+      }
+      // every key was loaded, a Get returns a whole value
+      if (header.status_ != Ok ||
+          (ops[j] == OpGet && value.size() != (size_t)VALUE_SIZE)) {
+        _worker->errors_++;
+      }
+    }
+    _worker->op_ns_.push_back(timer.ElapsedNs() / n);
+    _worker->ops_ += n;
+  }
+}
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hs:c:d:n:o:v:r:l")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-s :unix socket path of kv_server.\n"
+            "-c :connections, one thread each.\n"
+            "-d :requests in flight per connection.\n"
+            "-n :keys.\n"
+            "-o :ops per connection.\n"
+            "-v :value size.\n"
+            "-r :read percent.\n"
+            "-l :skip loading the keys.\n");
+        exit(0);
+      }
+      case 's':
+        SOCKET_PATH = optarg;
+        break;
+      case 'c':
+        NUM_CONNECTIONS = atoi(optarg);
+        break;
+      case 'd':
+        DEPTH = std::max(1, atoi(optarg));
+        break;
+      case 'n':
+        NUM_KEYS = atoi(optarg);
+        break;
+      case 'o':
+        NUM_OPS = atoi(optarg);
+        break;
+      case 'v':
+        VALUE_SIZE = atoi(optarg);
+        break;
+      case 'r':
+        READ_PERCENT = atoi(optarg);
+        break;
+      case 'l':
+        LOAD = false;
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config_parse(argc, argv);
+  // values are slices of one random buffer at random offsets
+  vector<char> values(VALUE_SIZE + 4096);
+  Random gen(42);
+  for (auto& c : values) {
+    c = (char)gen.Next();
+  }
+
+  vector<Client> clients(NUM_CONNECTIONS);
+  for (auto& client : clients) {
+    if (!client.Connect()) {
+      perror("connect failed");
+      return 1;
+    }
+  }
+  if (LOAD) {
+    Timer timer;
+    std::atomic<bool> failed{false};
+    vector<thread> loaders;
+    for (int t = 0; t < NUM_CONNECTIONS; t++) {
+      loaders.emplace_back([&, t]() {
+        if (!load(&clients[t], t, values)) failed = true;
+      });
+    }
+    for (auto& loader : loaders) {
+      loader.join();
+    }
+    if (failed) {
+      fprintf(stderr, "load failed\n");
+      return 1;
+    }
+    double seconds = timer.ElapsedNs() / 1e9;
+    printf("load %d keys: %.3lf s, %.2lf Mops/s\n", NUM_KEYS, seconds,
+           NUM_KEYS / seconds / 1e6);
+  }
+
+  vector<Worker> workers(NUM_CONNECTIONS);
+  vector<thread> runners;
+  Timer timer;
+  for (int t = 0; t < NUM_CONNECTIONS; t++) {
+    runners.emplace_back(
+        [&, t]() { run(&clients[t], t, values, &workers[t]); });
+  }
+  for (auto& runner : runners) {
+    runner.join();
+  }
+  double seconds = timer.ElapsedNs() / 1e9;
+
+  vector<float> op_ns;
+  ull ops = 0;
+  ull errors = 0;
+  for (auto& worker : workers) {
+    op_ns.insert(op_ns.end(), worker.op_ns_.begin(), worker.op_ns_.end());
+    ops += worker.ops_;
+    errors += worker.errors_;
+  }
+  std::sort(op_ns.begin(), op_ns.end());
+  printf(
+      "connections %d depth %d read %d%%: %llu ops, %.3lf s, %.2lf Mops/s, "
+      "per op p50 %.0lf ns p99 %.0lf ns, errors %llu\n",
+      NUM_CONNECTIONS, DEPTH, READ_PERCENT, ops, seconds, ops / seconds / 1e6,
+      percentile(op_ns, 0.5), percentile(op_ns, 0.99), errors);
+  return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "nvm_engine.hpp"
+
+using namespace std;
+
+typedef unsigned long long ull;
+
+// Runs the engine over every combination of the lists given on the command
+// line and writes one CSV row per combination, so configs can be picked for
+// new hardware from data instead of by hand-running judge.
+
+// config for bench
+string POOL_PATH = "/dev/shm/sweep_bench_pool";
+string CSV_PATH = "sweep.csv";
+int NUM_KEYS = 1000000;
+int NUM_OPS = 1000000;
+string THREADS = "1,4,8,16";
+string BLOCK_SIZES = "32,64";
+string SEGMENT_BLOCKS = "4096,65536";
+// fixed length N or uniform lengths A-B
+string VALUE_SIZES = "80,16-1024";
+string READ_PERCENTS = "0,50,95";
+Config config;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double ElapsedNs() const {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// xorshift generator, cheap enough not to show up in the numbers
+class KeyGen {
+ public:
+  explicit KeyGen(ull _seed) : state_(_seed * 2654435761ULL + 1) {}
+  ull Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+  void Fill(char* _buf, size_t _size) {
+    for (size_t i = 0; i < _size; i += sizeof(ull)) {
+      ull v = Next();
+      memcpy(_buf + i, &v, std::min(sizeof(ull), _size - i));
+    }
+  }
+
+ private:
+  ull state_;
+};
+
+vector<string> split(const string& _list) {
+  vector<string> items;
+  size_t begin = 0;
+  while (begin <= _list.size()) {
+    size_t end = _list.find(',', begin);
+    if (end == string::npos) end = _list.size();
+    if (end > begin) items.push_back(_list.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return items;
+}
+
+vector<int> split_ints(const string& _list) {
+  vector<int> values;
+  for (auto& item : split(_list)) {
+    values.push_back(atoi(item.c_str()));
+  }
+  return values;
+}
+
+struct ValueSize {
+  string name_;
+  size_t min_;
+  size_t max_;
+
+  size_t Next(KeyGen* _gen) const {
+    return min_ == max_ ? min_ : min_ + _gen->Next() % (max_ - min_ + 1);
+  }
+};
+
+ValueSize parse_value_size(const string& _spec) {
+  ValueSize size{_spec, 0, 0};
+  size_t dash = _spec.find('-');
+  size.min_ = atoll(_spec.c_str());
+  size.max_ =
+      dash == string::npos ? size.min_ : atoll(_spec.c_str() + dash + 1);
+  if (size.max_ < size.min_) std::swap(size.min_, size.max_);
+  return size;
+}
+
+// Key i of the data set, the same in every combination
+void make_key(ull _i, char* _buf) {
+  KeyGen gen(_i);
+  gen.Fill(_buf, KEY_LEN);
+}
+
+struct Case {
+  int threads_;
+  int block_size_;
+  int segment_blocks_;
+  ValueSize value_size_;
+  int read_percent_;
+};
+
+struct Worker {
+  vector<float> get_ns_;
+  vector<float> set_ns_;
+  ull errors_ = 0;
+};
+
+// Latency at fraction _p of the sorted samples, 0 without samples
+double percentile(const vector<float>& _sorted, double _p) {
+  if (_sorted.empty()) return 0;
+  size_t i = std::min(_sorted.size() - 1, (size_t)(_sorted.size() * _p));
+  return _sorted[i];
+}
+
+// Run one case on a new pool and write its row
+void run_case(const Case& _case, const vector<char>& _values, FILE* _csv) {
+  unlink(POOL_PATH.c_str());
+  Config case_config = config;
+  case_config.block_size_ = _case.block_size_;
+  case_config.block_per_segment_ = _case.segment_blocks_;
+  DB* db;
+  if (DB::CreateOrOpen(POOL_PATH, &case_config, &db) != Ok) {
+    fprintf(stderr, "open %s failed\n", POOL_PATH.c_str());
+    exit(1);
+  }
+  StorageBackend* storage = AepMemoryController::global_memory_->storage();
+  int threads = _case.threads_;
+
+  // load every key once
+  vector<thread> loaders;
+  for (int t = 0; t < threads; t++) {
+    loaders.emplace_back([&, t]() {
+      KeyGen gen(t + 1);
+      char key_buf[KEY_LEN];
+      for (ull i = t; i < (ull)NUM_KEYS; i += threads) {
+        make_key(i, key_buf);
+        size_t len = _case.value_size_.Next(&gen);
+        db->Set(Slice(key_buf, KEY_LEN),
+                Slice((char*)_values.data() + gen.Next() % 4096, len));
+      }
+    });
+  }
+  for (auto& loader : loaders) {
+    loader.join();
+  }
+
+  uint64_t persisted_before = storage->persisted_bytes();
+  vector<Worker> workers(threads);
+  vector<thread> runners;
+  Timer timer;
+  for (int t = 0; t < threads; t++) {
+    runners.emplace_back([&, t]() {
+      Worker& worker = workers[t];
+      worker.get_ns_.reserve(NUM_OPS * _case.read_percent_ / 100 + 1);
+      worker.set_ns_.reserve(NUM_OPS * (100 - _case.read_percent_) / 100 + 1);
+      KeyGen gen((ull)t * 7919 + 17);
+      char key_buf[KEY_LEN];
+      string value;
+      for (int i = 0; i < NUM_OPS; i++) {
+        make_key(gen.Next() % NUM_KEYS, key_buf);
+        Slice key(key_buf, KEY_LEN);
+        if ((int)(gen.Next() % 100) < _case.read_percent_) {
+          Timer op;
+          if (db->Get(key, &value) != Ok) worker.errors_++;
+          worker.get_ns_.push_back(op.ElapsedNs());
+        } else {
+          size_t len = _case.value_size_.Next(&gen);
+          Slice data((char*)_values.data() + gen.Next() % 4096, len);
+          Timer op;
+          if (db->Set(key, data) != Ok) worker.errors_++;
+          worker.set_ns_.push_back(op.ElapsedNs());
+        }
+      }
+    });
+  }
+  for (auto& runner : runners) {
+    runner.join();
+  }
+  double seconds = timer.ElapsedNs() / 1e9;
+  uint64_t persisted = storage->persisted_bytes() - persisted_before;
+
+  vector<float> get_ns;
+  vector<float> set_ns;
+  ull errors = 0;
+  for (auto& worker : workers) {
+    get_ns.insert(get_ns.end(), worker.get_ns_.begin(), worker.get_ns_.end());
+    set_ns.insert(set_ns.end(), worker.set_ns_.begin(), worker.set_ns_.end());
+    errors += worker.errors_;
+  }
+  std::sort(get_ns.begin(), get_ns.end());
+  std::sort(set_ns.begin(), set_ns.end());
+  ull ops = (ull)NUM_OPS * threads;
+  double pool_used = (double)AepMemoryController::global_memory_
+                         ->allocated_size() /
+                     case_config.pool_size_;
+  double live = AepMemoryController::global_memory_->LiveRatio();
+  fprintf(_csv,
+          "%d,%d,%d,%s,%d,%llu,%.3lf,%.0lf,%.0lf,%.0lf,%.0lf,%.0lf,%.0lf,"
+          "%.0lf,%llu,%.1lf,%.4lf,%.4lf,%llu\n",
+          threads, _case.block_size_, _case.segment_blocks_,
+          _case.value_size_.name_.c_str(), _case.read_percent_, ops, seconds,
+          ops / seconds, percentile(get_ns, 0.5), percentile(get_ns, 0.99),
+          percentile(get_ns, 0.999), percentile(set_ns, 0.5),
+          percentile(set_ns, 0.99), percentile(set_ns, 0.999),
+          (ull)persisted,
+          set_ns.empty() ? 0.0 : (double)persisted / set_ns.size(),
+          pool_used, live, errors);
+  fflush(_csv);
+  printf("threads %d block %d segment %d value %s read %d%%: %.2lf Mops/s\n",
+         threads, _case.block_size_, _case.segment_blocks_,
+         _case.value_size_.name_.c_str(), _case.read_percent_,
+         ops / seconds / 1e6);
+  delete db;
+  unlink(POOL_PATH.c_str());
+}
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hf:o:n:s:t:x:y:v:r:p:b:l:w:")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-f :pool file, tmpfs or regular file. \n"
+            "-o :csv file.\n"
+            "-n :keys loaded before each case. \n"
+            "-s :ops per thread.\n"
+            "-t :comma separated thread counts.\n"
+            "-x :comma separated block sizes.\n"
+            "-y :comma separated block per segment.\n"
+            "-v :comma separated value sizes, N or A-B for uniform.\n"
+            "-r :comma separated read percents.\n"
+            "-p :pool size in MB.\n"
+            "-b :storage backend (pmem, mmap, msync, dram).\n"
+            "-l :dram backend write latency in ns.\n"
+            "-w :dram backend bandwidth in MB/s.\n");
+        exit(0);
+      }
+      case 'f':
+        POOL_PATH = optarg;
+        break;
+      case 'o':
+        CSV_PATH = optarg;
+        break;
+      case 'n':
+        NUM_KEYS = atoi(optarg);
+        break;
+      case 's':
+        NUM_OPS = atoi(optarg);
+        break;
+      case 't':
+        THREADS = optarg;
+        break;
+      case 'x':
+        BLOCK_SIZES = optarg;
+        break;
+      case 'y':
+        SEGMENT_BLOCKS = optarg;
+        break;
+      case 'v':
+        VALUE_SIZES = optarg;
+        break;
+      case 'r':
+        READ_PERCENTS = optarg;
+        break;
+      case 'p':
+        config.pool_size_ = atoll(optarg) << 20;
+        break;
+      case 'b':
+        if (strcmp(optarg, "mmap") == 0) {
+          config.storage_ = StorageMmap;
+        } else if (strcmp(optarg, "msync") == 0) {
+          config.storage_ = StorageMmap;
+          config.msync_ = true;
+        } else if (strcmp(optarg, "dram") == 0) {
+          config.storage_ = StorageDram;
+        } else {
+          config.storage_ = StoragePmem;
+        }
+        break;
+      case 'l':
+        config.emulated_write_latency_ns_ = atoll(optarg);
+        break;
+      case 'w':
+        config.emulated_bandwidth_mb_ = atoll(optarg);
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config.pool_size_ = 8192UL << 20;
+  config_parse(argc, argv);
+  config.max_keys_ = std::max(NUM_KEYS * 2, 1024);
+
+  vector<ValueSize> value_sizes;
+  size_t max_len = 0;
+  for (auto& spec : split(VALUE_SIZES)) {
+    value_sizes.push_back(parse_value_size(spec));
+    max_len = std::max(max_len, value_sizes.back().max_);
+  }
+  // values are slices of one random buffer at random offsets
+  vector<char> values(max_len + 4096);
+  KeyGen gen(42);
+  gen.Fill(values.data(), values.size());
+
+  FILE* csv = fopen(CSV_PATH.c_str(), "w");
+  if (csv == nullptr) {
+    perror("open csv file failed");
+    exit(1);
+  }
+  fprintf(csv,
+          "threads,block_size,block_per_segment,value_size,read_percent,ops,"
+          "seconds,ops_per_sec,get_p50_ns,get_p99_ns,get_p999_ns,set_p50_ns,"
+          "set_p99_ns,set_p999_ns,persisted_bytes,persisted_bytes_per_set,"
+          "pool_used,live_ratio,errors\n");
+  for (int block_size : split_ints(BLOCK_SIZES)) {
+    for (int segment_blocks : split_ints(SEGMENT_BLOCKS)) {
+      for (auto& value_size : value_sizes) {
+        for (int read_percent : split_ints(READ_PERCENTS)) {
+          for (int threads : split_ints(THREADS)) {
+            run_case({threads, block_size, segment_blocks, value_size,
+                      read_percent},
+                     values, csv);
+          }
+        }
+      }
+    }
+  }
+  fclose(csv);
+  return 0;
+}
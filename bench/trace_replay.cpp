@@ -0,0 +1,280 @@
+#include <emmintrin.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "nvm_engine.hpp"
+
+using namespace std;
+
+typedef unsigned long long ull;
+
+// Replays a trace written with Config::trace_path_ against a new pool. Every
+// traced thread becomes a thread issuing the same ops in the same order, at
+// the traced times scaled by -s or as fast as it can, so that engine changes
+// and configs can be compared on recorded traffic.
+
+// config for bench
+string TRACE_PATH = "trace.bin";
+string POOL_PATH = "/dev/shm/trace_replay_pool";
+// 1 replays at the traced pace, 2 twice as fast, 0 without waiting
+double SPEED = 0;
+// set the keys a trace reads before writing them first
+bool PRELOAD = false;
+Config config;
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+  double ElapsedNs() const {
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+struct Worker {
+  vector<float> get_ns_;
+  vector<float> set_ns_;
+  ull get_misses_ = 0;
+  ull traced_misses_ = 0;
+  ull errors_ = 0;
+  // how far behind the traced times ops were issued
+  double lag_ns_ = 0;
+};
+
+double percentile(const vector<float>& _sorted, double _p) {
+  if (_sorted.empty()) return 0;
+  size_t i = std::min(_sorted.size() - 1, (size_t)(_sorted.size() * _p));
+  return _sorted[i];
+}
+
+// Records of each traced thread in their order, false if the file is not
+// a whole trace
+bool read_trace(vector<vector<TraceRecord>>* _streams, uint32_t* _flags) {
+  FILE* file = fopen(TRACE_PATH.c_str(), "rb");
+  if (file == nullptr) return false;
+  TraceHeader header;
+  bool ok = fread(&header, sizeof(TraceHeader), 1, file) == 1 &&
+            header.magic_ == TRACE_MAGIC;
+  *_flags = header.flags_;
+  TraceBlockHeader block;
+  while (ok && fread(&block, sizeof(TraceBlockHeader), 1, file) == 1) {
+    if (block.count_ > TRACE_BUFFER_RECORDS) {
+      ok = false;
+      break;
+    }
+    if (block.thread_ >= _streams->size()) _streams->resize(block.thread_ + 1);
+    vector<TraceRecord>& stream = (*_streams)[block.thread_];
+    size_t size = stream.size();
+    stream.resize(size + block.count_);
+    ok = fread(&stream[size], sizeof(TraceRecord), block.count_, file) ==
+         block.count_;
+  }
+  fclose(file);
+  return ok;
+}
+
+void replay(const vector<TraceRecord>& _stream, DB* _db,
+            const vector<char>& _values, Timer* _start, uint64_t _first_ns,
+            Worker* _worker) {
+  _worker->get_ns_.reserve(_stream.size());
+  string value;
+  ull n = 0;
+  for (auto& record : _stream) {
+    Slice key((char*)record.key_, KEY_LEN);
+    if (SPEED > 0) {
+      double due = (record.time_ns_ - _first_ns) / SPEED;
+      double now;
+      while ((now = _start->ElapsedNs()) < due) {
+        if (due - now > 50000) {
+          std::this_thread::sleep_for(
+              std::chrono::nanoseconds((ull)(due - now) - 20000));
+        } else {
+          _mm_pause();
+        }
+      }
+      _worker->lag_ns_ += now - due;
+    }
+    Timer op;
+    if (record.op_ == TraceGet) {
+      Status s = _db->Get(key, &value);
+      _worker->get_ns_.push_back(op.ElapsedNs());
+      if (s == NotFound) {
+        _worker->get_misses_++;
+      } else if (s != Ok) {
+        _worker->errors_++;
+      }
+      if (record.value_len_ == 0) _worker->traced_misses_++;
+    } else {
+      Slice data((char*)_values.data() + (n * 64) % 4096, record.value_len_);
+      Status s = _db->Set(key, data);
+      _worker->set_ns_.push_back(op.ElapsedNs());
+      if (s != Ok) _worker->errors_++;
+    }
+    n++;
+  }
+}
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hi:f:s:lp:b:k:x:y:")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-i :trace file.\n"
+            "-f :pool file, tmpfs or regular file. \n"
+            "-s :speed, 1 for the traced pace, 0 for as fast as possible.\n"
+            "-l :set the keys read before their first write.\n"
+            "-p :pool size in MB.\n"
+            "-b :storage backend (pmem, mmap, msync, dram).\n"
+            "-k :max keys.\n"
+            "-x :block size.\n"
+            "-y :block per segment.\n");
+        exit(0);
+      }
+      case 'i':
+        TRACE_PATH = optarg;
+        break;
+      case 'f':
+        POOL_PATH = optarg;
+        break;
+      case 's':
+        SPEED = atof(optarg);
+        break;
+      case 'l':
+        PRELOAD = true;
+        break;
+      case 'p':
+        config.pool_size_ = atoll(optarg) << 20;
+        break;
+      case 'b':
+        if (strcmp(optarg, "mmap") == 0) {
+          config.storage_ = StorageMmap;
+        } else if (strcmp(optarg, "msync") == 0) {
+          config.storage_ = StorageMmap;
+          config.msync_ = true;
+        } else if (strcmp(optarg, "dram") == 0) {
+          config.storage_ = StorageDram;
+        } else {
+          config.storage_ = StoragePmem;
+        }
+        break;
+      case 'k':
+        config.max_keys_ = atoll(optarg);
+        break;
+      case 'x':
+        config.block_size_ = atoi(optarg);
+        break;
+      case 'y':
+        config.block_per_segment_ = atoi(optarg);
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config_parse(argc, argv);
+  vector<vector<TraceRecord>> streams;
+  uint32_t flags = 0;
+  if (!read_trace(&streams, &flags)) {
+    fprintf(stderr, "read trace %s failed\n", TRACE_PATH.c_str());
+    return 1;
+  }
+  ull ops = 0;
+  uint64_t first_ns = UINT64_MAX;
+  size_t max_len = 0;
+  // the first op on each key, by traced time
+  unordered_map<string, TraceRecord> first;
+  for (auto& stream : streams) {
+    ops += stream.size();
+    for (auto& record : stream) {
+      first_ns = std::min<uint64_t>(first_ns, record.time_ns_);
+      max_len = std::max<size_t>(max_len, record.value_len_);
+      if (!PRELOAD) continue;
+      auto it = first.emplace(string(record.key_, KEY_LEN), record).first;
+      if (record.time_ns_ < it->second.time_ns_) it->second = record;
+    }
+  }
+  printf("%zu threads, %llu ops, %s\n", streams.size(), ops,
+         flags & TRACE_FULL_KEYS ? "keys" : "key hashes");
+
+  vector<char> values(max_len + 4096);
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] = (char)(i * 131 + 7);
+  }
+  unlink(POOL_PATH.c_str());
+  // the replay is not traced again
+  config.trace_path_.clear();
+  DB* db;
+  if (DB::CreateOrOpen(POOL_PATH, &config, &db) != Ok) {
+    fprintf(stderr, "open %s failed\n", POOL_PATH.c_str());
+    return 1;
+  }
+  ull preloaded = 0;
+  for (auto& key : first) {
+    const TraceRecord& record = key.second;
+    if (record.op_ != TraceGet || record.value_len_ == 0) continue;
+    db->Set(Slice((char*)key.first.data(), KEY_LEN),
+            Slice(values.data(), record.value_len_));
+    preloaded++;
+  }
+  if (PRELOAD) printf("preloaded %llu keys\n", preloaded);
+
+  vector<Worker> workers(streams.size());
+  vector<thread> runners;
+  Timer start;
+  for (size_t t = 0; t < streams.size(); t++) {
+    runners.emplace_back([&, t]() {
+      replay(streams[t], db, values, &start, first_ns, &workers[t]);
+    });
+  }
+  for (auto& runner : runners) {
+    runner.join();
+  }
+  double seconds = start.ElapsedNs() / 1e9;
+
+  vector<float> get_ns;
+  vector<float> set_ns;
+  ull get_misses = 0;
+  ull traced_misses = 0;
+  ull errors = 0;
+  double lag_ns = 0;
+  for (auto& worker : workers) {
+    get_ns.insert(get_ns.end(), worker.get_ns_.begin(), worker.get_ns_.end());
+    set_ns.insert(set_ns.end(), worker.set_ns_.begin(), worker.set_ns_.end());
+    get_misses += worker.get_misses_;
+    traced_misses += worker.traced_misses_;
+    errors += worker.errors_;
+    lag_ns += worker.lag_ns_;
+  }
+  std::sort(get_ns.begin(), get_ns.end());
+  std::sort(set_ns.begin(), set_ns.end());
+  printf("replayed in %.3lf s, %.2lf Mops/s\n", seconds, ops / seconds / 1e6);
+  printf("get %zu: p50 %.0lf ns p99 %.0lf ns p999 %.0lf ns, misses %llu "
+         "(traced %llu)\n",
+         get_ns.size(), percentile(get_ns, 0.5), percentile(get_ns, 0.99),
+         percentile(get_ns, 0.999), get_misses, traced_misses);
+  printf("set %zu: p50 %.0lf ns p99 %.0lf ns p999 %.0lf ns\n", set_ns.size(),
+         percentile(set_ns, 0.5), percentile(set_ns, 0.99),
+         percentile(set_ns, 0.999));
+  if (SPEED > 0) {
+    printf("mean lag behind the trace %.0lf ns\n", ops ? lag_ns / ops : 0.0);
+  }
+  printf("errors %llu\n", errors);
+  delete db;
+  unlink(POOL_PATH.c_str());
+  return errors == 0 ? 0 : 1;
+}
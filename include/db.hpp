@@ -1,13 +1,113 @@
 #pragma once
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
-enum Status : unsigned char { Ok, NotFound, IOError, OutOfMemory };
+enum Status : unsigned char {
+  Ok,
+  NotFound,
+  IOError,
+  OutOfMemory,
+  // CompareAndSet found a different value
+  Conflict,
+  InvalidArgument
+};
+
+enum StorageType : unsigned char {
+  StoragePmem,
+  StorageMmap,
+  StorageDram,
+  StorageCrash
+};
+
+class Slice;
+
+// Combine the current value (nullptr if the key is absent) with an operand
+typedef std::function<Status(const Slice* existing, const Slice& operand,
+                             std::string* new_value)>
+    MergeOperator;
 
 typedef struct Config {
-  size_t block_size_ = 64;
+  // smallest block, segments of class i have blocks of block_size_ << i
+  size_t block_size_ = 32;
+  int block_size_classes_ = 4;
   uint64_t block_per_segment_ = 65536;
+  // size of the pool file, 50G by default
+  uint64_t pool_size_ = 53687091200UL;
+  // StoragePmem: libpmem on AEP.
+  // StorageMmap: regular file, flushed with clflush or msync if msync_ set.
+  // StorageDram: volatile DRAM with emulated write latency and bandwidth.
+  // StorageCrash: regular file that only gets what was flushed and drained,
+  // for crash tests, see crash_after_copies_.
+  StorageType storage_ = StoragePmem;
+  bool msync_ = false;
+  uint64_t emulated_write_latency_ns_ = 0;
+  // 0 means unlimited
+  uint64_t emulated_bandwidth_mb_ = 0;
+  // StorageCrash kills the process in the middle of this copy to the pool,
+  // counted from the open, 0 never. crash_seed_ picks how much of it and of
+  // the flushes not drained yet reach the file.
+  uint64_t crash_after_copies_ = 0;
+  uint64_t crash_seed_ = 0;
+  // engine threads serving SetAsync/GetAsync, 0 runs them inline
+  int async_threads_ = 0;
+  // max Sets persisted with one drain by an async worker
+  size_t async_batch_ = 64;
+  // overwrite a value needing the same number of blocks in place, keeping
+  // the previous record as the other slot of an A/B pair
+  bool in_place_update_ = true;
+  // used by DB::Merge
+  MergeOperator merge_operator_ = nullptr;
+  // threads of DB::BulkLoad, 0 uses one per core
+  int bulk_load_threads_ = 0;
+  // changes kept in the pool for DB::GetUpdatesSince, 16 bytes each and
+  // 8 more in DRAM
+  uint64_t change_ring_size_ = 1 << 20;
+  // capacity of the key index, 0 for about 241M keys
+  uint64_t max_keys_ = 0;
+  // 8 byte block indexes per key instead of 4, always used for pools of
+  // 2^31 blocks or more
+  bool wide_block_index_ = false;
+  // DRAM filter answering Gets of absent keys without walking the hash
+  // chain, with counters so that keys can be taken out again
+  bool key_filter_ = false;
+  // false positive rate aimed at with max_keys_ keys, sets the probes
+  double key_filter_fp_rate_ = 0.01;
+  // memory of the filter, 0 sizes it for key_filter_fp_rate_
+  uint64_t key_filter_bytes_ = 0;
+  // values up to this many bytes (at most 64) are also kept in DRAM next
+  // to the key, and the keys move from the pool to DRAM: Gets of them never
+  // read AEP. The pool record stays the durable copy. Takes 8 + len bytes,
+  // rounded up to 8, for each of max_keys_. 0 turns it off.
+  uint32_t inline_value_len_ = 0;
+  // keep the key index in the pool instead of DRAM: a hash table of 256
+  // byte buckets sized for max_keys_ at 3/4 load, about 43 bytes per key.
+  // DRAM no longer grows with the keys and an open walks the index instead
+  // of scanning every record, for one more persist per write. Fixed when
+  // the pool is created; it turns off in place updates and inline values.
+  bool pmem_index_ = false;
+  // threads storing the records of all writers to the pool, 0 lets every
+  // writer store its own. A few of them keep AEP at its peak bandwidth
+  // when many more clients write.
+  int persist_threads_ = 0;
+  // file the coldest values move to when the pool fills up, empty keeps
+  // every value in the pool and fails writes once it is full
+  std::string value_log_path_;
+  // values not read lately are moved out while more than tier_high_ratio_
+  // of the pool is live, until tier_low_ratio_ is
+  double tier_high_ratio_ = 0.9;
+  double tier_low_ratio_ = 0.8;
+  // file each Get and Set is traced to, with its thread, start time, key
+  // and value size, for bench/trace_replay. Empty turns tracing off.
+  std::string trace_path_;
+  // trace whole keys instead of 8 byte hashes of them
+  bool trace_keys_ = false;
 } Config;
 
 class Slice {
@@ -24,7 +124,7 @@ class Slice {
 
   uint64_t size() const { return _size; }
 
-  bool operator==(const Slice& b) {
+  bool operator==(const Slice& b) const {
     return b.size() == this->_size &&
            memcmp(this->_data, b.data(), b.size()) == 0;
   }
@@ -38,6 +138,48 @@ class Slice {
   uint64_t _size;
 };
 
+// Changes read from DB::GetUpdatesSince, in sequence number order
+class UpdateIterator {
+ public:
+  virtual ~UpdateIterator() = default;
+
+  // Move to the next durable change, false if there is none yet. Calling
+  // it again later tails the store.
+  virtual bool Next() = 0;
+
+  // NotFound once changes not read yet were dropped from the ring
+  virtual Status status() const = 0;
+
+  virtual uint64_t sequence() const = 0;
+  virtual const std::string& key() const = 0;
+  virtual const std::string& value() const = 0;
+};
+
+// Streams a value without copying it whole, see DB::GetReader. It holds
+// back the reuse of freed pool blocks while it lives: keep it short, and
+// use and destroy it on the thread that created it.
+class ValueReader {
+ public:
+  virtual ~ValueReader() = default;
+
+  // Length of the whole value
+  virtual uint64_t size() const = 0;
+
+  // Copy up to len bytes from offset to buffer, return how many were copied
+  virtual size_t Read(uint64_t offset, size_t len, char* buffer) = 0;
+
+  // Next piece of the value in order, false after the last one. The slice
+  // points into the pool and stays valid while the reader lives.
+  virtual bool NextChunk(Slice* chunk) = 0;
+};
+
+typedef std::function<void(Status)> SetCallback;
+typedef std::function<void(Status, const std::string&)> GetCallback;
+// Called by DB::ParallelScan from the thread of range part, 0 <= part < n.
+// The slices are only valid during the call.
+typedef std::function<void(int part, const Slice& key, const Slice& value)>
+    ScanCallback;
+
 class DB {
  public:
   /*
@@ -50,18 +192,154 @@ class DB {
   static Status CreateOrOpen(const std::string& _name, Config* _config, DB** _db,
                              FILE* _log_file = nullptr);
 
+  /*
+   *  Rebuild the pool file _name from a full backup followed by the
+   *  incremental backups taken after it, then open it like CreateOrOpen.
+   */
+  static Status Restore(const std::vector<std::string>& _backups,
+                        const std::string& _name, Config* _config, DB** _db,
+                        FILE* _log_file = nullptr);
+
+  /*
+   *  Attach to the pool file _name while another process writes it, for
+   *  Gets only: writes return InvalidArgument. The pool must have been
+   *  created with Config::pmem_index_ on a shared mapping (StoragePmem or
+   *  StorageMmap), the index is read in place and nothing is rebuilt.
+   *  Only value_log_path_ is taken from _config, the rest from the pool,
+   *  which leaves a db opened by this process with its own geometry.
+   */
+  static Status AttachReadOnly(const std::string& _name, Config* _config,
+                               DB** _db);
+
   /*
    *  Get the value of key.
    *  If the key does not exist the NotFound is returned.
    */
   virtual Status Get(const Slice& key, std::string* value) = 0;
 
+  /*
+   *  Open the value of key for reads by range or chunk, for values too
+   *  large to copy at once. NotFound if the key does not exist.
+   */
+  virtual Status GetReader(const Slice& key,
+                           std::unique_ptr<ValueReader>* reader) = 0;
+
   /*
    *  Set key to hold the string value.
-   *  If key already holds a value, it is overwritten.
+   *  If key already holds a value, it is overwritten. Values longer than
+   *  1024 bytes are stored in chunks, up to a few MB depending on the block
+   *  and segment size; InvalidArgument beyond that.
    */
   virtual Status Set(const Slice& key, const Slice& value) = 0;
 
+  /*
+   *  Get n keys at once, statuses and values go to status[i] and
+   *  values[i]. The index and records of all keys are prefetched before
+   *  the first value is copied.
+   */
+  virtual void MultiGet(const Slice* keys, std::string* values,
+                        Status* status, size_t n) = 0;
+
+  /*
+   *  Set n pairs in order, persisting all new records with a single drain.
+   *  A later pair of a key overwrites an earlier one as with Set.
+   */
+  virtual void MultiSet(const Slice* keys, const Slice* values,
+                        Status* status, size_t n) = 0;
+
+  /*
+   *  Queue a Set and return at once. key and value are copied.
+   *  callback runs on an engine thread after the value is durable.
+   */
+  virtual void SetAsync(const Slice& key, const Slice& value,
+                        SetCallback callback) = 0;
+
+  /*
+   *  Queue a Get and return at once. key is copied.
+   *  callback runs on an engine thread with the status and value.
+   */
+  virtual void GetAsync(const Slice& key, GetCallback callback) = 0;
+
+  /*
+   *  Set key to desired only if its value equals *expected, or if the key
+   *  does not exist when expected is nullptr. Conflict is returned otherwise.
+   */
+  virtual Status CompareAndSet(const Slice& key, const Slice* expected,
+                               const Slice& desired) = 0;
+
+  /*
+   *  Append value to the current value of key, creating it if absent.
+   */
+  virtual Status Append(const Slice& key, const Slice& value) = 0;
+
+  /*
+   *  Apply the merge operator from Config to key and operand.
+   */
+  virtual Status Merge(const Slice& key, const Slice& operand) = 0;
+
+  /*
+   *  Load n pairs with several engine threads, meant for populating a db.
+   *  With unique_keys the caller guarantees that no key repeats or exists
+   *  yet: records are written in sequential runs without lookups and linked
+   *  into the index in a final pass. Otherwise a later pair of a key
+   *  overwrites an earlier one as with Set. Returns OutOfMemory when the
+   *  pool or the index fills up, with part of the pairs loaded.
+   */
+  virtual Status BulkLoad(const Slice* keys, const Slice* values, size_t n,
+                          bool unique_keys) = 0;
+
+  /*
+   *  Copy the pool to path while writes go on. Only the segments written
+   *  since the backup that returned since are copied, 0 takes a full one.
+   *  *epoch is the since of the next incremental backup.
+   */
+  virtual Status Backup(const std::string& path, uint64_t since,
+                        uint64_t* epoch) = 0;
+
+  /*
+   *  Iterate the changes with a sequence number after since, 0 for all the
+   *  ring still holds. A change overwritten again is skipped, the later one
+   *  follows. NotFound if changes after since were already dropped.
+   */
+  virtual Status GetUpdatesSince(uint64_t since,
+                                 std::unique_ptr<UpdateIterator>* iter) = 0;
+
+  /*
+   *  Pass every key and its value to callback, from n threads each
+   *  visiting its own range of the pool in order, 0 for one per core.
+   *  Writers are not blocked. A key present for the whole scan is passed
+   *  exactly once, with a value it held at some point during the scan;
+   *  keys first written meanwhile may be left out.
+   */
+  virtual Status ParallelScan(int n, const ScanCallback& callback) = 0;
+
+  /*
+   *  Write every key and value to path with ParallelScan(n), in a compact
+   *  file that Import loads into a db.
+   */
+  Status Export(const std::string& path, int n = 0);
+
+  /*
+   *  Load a file written by Export through BulkLoad. unique_keys as for
+   *  BulkLoad: none of the keys may exist yet.
+   */
+  Status Import(const std::string& path, bool unique_keys);
+
+  std::future<Status> SetAsync(const Slice& key, const Slice& value) {
+    auto promise = std::make_shared<std::promise<Status>>();
+    SetAsync(key, value, [promise](Status s) { promise->set_value(s); });
+    return promise->get_future();
+  }
+
+  std::future<std::pair<Status, std::string>> GetAsync(const Slice& key) {
+    auto promise =
+        std::make_shared<std::promise<std::pair<Status, std::string>>>();
+    GetAsync(key, [promise](Status s, const std::string& value) {
+      promise->set_value(std::make_pair(s, value));
+    });
+    return promise->get_future();
+  }
+
   /*
    * Close the db on exit.
    */
@@ -160,6 +160,7 @@ void config_parse(int argc, char* argv[]) {
         break;
       case 'x':
         config.block_size_ = atoi(optarg);
+        break;
       case 'y':
         config.block_per_segment_ = atoi(optarg);
         break;
@@ -0,0 +1,78 @@
+#include "async_executor.h"
+#include <sched.h>
+#include "nvm_engine.hpp"
+
+AsyncExecutor::AsyncExecutor(HashMap* _hash_map, int _threads, size_t _batch)
+    : hash_map_(_hash_map), batch_(_batch == 0 ? 1 : _batch) {
+  for (int i = 0; i < _threads; i++) {
+    queues_.push_back(new SubmissionQueue<AsyncRequest>());
+  }
+  for (int i = 0; i < _threads; i++) {
+    workers_.emplace_back(&AsyncExecutor::Run, this, queues_[i]);
+  }
+}
+
+AsyncExecutor::~AsyncExecutor() {
+  for (auto queue : queues_) {
+    queue->Stop();
+  }
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  for (auto queue : queues_) {
+    delete queue;
+  }
+}
+
+void AsyncExecutor::Submit(AsyncRequest&& _request) {
+  int cpu = sched_getcpu();
+  if (cpu < 0) {
+    cpu = std::hash<std::thread::id>()(std::this_thread::get_id());
+  }
+  queues_[cpu % queues_.size()]->Push(std::move(_request));
+}
+
+void AsyncExecutor::Run(SubmissionQueue<AsyncRequest>* _queue) {
+  std::vector<AsyncRequest> requests;
+  std::string value;
+  while (_queue->PopAll(&requests)) {
+    // keep queue order: runs of Sets are batched, Gets see earlier Sets
+    size_t i = 0;
+    while (i < requests.size()) {
+      if (requests[i].is_set_) {
+        size_t end = i;
+        while (end < requests.size() && end - i < batch_ &&
+               requests[end].is_set_) {
+          end++;
+        }
+        RunSets(&requests, i, end);
+        i = end;
+      } else {
+        AsyncRequest& request = requests[i];
+        value.clear();
+        Status s = hash_map_->Get(
+            Slice((char*)request.key_.data(), request.key_.size()), &value);
+        request.get_callback_(s, value);
+        i++;
+      }
+    }
+    requests.clear();
+  }
+}
+
+void AsyncExecutor::RunSets(std::vector<AsyncRequest>* _requests,
+                            size_t _begin, size_t _end) {
+  size_t n = _end - _begin;
+  std::vector<Slice> keys(n);
+  std::vector<Slice> values(n);
+  std::vector<Status> status(n);
+  for (size_t i = 0; i < n; i++) {
+    AsyncRequest& request = (*_requests)[_begin + i];
+    keys[i] = Slice((char*)request.key_.data(), request.key_.size());
+    values[i] = Slice((char*)request.value_.data(), request.value_.size());
+  }
+  hash_map_->MultiSet(keys.data(), values.data(), status.data(), n);
+  for (size_t i = 0; i < n; i++) {
+    (*_requests)[_begin + i].set_callback_(status[i]);
+  }
+}
@@ -0,0 +1,76 @@
+//
+// Created by andyshen on 2/9/21.
+//
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/db.hpp"
+
+class HashMap;
+
+struct AsyncRequest {
+  bool is_set_;
+  std::string key_;
+  std::string value_;
+  SetCallback set_callback_;
+  GetCallback get_callback_;
+};
+
+// Requests of one core, drained in batches by its worker
+template <typename T>
+class SubmissionQueue {
+ public:
+  void Push(T&& _request) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.emplace_back(std::move(_request));
+    }
+    cv_.notify_one();
+  }
+
+  // Wait for requests and take all of them, false once stopped and empty
+  bool PopAll(std::vector<T>* _requests) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !requests_.empty() || stop_; });
+    if (requests_.empty()) return false;
+    _requests->swap(requests_);
+    return true;
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<T> requests_;
+  bool stop_ = false;
+};
+
+// One submission queue per worker. Submitters pick the queue of the core
+// they run on, workers persist consecutive Sets with one drain.
+class AsyncExecutor {
+ public:
+  AsyncExecutor(HashMap* _hash_map, int _threads, size_t _batch);
+  ~AsyncExecutor();
+
+  void Submit(AsyncRequest&& _request);
+
+ private:
+  void Run(SubmissionQueue<AsyncRequest>* _queue);
+  void RunSets(std::vector<AsyncRequest>* _requests, size_t _begin,
+               size_t _end);
+
+  HashMap* hash_map_;
+  size_t batch_;
+  std::vector<SubmissionQueue<AsyncRequest>*> queues_;
+  std::vector<std::thread> workers_;
+};
@@ -0,0 +1,101 @@
+#include "backup.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+
+Status PoolBackup::Create(GlobalMemoryController* _global, const char* _base,
+                          const std::string& _path, uint64_t _since,
+                          uint64_t* _epoch) {
+  FILE* file = fopen(_path.c_str(), "wb");
+  if (file == nullptr) return IOError;
+  uint64_t segment_size = GlobalMemoryController::segment_size();
+  BackupHeader header{};
+  header.magic_ = BACKUP_MAGIC;
+  header.since_ = _since;
+  header.pool_size_ = _global->max_segment_index() * segment_size;
+  header.segment_size_ = segment_size;
+  header.meta_size_ = _global->first_segment_index() * segment_size;
+
+  *_epoch = _global->BeginBackup();
+  // the summaries are taken first: the live counts and fill pointers cover
+  // every record live at this point, the only ones sure to be intact
+  bool ok = fwrite(&header, sizeof(BackupHeader), 1, file) == 1 &&
+            fwrite(_base, 1, header.meta_size_, file) == header.meta_size_;
+  SEGMENT_INDEX_TYPE end = _global->segment_index();
+  for (uint64_t segment = _global->first_segment_index();
+       ok && segment < end; segment++) {
+    SegmentSummary* summary = _global->summary(segment);
+    if (summary->state_ != SegmentData || summary->epoch_ < _since) continue;
+    ok = fwrite(&segment, sizeof(uint64_t), 1, file) == 1 &&
+         fwrite(_base + segment * segment_size, 1, segment_size, file) ==
+             segment_size;
+  }
+  ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+  fclose(file);
+  _global->EndBackup();
+  return ok ? Ok : IOError;
+}
+
+static bool WriteAt(int _fd, const char* _buffer, uint64_t _size,
+                    uint64_t _offset) {
+  while (_size > 0) {
+    ssize_t n = pwrite(_fd, _buffer, _size, _offset);
+    if (n <= 0) return false;
+    _buffer += n;
+    _size -= n;
+    _offset += n;
+  }
+  return true;
+}
+
+Status PoolBackup::Restore(const std::vector<std::string>& _backups,
+                           const std::string& _path) {
+  int fd = -1;
+  Status s = Ok;
+  std::vector<char> buffer;
+  for (size_t i = 0; s == Ok && i < _backups.size(); i++) {
+    FILE* file = fopen(_backups[i].c_str(), "rb");
+    if (file == nullptr) {
+      s = IOError;
+      break;
+    }
+    BackupHeader header{};
+    if (fread(&header, sizeof(BackupHeader), 1, file) != 1 ||
+        header.magic_ != BACKUP_MAGIC || (i == 0 && header.since_ != 0)) {
+      // the chain has to start from a full backup
+      fclose(file);
+      s = InvalidArgument;
+      break;
+    }
+    if (fd < 0) {
+      fd = open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+      if (fd < 0 || ftruncate(fd, header.pool_size_) != 0) {
+        fclose(file);
+        s = IOError;
+        break;
+      }
+    }
+    buffer.resize(std::max(header.meta_size_, header.segment_size_));
+    // later metadata replaces the earlier one, segments are taken as is
+    if (fread(buffer.data(), 1, header.meta_size_, file) !=
+            header.meta_size_ ||
+        !WriteAt(fd, buffer.data(), header.meta_size_, 0)) {
+      s = IOError;
+    }
+    uint64_t segment;
+    while (s == Ok && fread(&segment, sizeof(uint64_t), 1, file) == 1) {
+      if (fread(buffer.data(), 1, header.segment_size_, file) !=
+              header.segment_size_ ||
+          !WriteAt(fd, buffer.data(), header.segment_size_,
+                   segment * header.segment_size_)) {
+        s = IOError;
+      }
+    }
+    fclose(file);
+  }
+  if (fd >= 0) {
+    if (fsync(fd) != 0 && s == Ok) s = IOError;
+    close(fd);
+  }
+  return s;
+}
@@ -0,0 +1,37 @@
+//
+// Created by andyshen on 2/12/21.
+//
+#pragma once
+#include <string>
+#include <vector>
+#include "../include/db.hpp"
+#include "memory_cotroller.h"
+
+static const uint64_t BACKUP_MAGIC = 0x31305f50554b4341UL;  // "ACKUP_01"
+
+// A backup file is this header, the pool metadata (header and segment
+// summaries) as of the start of the backup, then the copied segments, each
+// one preceded by its segment index.
+struct BackupHeader {
+  uint64_t magic_;
+  // epoch the backup starts from, 0 for a full one
+  uint64_t since_;
+  uint64_t pool_size_;
+  uint64_t segment_size_;
+  uint64_t meta_size_;
+};
+
+// Online backup of a pool as a sequential stream of segments
+class PoolBackup {
+ public:
+  // Copy the data segments of the pool at _base written in epochs >= _since
+  // to _path, all of them for 0. *_epoch is the _since of the next one.
+  static Status Create(GlobalMemoryController* _global, const char* _base,
+                       const std::string& _path, uint64_t _since,
+                       uint64_t* _epoch);
+
+  // Write a full backup and the incremental ones taken after it, in order,
+  // into the pool file _path. The pool is recovered when it is opened.
+  static Status Restore(const std::vector<std::string>& _backups,
+                        const std::string& _path);
+};
@@ -0,0 +1,51 @@
+//
+// Created by andyshen on 2/18/21.
+//
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include "define.h"
+
+// Block indexes of the keys, 4 bytes each while the pool and the value log
+// stay below 2^31 blocks and 8 bytes otherwise, picked at open. The compact
+// form keeps the value log tag in bit 31.
+class BlockIndexArray {
+ public:
+  // calloc leaves the untouched pages unmapped
+  BlockIndexArray(size_t _size, bool _wide)
+      : wide_(_wide),
+        data_(calloc(_size, _wide ? sizeof(uint64_t) : sizeof(uint32_t))) {}
+  ~BlockIndexArray() { free(data_); }
+
+  BLOCK_INDEX_TYPE get(size_t _i) const {
+    if (wide_) return ((const uint64_t*)data_)[_i];
+    uint32_t value = ((const uint32_t*)data_)[_i];
+    if (value & COMPACT_TAG) {
+      return (value & ~COMPACT_TAG) | VALUE_LOG_TAG;
+    }
+    return value;
+  }
+
+  void set(size_t _i, BLOCK_INDEX_TYPE _block_index) {
+    if (wide_) {
+      ((uint64_t*)data_)[_i] = _block_index;
+      return;
+    }
+    uint32_t value = (uint32_t)(_block_index & ~VALUE_LOG_TAG);
+    if (_block_index & VALUE_LOG_TAG) {
+      value |= COMPACT_TAG;
+    }
+    ((uint32_t*)data_)[_i] = value;
+  }
+
+  // Pool and value log blocks must stay below it
+  BLOCK_INDEX_TYPE limit() const { return wide_ ? VALUE_LOG_TAG : COMPACT_TAG; }
+
+  bool wide() const { return wide_; }
+
+ private:
+  static const uint32_t COMPACT_TAG = 1u << 31;
+
+  bool wide_;
+  void* data_;
+};
@@ -0,0 +1,140 @@
+//
+// Created by andyshen on 2/14/21.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include "define.h"
+#include "storage_backend.h"
+
+// Slot of the change ring
+struct ChangeEntry {
+  std::atomic<uint64_t> sequence_;
+  // INVALID_BLOCK_INDEX for a change lost in a crash
+  BLOCK_INDEX_TYPE block_index_;
+};
+
+// Bounded log of the latest writes, kept in the pool after the segment
+// summaries. The change with sequence number s lives in slot s % capacity,
+// so writers append without coordination and a reader can tell a pending
+// slot from an overwritten one. An entry only points at its record, the
+// reader checks that the record still carries the same sequence number.
+// A slot is only handed to readers once its writer published it, after the
+// record was drained and linked: an entry stored earlier may still belong to
+// a record that is not current yet.
+class ChangeRing {
+ public:
+  enum SlotState { SlotReady, SlotPending, SlotLost };
+
+  ChangeRing(ChangeEntry* _entries, uint64_t _capacity,
+             StorageBackend* _storage)
+      : entries_(_entries),
+        capacity_(_capacity),
+        storage_(_storage),
+        ready_(new std::atomic<uint64_t>[_capacity]()) {}
+
+  ~ChangeRing() { delete[] ready_; }
+
+  // Sequence numbers start from 1, 0 is before the first change
+  uint64_t NextSequence() { return next_sequence_.fetch_add(1); }
+
+  // Log change _sequence written at _block_index, flushed but not drained:
+  // the drain of the record makes both durable
+  void Append(uint64_t _sequence, BLOCK_INDEX_TYPE _block_index) {
+    if (capacity_ == 0) return;
+    ChangeEntry& entry = entries_[_sequence % capacity_];
+    entry.block_index_ = _block_index;
+    entry.sequence_.store(_sequence, std::memory_order_release);
+    storage_->Flush(&entry, sizeof(ChangeEntry));
+  }
+
+  // Hand change _sequence to readers, its record is durable and current
+  void Publish(uint64_t _sequence) {
+    if (capacity_ == 0) return;
+    std::atomic<uint64_t>& ready = ready_[_sequence % capacity_];
+    uint64_t published = ready.load(std::memory_order_relaxed);
+    // a writer a whole ring ahead may have published the slot already
+    while (published < _sequence &&
+           !ready.compare_exchange_weak(published, _sequence,
+                                        std::memory_order_release)) {
+    }
+  }
+
+  // Point change _sequence at the new place of its record if the slot
+  // still holds it. A writer wrapping around the whole ring meanwhile could
+  // lose its entry, the window is a few instructions.
+  void Relocate(uint64_t _sequence, BLOCK_INDEX_TYPE _block_index) {
+    if (capacity_ == 0) return;
+    ChangeEntry& entry = entries_[_sequence % capacity_];
+    if (entry.sequence_.load(std::memory_order_acquire) != _sequence) return;
+    entry.block_index_ = _block_index;
+    storage_->Persist(&entry, sizeof(ChangeEntry));
+  }
+
+  SlotState Get(uint64_t _sequence, BLOCK_INDEX_TYPE* _block_index) const {
+    if (capacity_ == 0) return SlotLost;
+    if (ready_[_sequence % capacity_].load(std::memory_order_acquire) <
+        _sequence) {
+      return SlotPending;
+    }
+    ChangeEntry& entry = entries_[_sequence % capacity_];
+    uint64_t sequence = entry.sequence_.load(std::memory_order_acquire);
+    *_block_index = entry.block_index_;
+    // a later change may have taken the slot meanwhile
+    if (sequence > _sequence ||
+        entry.sequence_.load(std::memory_order_acquire) != _sequence) {
+      return SlotLost;
+    }
+    return SlotReady;
+  }
+
+  void Format() {
+    memset((void*)entries_, 0, capacity_ * sizeof(ChangeEntry));
+    storage_->Persist(entries_, capacity_ * sizeof(ChangeEntry));
+    for (uint64_t i = 0; i < capacity_; i++) {
+      ready_[i] = 0;
+    }
+  }
+
+  // Continue after the highest sequence number found in the records or the
+  // ring. Slots of changes whose record never became durable are marked
+  // lost, readers would wait for them forever. Every other slot is ready,
+  // a record that was never linked is skipped like an overwritten one.
+  void Recover(uint64_t _max_sequence) {
+    for (uint64_t i = 0; i < capacity_; i++) {
+      _max_sequence = std::max<uint64_t>(_max_sequence, entries_[i].sequence_);
+    }
+    uint64_t begin =
+        _max_sequence >= capacity_ ? _max_sequence - capacity_ + 1 : 1;
+    for (uint64_t sequence = begin; sequence <= _max_sequence; sequence++) {
+      ChangeEntry& entry = entries_[sequence % capacity_];
+      if (entry.sequence_ != sequence) {
+        entry.block_index_ = INVALID_BLOCK_INDEX;
+        entry.sequence_ = sequence;
+        storage_->Flush(&entry, sizeof(ChangeEntry));
+      }
+    }
+    storage_->Drain();
+    for (uint64_t i = 0; i < capacity_; i++) {
+      ready_[i] = entries_[i].sequence_.load();
+    }
+    next_sequence_ = _max_sequence + 1;
+  }
+
+  // Oldest sequence number the ring may still hold
+  uint64_t Oldest() const {
+    uint64_t next = next_sequence_.load();
+    return next > capacity_ ? next - capacity_ : 1;
+  }
+
+  uint64_t capacity() const { return capacity_; }
+
+ private:
+  ChangeEntry* entries_;
+  uint64_t capacity_;
+  StorageBackend* storage_;
+  // highest sequence number published in each slot, in DRAM
+  std::atomic<uint64_t>* ready_;
+  std::atomic<uint64_t> next_sequence_{1};
+};
@@ -5,7 +5,7 @@
 typedef uint32_t HASH_VALUE;
 typedef uint16_t VALUE_LEN_TYPE;
 typedef uint32_t KEY_INDEX_TYPE;
-typedef uint32_t BLOCK_INDEX_TYPE;
+typedef uint64_t BLOCK_INDEX_TYPE;
 typedef uint16_t VERSION_TYPE;
 typedef uint32_t SEGMENT_INDEX_TYPE;
 
@@ -14,23 +14,39 @@ static const uint8_t KEY_LEN = 16;
 static const uint8_t VAL_SIZE_LEN = 2;
 static const uint8_t CHECK_SUM_LEN = 4;
 static const uint8_t VERSION_LEN = 2;
-static const uint8_t RECORD_FIX_LEN = 24;
+static const uint8_t SEQUENCE_LEN = 8;
+static const uint8_t RECORD_FIX_LEN = 32;
 static const uint16_t VALUE_MAX_LEN = 1024;
 
+// segments of block_size_ << i for i < Config::block_size_classes_
+static const int MAX_SIZE_CLASSES = 8;
+
+// block indexes with this bit set are offsets into the value log, in blocks
+static const BLOCK_INDEX_TYPE VALUE_LOG_TAG = 1ULL << 63;
+static const BLOCK_INDEX_TYPE INVALID_BLOCK_INDEX = UINT64_MAX;
+// records moved to the value log with one write
+static const uint32_t MIGRATE_BATCH = 1024;
+
+// blocks by which a segment summary's fill pointer and live count run ahead
+static const uint32_t SUMMARY_CHUNK = 1024;
+// freed runs a thread collects before it tries to move the epoch on
+static const uint32_t LIMBO_BATCH = 64;
+
 // offset of record
 static const uint8_t VAL_SIZE_OFFSET = 0;
 static const uint8_t KEY_OFFSET = VAL_SIZE_LEN;
 static const uint8_t VERSION_OFFSET = KEY_OFFSET + KEY_LEN;
-static const uint8_t VALUE_OFFSET = VERSION_OFFSET + VERSION_LEN;
+static const uint8_t SEQUENCE_OFFSET = VERSION_OFFSET + VERSION_LEN;
+static const uint8_t VALUE_OFFSET = SEQUENCE_OFFSET + SEQUENCE_LEN;
 
-// aep setting
-static Config CONFIG;
-//static const uint64_t FILE_SIZE = 68719476736UL;
-static const uint64_t FILE_SIZE = 53687091200UL;
+// aep setting, the pool size lives in CONFIG.pool_size_
+extern Config CONFIG;
 
-// hash setting
-static const uint32_t KV_NUM_MAX = 16 * 24 * 1024 * 1024 * 0.60;
+// hash setting, Config::max_keys_ of 0 takes DEFAULT_MAX_KEYS and the
+// buckets scale with it from HASH_MAP_SIZE
+static const uint32_t DEFAULT_MAX_KEYS = 16 * 24 * 1024 * 1024 * 0.60;
 static const uint32_t HASH_MAP_SIZE = 100000000;
+static const uint32_t LOCK_NUM = 1 << 16;
 
 // log
-thread_local int wt = 0;
+extern thread_local int wt;
@@ -0,0 +1,96 @@
+//
+// Created by andyshen on 2/19/21.
+//
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Epoch based reclamation of pool blocks. A reader announces the global
+// epoch while it may copy from a block whose index it loaded, see
+// EpochGuard. Blocks unlinked in epoch e are handed out again once the
+// global epoch reached e + 2: the epoch only moves on when every reader
+// inside announced the current one, so no reader of e is left by then.
+class EpochManager {
+ public:
+  // Announcement of a thread, slots of exited threads are reused
+  struct Slot {
+    std::atomic<uint64_t> epoch_{QUIESCENT};
+    std::atomic<bool> in_use_{true};
+    // guards of the thread nested in each other
+    int depth_ = 0;
+  };
+
+  static uint64_t current() { return epoch_.load(std::memory_order_acquire); }
+
+  // Whether blocks unlinked in _epoch may be reused
+  static bool Safe(uint64_t _epoch) { return current() >= _epoch + 2; }
+
+  // Move the epoch on if every reader inside announced it, return the
+  // epoch. Gives up at once while another thread is at it.
+  static uint64_t TryAdvance() {
+    uint64_t epoch = current();
+    {
+      std::unique_lock<std::mutex> lock(registry_mutex_, std::try_to_lock);
+      if (!lock.owns_lock()) return epoch;
+      for (auto slot : registry_) {
+        uint64_t announced = slot->epoch_.load(std::memory_order_acquire);
+        if (announced != QUIESCENT && announced != epoch) return epoch;
+      }
+    }
+    epoch_.compare_exchange_strong(epoch, epoch + 1);
+    return current();
+  }
+
+  // Wait until blocks unlinked in _epoch may be reused
+  static void Synchronize(uint64_t _epoch) {
+    while (!Safe(_epoch)) {
+      TryAdvance();
+      std::this_thread::yield();
+    }
+  }
+
+  static void Enter(Slot* _slot) {
+    if (_slot->depth_++ > 0) return;
+    // the announcement has to be visible before any block index is loaded
+    _slot->epoch_.store(current(), std::memory_order_seq_cst);
+  }
+
+  static void Exit(Slot* _slot) {
+    if (--_slot->depth_ > 0) return;
+    _slot->epoch_.store(QUIESCENT, std::memory_order_release);
+  }
+
+  // Take a free slot or register a new one, for a thread's first guard
+  static Slot* Acquire() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (auto slot : registry_) {
+      if (!slot->in_use_.load() && !slot->in_use_.exchange(true)) {
+        return slot;
+      }
+    }
+    registry_.push_back(new Slot);
+    return registry_.back();
+  }
+
+  static void Release(Slot* _slot) { _slot->in_use_.store(false); }
+
+ private:
+  static const uint64_t QUIESCENT = 0;
+
+  // starts at 1, 0 marks a thread outside
+  static std::atomic<uint64_t> epoch_;
+  static std::mutex registry_mutex_;
+  static std::vector<Slot*> registry_;
+};
+
+extern thread_local EpochManager::Slot* thread_local_epoch_slot;
+
+// Keeps the blocks of the indexes loaded meanwhile from being reused
+class EpochGuard {
+ public:
+  EpochGuard() { EpochManager::Enter(thread_local_epoch_slot); }
+  ~EpochGuard() { EpochManager::Exit(thread_local_epoch_slot); }
+};
@@ -0,0 +1,114 @@
+#include "export.h"
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "define.h"
+
+// a scan thread writes its pairs out in pieces of about this size
+static const size_t EXPORT_BUFFER_SIZE = 4 << 20;
+// pairs handed to one BulkLoad
+static const size_t IMPORT_BATCH = 1 << 16;
+static const size_t IMPORT_BATCH_SIZE = 64 << 20;
+
+Status PoolExport::Write(DB* _db, const std::string& _path, int _threads) {
+  if (_threads <= 0) {
+    _threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  FILE* file = fopen(_path.c_str(), "wb");
+  if (file == nullptr) return IOError;
+  ExportHeader header{EXPORT_MAGIC, 0};
+  bool ok = fwrite(&header, sizeof(ExportHeader), 1, file) == 1;
+  std::mutex mutex;
+  std::atomic<uint64_t> count{0};
+  std::vector<std::vector<char>> buffers(_threads);
+  auto flush = [&](std::vector<char>* _buffer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ok = fwrite(_buffer->data(), 1, _buffer->size(), file) ==
+             _buffer->size() &&
+         ok;
+    _buffer->clear();
+  };
+  Status s = _db->ParallelScan(
+      _threads, [&](int _part, const Slice& _key, const Slice& _value) {
+        std::vector<char>& buffer = buffers[_part];
+        uint32_t len = _value.size();
+        buffer.insert(buffer.end(), _key.data(), _key.data() + KEY_LEN);
+        buffer.insert(buffer.end(), (const char*)&len,
+                      (const char*)&len + sizeof(uint32_t));
+        buffer.insert(buffer.end(), _value.data(), _value.data() + len);
+        count.fetch_add(1, std::memory_order_relaxed);
+        if (buffer.size() >= EXPORT_BUFFER_SIZE) flush(&buffer);
+      });
+  for (auto& buffer : buffers) {
+    if (!buffer.empty()) flush(&buffer);
+  }
+  // the count is known last
+  header.count_ = count.load();
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(ExportHeader), 1, file) == 1;
+  ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+  fclose(file);
+  if (s != Ok) return s;
+  return ok ? Ok : IOError;
+}
+
+Status PoolExport::Read(DB* _db, const std::string& _path,
+                        bool _unique_keys) {
+  FILE* file = fopen(_path.c_str(), "rb");
+  if (file == nullptr) return IOError;
+  ExportHeader header;
+  if (fread(&header, sizeof(ExportHeader), 1, file) != 1 ||
+      header.magic_ != EXPORT_MAGIC) {
+    fclose(file);
+    return InvalidArgument;
+  }
+  Status s = Ok;
+  std::vector<char> data;
+  // offset of the key and of the value, and the value length, of each pair
+  struct Pair {
+    size_t key_;
+    size_t value_;
+    uint32_t len_;
+  };
+  std::vector<Pair> pairs;
+  std::vector<Slice> keys;
+  std::vector<Slice> values;
+  auto load = [&]() {
+    keys.clear();
+    values.clear();
+    for (auto& pair : pairs) {
+      keys.emplace_back(data.data() + pair.key_, KEY_LEN);
+      values.emplace_back(data.data() + pair.value_, pair.len_);
+    }
+    s = _db->BulkLoad(keys.data(), values.data(), pairs.size(), _unique_keys);
+    pairs.clear();
+    data.clear();
+  };
+  for (uint64_t i = 0; s == Ok && i < header.count_; i++) {
+    char key[KEY_LEN];
+    uint32_t len;
+    if (fread(key, KEY_LEN, 1, file) != 1 ||
+        fread(&len, sizeof(uint32_t), 1, file) != 1) {
+      s = IOError;
+      break;
+    }
+    size_t key_offset = data.size();
+    data.insert(data.end(), key, key + KEY_LEN);
+    data.resize(data.size() + len);
+    if (len > 0 && fread(&data[key_offset + KEY_LEN], len, 1, file) != 1) {
+      s = IOError;
+      break;
+    }
+    pairs.push_back({key_offset, key_offset + KEY_LEN, len});
+    if (pairs.size() == IMPORT_BATCH || data.size() >= IMPORT_BATCH_SIZE) {
+      load();
+    }
+  }
+  if (s == Ok && !pairs.empty()) load();
+  fclose(file);
+  return s;
+}
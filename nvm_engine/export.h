@@ -0,0 +1,25 @@
+//
+// Created by andyshen on 2/26/21.
+//
+#pragma once
+#include <string>
+#include "../include/db.hpp"
+
+static const uint64_t EXPORT_MAGIC = 0x31305f54524f5058UL;  // "XPORT_01"
+
+// An export file is this header followed by count_ pairs, each one the key,
+// the value length as a uint32_t and the value. Pairs are in no order.
+struct ExportHeader {
+  uint64_t magic_;
+  uint64_t count_;
+};
+
+// Dump of the live pairs of a db, see DB::Export and DB::Import
+class PoolExport {
+ public:
+  // Scan _db with _threads threads into _path
+  static Status Write(DB* _db, const std::string& _path, int _threads);
+
+  // BulkLoad the pairs in _path into _db, a batch at a time
+  static Status Read(DB* _db, const std::string& _path, bool _unique_keys);
+};
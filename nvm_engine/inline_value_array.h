@@ -0,0 +1,79 @@
+//
+// Created by andyshen on 2/22/21.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include <string>
+
+// DRAM copies of the values up to max_len() bytes, one slot per key:
+// a sequence number, the length + 1 (0 for none) and the value. A writer,
+// holding the key's lock, makes the sequence odd while it copies; readers
+// retry while it is odd or moved during their copy. The pool record stays
+// the durable one, the copies are rebuilt by recovery.
+class InlineValueArray {
+ public:
+  static const uint32_t MAX_LEN = 64;
+
+  // calloc leaves the untouched pages unmapped
+  InlineValueArray(size_t _size, uint32_t _max_len)
+      : max_len_(std::min(_max_len, (uint32_t)MAX_LEN)),
+        stride_((HEADER_LEN + max_len_ + 7) / 8 * 8),
+        data_((char*)calloc(_size, stride_)) {}
+  ~InlineValueArray() { free(data_); }
+
+  uint32_t max_len() const { return max_len_; }
+
+  // Keep a copy of _value for key _i, or drop it if _value is too long
+  void set(size_t _i, const char* _value, size_t _len) {
+    char* slot = data_ + _i * stride_;
+    std::atomic<uint32_t>* sequence = (std::atomic<uint32_t>*)slot;
+    uint32_t begin = sequence->load(std::memory_order_relaxed);
+    sequence->store(begin + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    uint16_t stored = _len <= max_len_ ? _len + 1 : 0;
+    memcpy(slot + LEN_OFFSET, &stored, sizeof(uint16_t));
+    if (stored != 0) {
+      memcpy(slot + HEADER_LEN, _value, _len);
+    }
+    sequence->store(begin + 2, std::memory_order_release);
+  }
+
+  // Copy the value of key _i, false if there is no copy
+  bool get(size_t _i, std::string* _value) const {
+    const char* slot = data_ + _i * stride_;
+    const std::atomic<uint32_t>* sequence =
+        (const std::atomic<uint32_t>*)slot;
+    char buffer[MAX_LEN];
+    for (;;) {
+      uint32_t begin = sequence->load(std::memory_order_acquire);
+      if (begin & 1) {
+        _mm_pause();
+        continue;
+      }
+      uint16_t stored;
+      memcpy(&stored, slot + LEN_OFFSET, sizeof(uint16_t));
+      if (stored != 0) {
+        memcpy(buffer, slot + HEADER_LEN,
+               std::min<uint32_t>(stored - 1, max_len_));
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence->load(std::memory_order_relaxed) != begin) continue;
+      if (stored == 0) return false;
+      _value->assign(buffer, stored - 1);
+      return true;
+    }
+  }
+
+ private:
+  static const size_t LEN_OFFSET = sizeof(uint32_t);
+  static const size_t HEADER_LEN = 8;
+
+  uint32_t max_len_;
+  size_t stride_;
+  char* data_;
+};
@@ -0,0 +1,113 @@
+//
+// Created by andyshen on 2/20/21.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "define.h"
+
+// Counting blocked Bloom filter over the keys, kept in DRAM. All probes of
+// a key fall into one cache line of 128 4-bit counters, so a Get of an
+// absent key costs one cache miss instead of a walk over the key buffer.
+// Counters saturate at 15 and then stay, Remove never makes a key that is
+// still present look absent.
+class KeyFilter {
+ public:
+  // _bytes of counters, _fp_rate picks the probes per key
+  KeyFilter(uint64_t _bytes, double _fp_rate) {
+    blocks_ = std::max<uint64_t>(1, _bytes / BLOCK_SIZE);
+    // the constants are copied, binding them to a reference needs a
+    // definition outside the class
+    probes_ = std::min((int)MAX_PROBES,
+                       std::max(1, (int)std::lround(-std::log2(_fp_rate))));
+    // calloc leaves the untouched pages unmapped
+    words_ = (std::atomic<uint64_t>*)calloc(blocks_ * WORDS_PER_BLOCK,
+                                            sizeof(uint64_t));
+  }
+  ~KeyFilter() { free(words_); }
+
+  // Bytes for _keys keys at _fp_rate: 1.44 log2(1 / _fp_rate) counters
+  // per key, plus room for the skew between blocks that grows with them
+  static uint64_t Size(uint64_t _keys, double _fp_rate) {
+    double bits = -std::log2(_fp_rate);
+    double counters = (1 + 0.05 * bits) * 1.44 * bits * _keys;
+    return std::max((uint64_t)BLOCK_SIZE, (uint64_t)(counters / 2));
+  }
+
+  void Add(const char* _key) { Update(_key, 1); }
+
+  void Remove(const char* _key) { Update(_key, -1); }
+
+  // False if the key was never added, or removed as often as added
+  bool MayContain(const char* _key) const {
+    uint64_t hash = Hash(_key);
+    const std::atomic<uint64_t>* block = Block(hash);
+    uint32_t position = (uint32_t)hash;
+    uint32_t step = (uint32_t)(hash >> 16) | 1;
+    for (int i = 0; i < probes_; i++, position += step) {
+      uint32_t counter = position % COUNTERS_PER_BLOCK;
+      uint64_t word = block[counter / 16].load(std::memory_order_acquire);
+      if (((word >> (counter % 16 * 4)) & 0xf) == 0) return false;
+    }
+    return true;
+  }
+
+  uint64_t size() const { return blocks_ * BLOCK_SIZE; }
+
+  int probes() const { return probes_; }
+
+ private:
+  static const uint64_t BLOCK_SIZE = 64;
+  static const uint32_t WORDS_PER_BLOCK = BLOCK_SIZE / sizeof(uint64_t);
+  static const uint32_t COUNTERS_PER_BLOCK = BLOCK_SIZE * 2;
+  static const int MAX_PROBES = 16;
+
+  // Mix the two halves of the key, DJBHash picks the bucket already
+  static uint64_t Hash(const char* _key) {
+    uint64_t low, high;
+    memcpy(&low, _key, sizeof(uint64_t));
+    memcpy(&high, _key + sizeof(uint64_t), sizeof(uint64_t));
+    uint64_t hash = low ^ (high * 0x9e3779b97f4a7c15ULL);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  std::atomic<uint64_t>* Block(uint64_t _hash) const {
+    return words_ + (_hash >> 32) % blocks_ * WORDS_PER_BLOCK;
+  }
+
+  void Update(const char* _key, int _delta) {
+    uint64_t hash = Hash(_key);
+    std::atomic<uint64_t>* block = Block(hash);
+    uint32_t position = (uint32_t)hash;
+    uint32_t step = (uint32_t)(hash >> 16) | 1;
+    for (int i = 0; i < probes_; i++, position += step) {
+      uint32_t counter = position % COUNTERS_PER_BLOCK;
+      std::atomic<uint64_t>& word = block[counter / 16];
+      int shift = counter % 16 * 4;
+      uint64_t old_word = word.load(std::memory_order_relaxed);
+      uint64_t new_word;
+      do {
+        uint64_t value = (old_word >> shift) & 0xf;
+        // a saturated counter lost track of its keys
+        if (value == 0xf || (value == 0 && _delta < 0)) break;
+        new_word = _delta > 0 ? old_word + (1ULL << shift)
+                              : old_word - (1ULL << shift);
+      } while (!word.compare_exchange_weak(old_word, new_word,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+    }
+  }
+
+  uint64_t blocks_;
+  int probes_;
+  std::atomic<uint64_t>* words_;
+};
@@ -0,0 +1,98 @@
+//
+// Created by andyshen on 2/21/21.
+//
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "define.h"
+
+// Values longer than VALUE_MAX_LEN are cut into chunks, each in its own run
+// of blocks behind a ChunkHeader. The record of the key holds a manifest
+// listing the chunks instead of the value, LARGE_VALUE_FLAG in its length
+// field tells it apart. Chunks are drained before the manifest is written,
+// recovery keeps the chunks a live manifest points at and frees the rest.
+
+// First bytes of a chunk, mark_ sits where the value length of a record is
+struct ChunkHeader {
+  VALUE_LEN_TYPE mark_;
+  uint16_t pad_;
+  uint32_t blocks_;
+  uint32_t len_;
+  // of the fields above
+  HASH_VALUE check_sum_;
+};
+
+// Value of a manifest record, followed by count_ block indexes
+struct ManifestHeader {
+  uint64_t size_;
+  uint32_t chunk_len_;
+  uint32_t count_;
+};
+
+static const VALUE_LEN_TYPE LARGE_VALUE_FLAG = 0x8000;
+static const VALUE_LEN_TYPE CHUNK_MARK = 0xffff;
+// chunks take at most this much, and at most half a segment
+static const uint32_t LARGE_CHUNK_LEN = 64 * 1024;
+static const uint32_t MAX_CHUNKS =
+    (VALUE_MAX_LEN - sizeof(ManifestHeader)) / sizeof(BLOCK_INDEX_TYPE);
+
+class LargeValue {
+ public:
+  // Blocks of a full chunk, aligned to the largest size class
+  static uint32_t ChunkBlocks() {
+    uint64_t blocks = std::min<uint64_t>(LARGE_CHUNK_LEN / CONFIG.block_size_,
+                                         CONFIG.block_per_segment_ / 2);
+    uint64_t align = 1ULL << (CONFIG.block_size_classes_ - 1);
+    return std::max<uint64_t>(align, blocks / align * align);
+  }
+
+  // Value bytes of a full chunk
+  static uint32_t ChunkLen() {
+    return ChunkBlocks() * CONFIG.block_size_ - sizeof(ChunkHeader);
+  }
+
+  static uint64_t MaxLen() { return (uint64_t)MAX_CHUNKS * ChunkLen(); }
+
+  // Blocks of a chunk holding _len value bytes
+  static uint32_t BlockNum(uint32_t _len) {
+    return (sizeof(ChunkHeader) + _len + CONFIG.block_size_ - 1) /
+           CONFIG.block_size_;
+  }
+
+  // Length field of the record of a _size byte value
+  static VALUE_LEN_TYPE StoredLen(size_t _size) {
+    if (_size <= VALUE_MAX_LEN) return _size;
+    uint32_t count = (_size + ChunkLen() - 1) / ChunkLen();
+    return LARGE_VALUE_FLAG |
+           (sizeof(ManifestHeader) + count * sizeof(BLOCK_INDEX_TYPE));
+  }
+
+  static bool IsLarge(VALUE_LEN_TYPE _stored_len) {
+    return (_stored_len & LARGE_VALUE_FLAG) != 0;
+  }
+
+  // Bytes following the record header, the manifest for a large value
+  static VALUE_LEN_TYPE RecordLen(VALUE_LEN_TYPE _stored_len) {
+    return _stored_len & ~LARGE_VALUE_FLAG;
+  }
+
+  static BLOCK_INDEX_TYPE Chunk(const char* _manifest, uint32_t _i) {
+    BLOCK_INDEX_TYPE block_index;
+    memcpy(&block_index,
+           _manifest + sizeof(ManifestHeader) + _i * sizeof(BLOCK_INDEX_TYPE),
+           sizeof(BLOCK_INDEX_TYPE));
+    return block_index;
+  }
+
+  static HASH_VALUE HeaderCheckSum(const ChunkHeader& _header);
+
+  // The chunk header at _base is intact
+  static bool ValidChunk(const char* _base) {
+    ChunkHeader header;
+    memcpy(&header, _base, sizeof(ChunkHeader));
+    return header.mark_ == CHUNK_MARK && header.blocks_ > 0 &&
+           header.check_sum_ == HeaderCheckSum(header);
+  }
+};
@@ -2,16 +2,25 @@
 // Created by andyshen on 1/15/21.
 //
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <map>
 #include <mutex>
 #include <stack>
 #include <thread>
-#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "change_ring.h"
 #include "define.h"
+#include "epoch.h"
+#include "pmem_index.h"
+#include "storage_backend.h"
 
 using std::stack;
-using std::unordered_map;
 
-std::mutex mt;
+extern std::mutex mt;
 class FreeList {
  public:
   FreeList() = default;
@@ -28,56 +37,240 @@ class FreeList {
   virtual void MergeTo(FreeList* src_free_list, FreeList* dst_free_list) = 0;
 };
 
+// Keeps runs by size, a miss is served by splitting a larger run
 class SimpleFreeList : public FreeList {
  public:
   void Push(BLOCK_INDEX_TYPE _block_index, size_t _size) override {
-    auto iter = map_.find(_size);
-    if (iter == map_.cend()) {
-      std::vector<BLOCK_INDEX_TYPE> temp;
-      temp.emplace_back(_block_index);
-    } else {
-      iter->second.push(_block_index);
-    }
+    if (_size == 0) return;
+    map_[_size].push(_block_index);
   }
 
   bool Pop(BLOCK_INDEX_TYPE* _block_index, size_t _size) override {
-    auto iter = map_.find(_size);
-    if (iter == map_.cend()) {
+    auto iter = map_.lower_bound(_size);
+    if (iter == map_.end()) {
       return false;
-    } else {
-      if (iter->second.empty()) {
-        return false;
-      }
-      *_block_index = iter->second.top();
-      iter->second.pop();
     }
+    *_block_index = iter->second.top();
+    iter->second.pop();
+    size_t rest = iter->first - _size;
+    if (iter->second.empty()) {
+      map_.erase(iter);
+    }
+    Push(*_block_index + _size, rest);
     return true;
   }
 
-  void MergeTo(FreeList* src_free_list, FreeList* dst_free_list) override {}
+  // Move every run of src_free_list, a SimpleFreeList, to dst_free_list
+  void MergeTo(FreeList* src_free_list, FreeList* dst_free_list) override {
+    auto src = static_cast<SimpleFreeList*>(src_free_list);
+    for (auto& runs : src->map_) {
+      for (; !runs.second.empty(); runs.second.pop()) {
+        dst_free_list->Push(runs.second.top(), runs.first);
+      }
+    }
+    src->map_.clear();
+  }
+
+  bool empty() const { return map_.empty(); }
 
  private:
-  unordered_map<uint8_t, stack<BLOCK_INDEX_TYPE>> map_;
+  std::map<size_t, stack<BLOCK_INDEX_TYPE>> map_;
+};
+
+static const uint64_t POOL_MAGIC = 0x31305f564b504541UL;  // "AEPKV_01"
+// 2: sequence number in the record header, change ring
+static const uint32_t POOL_LAYOUT_VERSION = 2;
+
+// First cache line of the pool
+struct PoolHeader {
+  uint64_t magic_;
+  uint32_t layout_version_;
+  uint32_t block_size_;
+  uint64_t block_per_segment_;
+  uint64_t pool_size_;
+  // epoch of the writes since the last backup started
+  uint64_t epoch_;
+  uint64_t change_ring_size_;
+  // segments of block_size_ << i for i < size_classes_, 0 for 1
+  uint32_t size_classes_;
+  uint32_t pad_;
+  // buckets of the persistent index after the change ring, 0 for none
+  uint64_t index_buckets_;
+};
+
+enum SegmentState : uint32_t { SegmentFree = 0, SegmentData, SegmentIndex };
+
+// Persistent summary of a segment, one cache line each after the header.
+// fill_ and live_ are raised in chunks ahead of use and flushed before the
+// drain of the records they cover, so they are never below the truth:
+// recovery skips a segment whose live_ is 0 and only scans up to fill_.
+// Frees lower live_ without a flush, a lost decrement only costs a scan.
+// epoch_ is the pool epoch of the last write, for incremental backups.
+// Records of a segment are aligned to its block size, block_size_ <<
+// size_class_, that is the step of the recovery scan.
+struct SegmentSummary {
+  std::atomic<uint32_t> state_;
+  uint32_t owner_;
+  std::atomic<uint64_t> fill_;
+  std::atomic<uint64_t> live_;
+  std::atomic<uint64_t> epoch_;
+  uint32_t size_class_;
+  char pad_[28];
 };
 
 class GlobalMemoryController {
  public:
-  explicit GlobalMemoryController(size_t _file_size) {
+  GlobalMemoryController(char* _base, StorageBackend* _storage,
+                         size_t _file_size)
+      : storage_(_storage) {
     max_segment_index_ =
         _file_size / (CONFIG.block_per_segment_ * CONFIG.block_size_);
-    global_free_list_ = new SimpleFreeList();
+    for (int i = 0; i < CONFIG.block_size_classes_; i++) {
+      global_free_lists_[i] = new SimpleFreeList();
+    }
+    header_ = (PoolHeader*)_base;
+    summaries_ = (SegmentSummary*)(_base + sizeof(PoolHeader));
+    uint64_t ring_offset =
+        sizeof(PoolHeader) + max_segment_index_ * sizeof(SegmentSummary);
+    change_ring_ = new ChangeRing((ChangeEntry*)(_base + ring_offset),
+                                  CONFIG.change_ring_size_, _storage);
+    uint64_t meta_size =
+        ring_offset + CONFIG.change_ring_size_ * sizeof(ChangeEntry);
+    if (CONFIG.pmem_index_) {
+      uint64_t index_offset = IndexOffset(_file_size, CONFIG);
+      pmem_index_ = new PmemIndex(
+          (PmemSlot*)(_base + index_offset),
+          CONFIG.max_keys_ / PMEM_SLOTS_PER_BUCKET, _storage);
+      meta_size = index_offset + pmem_index_->size();
+    }
+    first_segment_index_ = (meta_size + segment_size() - 1) / segment_size();
+    segment_index_ = first_segment_index_;
   }
-  ~GlobalMemoryController() { delete global_free_list_; }
-  bool Allocate(BLOCK_INDEX_TYPE* _block_index) {
-    SEGMENT_INDEX_TYPE segment_index = this->segment_index_.fetch_add(1);
-    if (segment_index >= max_segment_index_) {
-      if (!free_segments.empty()) {
-        *_block_index = free_segments.top() * CONFIG.block_per_segment_;
-        free_segments.pop();
-        return true;
+  ~GlobalMemoryController() {
+    for (auto free_list : global_free_lists_) {
+      delete free_list;
+    }
+    delete change_ring_;
+    delete pmem_index_;
+  }
+
+  // Offset of the persistent index in a pool file of _file_size bytes with
+  // the geometry of _config, the first bucket boundary after the change ring
+  static uint64_t IndexOffset(uint64_t _file_size, const Config& _config) {
+    uint64_t segments =
+        _file_size / (_config.block_per_segment_ * _config.block_size_);
+    uint64_t ring_end = sizeof(PoolHeader) +
+                        segments * sizeof(SegmentSummary) +
+                        _config.change_ring_size_ * sizeof(ChangeEntry);
+    return (ring_end + PMEM_BUCKET_SIZE - 1) / PMEM_BUCKET_SIZE *
+           PMEM_BUCKET_SIZE;
+  }
+
+  // Take the geometry of an existing pool, false for a new one
+  static bool ReadPoolHeader(const char* _base, Config* _config) {
+    auto header = (const PoolHeader*)_base;
+    if (header->magic_ != POOL_MAGIC) {
+      return false;
+    }
+    if (header->layout_version_ != POOL_LAYOUT_VERSION) {
+      // never format over a pool written by another version
+      std::cout << "Unsupported pool layout version "
+                << header->layout_version_ << std::endl;
+      exit(1);
+    }
+    _config->block_size_ = header->block_size_;
+    _config->block_per_segment_ = header->block_per_segment_;
+    _config->change_ring_size_ = header->change_ring_size_;
+    _config->block_size_classes_ = std::max(1u, header->size_classes_);
+    _config->pool_size_ = std::min(_config->pool_size_, header->pool_size_);
+    // the kind of key index is fixed when the pool is created
+    _config->pmem_index_ = header->index_buckets_ > 0;
+    if (_config->pmem_index_) {
+      _config->max_keys_ = header->index_buckets_ * PMEM_SLOTS_PER_BUCKET;
+    }
+    return true;
+  }
+
+  // Format a new pool, or skip the segments in use by an existing one.
+  // Returns true if the pool holds data to recover.
+  bool Open(bool _exists) {
+    if (!_exists) {
+      memset((void*)summaries_, 0,
+             max_segment_index_ * sizeof(SegmentSummary));
+      storage_->Persist(summaries_,
+                        max_segment_index_ * sizeof(SegmentSummary));
+      change_ring_->Format();
+      if (pmem_index_ != nullptr) {
+        pmem_index_->Format();
       }
+      PoolHeader header{};
+      header.magic_ = POOL_MAGIC;
+      header.layout_version_ = POOL_LAYOUT_VERSION;
+      header.block_size_ = CONFIG.block_size_;
+      header.block_per_segment_ = CONFIG.block_per_segment_;
+      header.pool_size_ = max_segment_index_ * segment_size();
+      header.change_ring_size_ = CONFIG.change_ring_size_;
+      header.size_classes_ = CONFIG.block_size_classes_;
+      header.index_buckets_ =
+          pmem_index_ != nullptr ? pmem_index_->buckets() : 0;
+      storage_->MemcpyPersist(header_, &header, sizeof(PoolHeader));
       return false;
     }
+    epoch_ = header_->epoch_;
+    SEGMENT_INDEX_TYPE end = first_segment_index_;
+    for (SEGMENT_INDEX_TYPE i = first_segment_index_; i < max_segment_index_;
+         i++) {
+      // big arrays only live as long as the process
+      if (summaries_[i].state_ == SegmentIndex) {
+        SetState(i, SegmentFree);
+      }
+      if (summaries_[i].state_ == SegmentData) {
+        end = i + 1;
+      }
+    }
+    for (SEGMENT_INDEX_TYPE i = first_segment_index_; i < end; i++) {
+      if (summaries_[i].state_ == SegmentFree) {
+        free_segments.push(i);
+      }
+    }
+    segment_index_ = end;
+    return end > first_segment_index_;
+  }
+
+  // Size class of a record taking _blocks blocks: the largest block size
+  // dividing it, records are aligned to it without padding
+  static int SizeClass(size_t _blocks) {
+    int size_class = CONFIG.block_size_classes_ - 1;
+    while (size_class > 0 && _blocks % (1u << size_class) != 0) {
+      size_class--;
+    }
+    return size_class;
+  }
+
+  bool Allocate(BLOCK_INDEX_TYPE* _block_index, int _size_class) {
+    // stop at the end, a full pool is asked again on every miss
+    SEGMENT_INDEX_TYPE segment_index = segment_index_.load();
+    while (segment_index < max_segment_index_ &&
+           !segment_index_.compare_exchange_weak(segment_index,
+                                                 segment_index + 1)) {
+    }
+    if (segment_index >= max_segment_index_) {
+      std::lock_guard<std::mutex> lock(free_segments_mutex_);
+      if (free_segments.empty()) {
+        return false;
+      }
+      segment_index = free_segments.top();
+      free_segments.pop();
+    }
+    SegmentSummary& summary = summaries_[segment_index];
+    summary.owner_ =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    summary.fill_ = 0;
+    summary.live_ = 0;
+    summary.epoch_ = epoch_.load();
+    summary.size_class_ = _size_class;
+    storage_->Flush(&summary, sizeof(SegmentSummary));
+    SetState(segment_index, SegmentData);
     *_block_index = segment_index * CONFIG.block_per_segment_;
     /*std::cout << "Thread id:" << std::this_thread::get_id()
               << " allocate an segment, block index:" << *_block_index
@@ -86,33 +279,206 @@ class GlobalMemoryController {
   }
 
   bool New(BLOCK_INDEX_TYPE* _block_index, size_t _buffer_size) {
-    size_t num_segments =
-        (_buffer_size + CONFIG.block_per_segment_ * CONFIG.block_size_ - 1) /
-        (CONFIG.block_per_segment_ * CONFIG.block_size_);
-    SEGMENT_INDEX_TYPE segment_index = segment_index_.fetch_add(num_segments);
-    if (segment_index >= max_segment_index_) {
-      std::cout << "OOM: Failed to new a big array." << std::endl;
-      return false;
+    size_t num_segments = (_buffer_size + segment_size() - 1) / segment_size();
+    // don't consume segments on failure, small pools fall back to DRAM
+    SEGMENT_INDEX_TYPE segment_index = segment_index_.load();
+    do {
+      if (segment_index + num_segments > max_segment_index_) {
+        std::cout << "OOM: Failed to new a big array." << std::endl;
+        return false;
+      }
+    } while (!segment_index_.compare_exchange_weak(
+        segment_index, segment_index + num_segments));
+    for (size_t i = 0; i < num_segments; i++) {
+      SetState(segment_index + i, SegmentIndex);
     }
     *_block_index = segment_index * CONFIG.block_per_segment_;
     return true;
   }
 
   void Delete(BLOCK_INDEX_TYPE block_index_, size_t _buffer_size) {
-    size_t num_segments =
-        (_buffer_size + CONFIG.block_per_segment_ * CONFIG.block_size_ - 1) /
-        (CONFIG.block_per_segment_ * CONFIG.block_size_);
+    size_t num_segments = (_buffer_size + segment_size() - 1) / segment_size();
+    SEGMENT_INDEX_TYPE segment_index = block_index_ / CONFIG.block_per_segment_;
+    std::lock_guard<std::mutex> lock(free_segments_mutex_);
     for (unsigned int i = 0; i < num_segments; i++) {
-      free_segments.push(block_index_ + i * CONFIG.block_per_segment_);
+      SetState(segment_index + i, SegmentFree);
+      free_segments.push(segment_index + i);
+    }
+  }
+
+  // Bookkeeping of AepMemoryController, flushed but not drained: the drain
+  // of the record written into the blocks makes it durable. The fill
+  // pointer is raised to at least _fill_end, a block index.
+  void OnNew(BLOCK_INDEX_TYPE _block_index, size_t _live,
+             BLOCK_INDEX_TYPE _fill_end) {
+    SEGMENT_INDEX_TYPE segment_index = _block_index / CONFIG.block_per_segment_;
+    SegmentSummary& summary = summaries_[segment_index];
+    if (_live > 0) {
+      summary.live_.fetch_add(_live, std::memory_order_relaxed);
+    }
+    uint64_t fill = _fill_end - segment_index * CONFIG.block_per_segment_;
+    uint64_t old_fill = summary.fill_.load(std::memory_order_relaxed);
+    while (old_fill < fill &&
+           !summary.fill_.compare_exchange_weak(old_fill, fill)) {
+    }
+    summary.epoch_.store(epoch_.load(), std::memory_order_relaxed);
+    storage_->Flush(&summary, sizeof(SegmentSummary));
+  }
+
+  // Note a write to the segment of _block_index in the current epoch. The
+  // summary is flushed once per segment and epoch, the drain of the record
+  // makes it durable.
+  void Touch(BLOCK_INDEX_TYPE _block_index) {
+    SegmentSummary& summary =
+        summaries_[_block_index / CONFIG.block_per_segment_];
+    uint64_t epoch = epoch_.load();
+    if (summary.epoch_.load(std::memory_order_relaxed) != epoch) {
+      summary.epoch_.store(epoch, std::memory_order_relaxed);
+      storage_->Flush(&summary, sizeof(SegmentSummary));
+    }
+  }
+
+  // Start a backup and return the epoch it covers: writes of that epoch may
+  // race with the copy, so the next incremental backup starts from it.
+  // Until EndBackup freed blocks are held back and records are not
+  // overwritten in place, the records live now stay intact for the copy.
+  uint64_t BeginBackup() {
+    backup_running_ = true;
+    uint64_t epoch = epoch_.fetch_add(1);
+    header_->epoch_ = epoch + 1;
+    storage_->Persist(&header_->epoch_, sizeof(uint64_t));
+    return epoch;
+  }
+
+  void EndBackup() {
+    std::lock_guard<std::mutex> lock(deferred_mutex_);
+    backup_running_ = false;
+    std::lock_guard<std::mutex> free_list_lock(mt);
+    for (auto& run : deferred_) {
+      global_free_lists_[SizeClass(run.second)]->Push(run.first, run.second);
+    }
+    deferred_.clear();
+  }
+
+  bool backup_running() const { return backup_running_.load(); }
+
+  // Keep a free back while a backup runs, false if there is none
+  bool DeferFree(BLOCK_INDEX_TYPE _block_index, size_t _size) {
+    if (!backup_running_.load()) return false;
+    std::lock_guard<std::mutex> lock(deferred_mutex_);
+    if (!backup_running_.load()) return false;
+    deferred_.emplace_back(_block_index, _size);
+    return true;
+  }
+
+  void OnDelete(BLOCK_INDEX_TYPE _block_index, size_t _size) {
+    SegmentSummary& summary =
+        summaries_[_block_index / CONFIG.block_per_segment_];
+    summary.live_.fetch_sub(_size, std::memory_order_relaxed);
+  }
+
+  // Free blocks on behalf of a thread that did not allocate them, e.g.
+  // recovery: they go to the shared list of their class
+  void Free(BLOCK_INDEX_TYPE _block_index, size_t _size) {
+    OnDelete(_block_index, _size);
+    Release(_block_index, _size);
+  }
+
+  // Put blocks already taken off the live count on the shared list
+  void Release(BLOCK_INDEX_TYPE _block_index, size_t _size) {
+    if (DeferFree(_block_index, _size)) return;
+    std::lock_guard<std::mutex> lock(mt);
+    global_free_lists_[SizeClass(_size)]->Push(_block_index, _size);
+  }
+
+  // Share of the blocks available to records that hold live ones. Live
+  // counts run ahead by a chunk per writer, so it is slightly high.
+  double LiveRatio() const {
+    uint64_t live = 0;
+    uint64_t index_segments = 0;
+    SEGMENT_INDEX_TYPE end = segment_index();
+    for (SEGMENT_INDEX_TYPE i = first_segment_index_; i < end; i++) {
+      if (summaries_[i].state_ == SegmentData) {
+        live += summaries_[i].live_.load(std::memory_order_relaxed);
+      } else if (summaries_[i].state_ == SegmentIndex) {
+        index_segments++;
+      }
     }
+    uint64_t segments =
+        max_segment_index_ - first_segment_index_ - index_segments;
+    if (segments == 0) return 1.0;
+    return (double)live / (segments * CONFIG.block_per_segment_);
+  }
+
+  // Called by recovery once a segment has been scanned
+  void RecoverSegment(SEGMENT_INDEX_TYPE _segment_index, uint64_t _live) {
+    SegmentSummary& summary = summaries_[_segment_index];
+    summary.live_ = _live;
+    storage_->Persist(&summary, sizeof(SegmentSummary));
+    if (_live == 0) {
+      std::lock_guard<std::mutex> lock(free_segments_mutex_);
+      SetState(_segment_index, SegmentFree);
+      free_segments.push(_segment_index);
+    }
+  }
+
+  FreeList* free_list(int _size_class) const {
+    return global_free_lists_[_size_class];
+  }
+
+  ChangeRing* change_ring() const { return change_ring_; }
+
+  StorageBackend* storage() const { return storage_; }
+
+  // nullptr unless the pool keeps its key index, see Config::pmem_index_
+  PmemIndex* pmem_index() const { return pmem_index_; }
+
+  SegmentSummary* summary(SEGMENT_INDEX_TYPE _segment_index) const {
+    return summaries_ + _segment_index;
+  }
+
+  SEGMENT_INDEX_TYPE first_segment_index() const {
+    return first_segment_index_;
+  }
+
+  SEGMENT_INDEX_TYPE max_segment_index() const { return max_segment_index_; }
+
+  SEGMENT_INDEX_TYPE segment_index() const {
+    return std::min<SEGMENT_INDEX_TYPE>(segment_index_.load(),
+                                        max_segment_index_);
+  }
+
+  static uint64_t segment_size() {
+    return CONFIG.block_per_segment_ * CONFIG.block_size_;
+  }
+
+  // bytes of the file handed out as segments so far
+  uint64_t allocated_size() const {
+    return (uint64_t)segment_index() * segment_size();
   }
-  FreeList* free_list() const { return global_free_list_; }
 
  private:
+  void SetState(SEGMENT_INDEX_TYPE _segment_index, SegmentState _state) {
+    summaries_[_segment_index].state_ = _state;
+    storage_->Persist(summaries_ + _segment_index, sizeof(SegmentSummary));
+  }
+
+  StorageBackend* storage_;
+  PoolHeader* header_;
+  SegmentSummary* summaries_;
+  SEGMENT_INDEX_TYPE first_segment_index_;
   SEGMENT_INDEX_TYPE max_segment_index_;
   std::atomic<SEGMENT_INDEX_TYPE> segment_index_{0};
-  FreeList* global_free_list_;
-  std::stack<BLOCK_INDEX_TYPE> free_segments;
+  // one per size class, blocks of a class stay aligned to it
+  FreeList* global_free_lists_[MAX_SIZE_CLASSES] = {};
+  ChangeRing* change_ring_;
+  PmemIndex* pmem_index_ = nullptr;
+  std::mutex free_segments_mutex_;
+  std::stack<SEGMENT_INDEX_TYPE> free_segments;
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<bool> backup_running_{false};
+  std::mutex deferred_mutex_;
+  std::vector<std::pair<BLOCK_INDEX_TYPE, size_t>> deferred_;
 };
 
 class AepMemoryController {
@@ -120,47 +486,251 @@ class AepMemoryController {
   static GlobalMemoryController* global_memory_;
 
  public:
+  // Segments are taken on the first allocation of each size class
   explicit AepMemoryController() {
-    if (!global_memory_->Allocate(&current_block_index_)) {
-      std::cout << "Out of memory when allocate segment." << std::endl;
-      abort();
+    for (int i = 0; i < CONFIG.block_size_classes_; i++) {
+      classes_[i].free_list_ = new SimpleFreeList();
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    registry_.push_back(this);
+  }
+  // Runs at thread exit, what the thread still holds goes back to the pool
+  ~AepMemoryController() {
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex_);
+      registry_.erase(std::find(registry_.begin(), registry_.end(), this));
+    }
+    if (global_memory_ != nullptr) {
+      // readers finish within a grace period, the limbo is freed after it
+      if (!limbo_.empty()) {
+        EpochManager::Synchronize(limbo_.back().epoch_);
+      }
+      ReturnAll();
+    }
+    for (auto& size_class : classes_) {
+      delete size_class.free_list_;
     }
-    max_block_index_ = current_block_index_ + CONFIG.block_per_segment_;
-    free_list_ = new SimpleFreeList();
   }
-  ~AepMemoryController() { delete free_list_; }
+
+  // Forget the segments of every controller, for a pool being closed. The
+  // engine is quiet, a controller still in use is waited for.
+  static void ResetAll() {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (auto controller : registry_) {
+      controller->Lock();
+      controller->limbo_.clear();
+      for (auto& state : controller->classes_) {
+        delete state.free_list_;
+        state = SizeClassState();
+      }
+      for (int i = 0; i < CONFIG.block_size_classes_; i++) {
+        controller->classes_[i].free_list_ = new SimpleFreeList();
+      }
+      controller->Unlock();
+    }
+  }
+
+  // The pool ran out: take the segment tails and free blocks of the
+  // controllers not in an allocation right now. False if none had any.
+  static bool ReclaimIdle() {
+    bool reclaimed = false;
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (auto controller : registry_) {
+      // the caller holds its own controller, so it is skipped as well
+      if (controller->in_use_.exchange(true, std::memory_order_acquire)) {
+        continue;
+      }
+      reclaimed = controller->ReturnAll() || reclaimed;
+      controller->Unlock();
+    }
+    return reclaimed;
+  }
 
   bool New(int _size, BLOCK_INDEX_TYPE* _index) {
-    if (current_block_index_ + _size > max_block_index_) {
-      if (free_list_->Pop(_index, _size)) {
+    Lock();
+    bool ok = NewLocked(_size, _index);
+    Unlock();
+    return ok;
+  }
+
+  // Free blocks unlinked from the index. A reader may still copy from
+  // them, they wait in limbo until the epoch moved on twice.
+  bool Delete(int _size, BLOCK_INDEX_TYPE _index) {
+    global_memory_->OnDelete(_index, _size);
+    Retire(_index, _size, false);
+    return true;
+  }
+
+  // Like Delete, but the blocks go to the shared lists afterwards, for a
+  // thread that does not allocate such as the value log migrator
+  void DeleteShared(int _size, BLOCK_INDEX_TYPE _index) {
+    global_memory_->OnDelete(_index, _size);
+    Retire(_index, _size, true);
+  }
+
+ private:
+  bool NewLocked(int _size, BLOCK_INDEX_TYPE* _index) {
+    int size_class = GlobalMemoryController::SizeClass(_size);
+    SizeClassState& state = classes_[size_class];
+    if (state.current_block_index_ + _size > state.max_block_index_) {
+      if (state.free_list_->Pop(_index, _size)) {
+        global_memory_->OnNew(*_index, _size, *_index + _size);
         return true;
       }
       // recycle rest block.
-      size_t size = max_block_index_ - current_block_index_;
-      free_list_->Push(current_block_index_, size);
-      if (global_memory_->Allocate(&current_block_index_)) {
-        max_block_index_ = current_block_index_ + CONFIG.block_per_segment_;
-        *_index = current_block_index_;
-        current_block_index_ += _size;
-        return true;
+      ReturnCredit(&state);
+      state.free_list_->Push(
+          state.current_block_index_,
+          state.max_block_index_ - state.current_block_index_);
+      state.current_block_index_ = state.max_block_index_;
+      if (global_memory_->Allocate(&state.current_block_index_, size_class)) {
+        state.max_block_index_ =
+            state.current_block_index_ + CONFIG.block_per_segment_;
+        state.fill_mark_ = state.current_block_index_;
+        return Bump(&state, _size, _index);
       } else {
-        auto free_list = global_memory_->free_list();
-        return free_list->ThreadSafePop(_index, _size);
+        // the limbo may be past its grace period by now
+        EpochManager::TryAdvance();
+        if (Collect() && state.free_list_->Pop(_index, _size)) {
+          global_memory_->OnNew(*_index, _size, *_index + _size);
+          return true;
+        }
+        auto free_list = global_memory_->free_list(size_class);
+        if (free_list->ThreadSafePop(_index, _size) ||
+            (ReclaimIdle() && free_list->ThreadSafePop(_index, _size))) {
+          global_memory_->OnNew(*_index, _size, *_index + _size);
+          return true;
+        }
+        return false;
       }
     } else {
-      *_index = current_block_index_;
-      current_block_index_ += _size;
-      return true;
+      return Bump(&state, _size, _index);
     }
   };
 
-  bool Delete(int _size, BLOCK_INDEX_TYPE _index) {
-    free_list_->Push(_index, _size);
+  // Blocks waiting for the readers that may still copy from them
+  struct Retired {
+    BLOCK_INDEX_TYPE index_;
+    size_t size_;
+    uint64_t epoch_;
+    bool shared_;
+  };
+
+  void Retire(BLOCK_INDEX_TYPE _index, size_t _size, bool _shared) {
+    // the store unlinking the blocks has to be visible before the epoch is
+    // read, or a reader announcing the next one could still find them
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Lock();
+    limbo_.push_back({_index, _size, EpochManager::current(), _shared});
+    if (limbo_.size() >= LIMBO_BATCH) {
+      EpochManager::TryAdvance();
+      Collect();
+    }
+    Unlock();
+  }
+
+  // Free the blocks whose grace period is over, false if there were none.
+  // Called with the controller locked.
+  bool Collect() {
+    bool freed = false;
+    while (!limbo_.empty() && EpochManager::Safe(limbo_.front().epoch_)) {
+      Retired& retired = limbo_.front();
+      if (retired.shared_) {
+        global_memory_->Release(retired.index_, retired.size_);
+      } else if (!global_memory_->DeferFree(retired.index_, retired.size_)) {
+        classes_[GlobalMemoryController::SizeClass(retired.size_)]
+            .free_list_->Push(retired.index_, retired.size_);
+      }
+      limbo_.pop_front();
+      freed = true;
+    }
+    return freed;
+  }
+
+  // Current segment and free blocks of one size class
+  struct SizeClassState {
+    FreeList* free_list_ = nullptr;
+    BLOCK_INDEX_TYPE fill_mark_ = 0;
+    size_t live_credit_ = 0;
+    BLOCK_INDEX_TYPE max_block_index_ = 0;
+    BLOCK_INDEX_TYPE current_block_index_ = 0;
+  };
+
+  // Take _size blocks from the segment, raising the persistent fill pointer
+  // and live count a chunk at a time
+  bool Bump(SizeClassState* _state, int _size, BLOCK_INDEX_TYPE* _index) {
+    *_index = _state->current_block_index_;
+    _state->current_block_index_ += _size;
+    size_t live = 0;
+    BLOCK_INDEX_TYPE fill_end = *_index;
+    if (_state->live_credit_ < (size_t)_size) {
+      live = SUMMARY_CHUNK;
+      _state->live_credit_ += SUMMARY_CHUNK;
+    }
+    _state->live_credit_ -= _size;
+    if (_state->current_block_index_ > _state->fill_mark_) {
+      _state->fill_mark_ = std::min<BLOCK_INDEX_TYPE>(
+          _state->current_block_index_ + SUMMARY_CHUNK,
+          _state->max_block_index_);
+      fill_end = _state->fill_mark_;
+    }
+    if (live > 0 || fill_end > *_index) {
+      global_memory_->OnNew(*_index, live, fill_end);
+    } else {
+      global_memory_->Touch(*_index);
+    }
     return true;
   }
 
- private:
-  FreeList* free_list_;
-  BLOCK_INDEX_TYPE max_block_index_;
-  BLOCK_INDEX_TYPE current_block_index_;
-};
\ No newline at end of file
+  // Take back the live count raised ahead for the rest of the segment,
+  // before the segment is left
+  void ReturnCredit(SizeClassState* _state) {
+    if (_state->live_credit_ > 0) {
+      global_memory_->OnDelete(_state->max_block_index_ - 1,
+                               _state->live_credit_);
+      _state->live_credit_ = 0;
+    }
+  }
+
+  // Owner and reclaimers exclude each other, the owner's flag is only
+  // contended while the pool is out of space
+  void Lock() {
+    while (in_use_.exchange(true, std::memory_order_acquire)) {
+      _mm_pause();
+    }
+  }
+
+  void Unlock() { in_use_.store(false, std::memory_order_release); }
+
+  // Give the unused tail of each current segment, with its share of the
+  // live count raised ahead, and the free blocks to the global free lists
+  bool ReturnAll() {
+    bool returned = Collect();
+    std::lock_guard<std::mutex> lock(mt);
+    for (int i = 0; i < CONFIG.block_size_classes_; i++) {
+      SizeClassState& state = classes_[i];
+      FreeList* free_list = global_memory_->free_list(i);
+      ReturnCredit(&state);
+      if (state.current_block_index_ < state.max_block_index_) {
+        free_list->Push(state.current_block_index_,
+                        state.max_block_index_ - state.current_block_index_);
+        returned = true;
+      }
+      state.current_block_index_ = state.max_block_index_ = 0;
+      state.fill_mark_ = 0;
+      auto local = static_cast<SimpleFreeList*>(state.free_list_);
+      if (!local->empty()) {
+        local->MergeTo(local, free_list);
+        returned = true;
+      }
+    }
+    return returned;
+  }
+
+  SizeClassState classes_[MAX_SIZE_CLASSES];
+  std::deque<Retired> limbo_;
+  std::atomic<bool> in_use_{false};
+
+  static std::mutex registry_mutex_;
+  static std::vector<AepMemoryController*> registry_;
+};
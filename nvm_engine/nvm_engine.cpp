@@ -6,165 +6,1200 @@
 FILE* NvmEngine::LOG;
 typedef hash_func pFunction;
 
+Config CONFIG;
+std::mutex mt;
+thread_local int wt = 0;
 
+GlobalMemoryController* AepMemoryController::global_memory_ = nullptr;
+std::mutex AepMemoryController::registry_mutex_;
+std::vector<AepMemoryController*> AepMemoryController::registry_;
+
+std::atomic<uint64_t> EpochManager::epoch_{1};
+std::mutex EpochManager::registry_mutex_;
+std::vector<EpochManager::Slot*> EpochManager::registry_;
+
+// Owns the controller of a thread, destroyed when the thread exits
+struct ThreadController {
+  AepMemoryController* controller_ = new AepMemoryController;
+  ~ThreadController() { delete controller_; }
+};
+thread_local ThreadController thread_controller;
+thread_local AepMemoryController* thread_local_aep_controller =
+    thread_controller.controller_;
+
+// Holds the epoch slot of a thread, given back when the thread exits
+struct ThreadEpochSlot {
+  EpochManager::Slot* slot_ = EpochManager::Acquire();
+  ~ThreadEpochSlot() { EpochManager::Release(slot_); }
+};
+thread_local ThreadEpochSlot thread_epoch_slot;
+thread_local EpochManager::Slot* thread_local_epoch_slot =
+    thread_epoch_slot.slot_;
+
+thread_local size_t write_count_{0};
 
 Status DB::CreateOrOpen(const std::string& _name, Config* _config, DB** _db,
                         FILE* _log_file) {
   return NvmEngine::CreateOrOpen(_name, _config, _db, _log_file);
 }
 
+Status DB::Restore(const std::vector<std::string>& _backups,
+                   const std::string& _name, Config* _config, DB** _db,
+                   FILE* _log_file) {
+  Status s = PoolBackup::Restore(_backups, _name);
+  if (s != Ok) return s;
+  return NvmEngine::CreateOrOpen(_name, _config, _db, _log_file);
+}
+
+Status DB::AttachReadOnly(const std::string& _name, Config* _config,
+                          DB** _db) {
+  return PoolReader::Attach(_name, _config, _db);
+}
+
+Status DB::Export(const std::string& _path, int _n) {
+  return PoolExport::Write(this, _path, _n);
+}
+
+Status DB::Import(const std::string& _path, bool _unique_keys) {
+  return PoolExport::Read(this, _path, _unique_keys);
+}
+
 DB::~DB() = default;
 
+HASH_VALUE LargeValue::HeaderCheckSum(const ChunkHeader& _header) {
+  return DJBHash((const char*)&_header, offsetof(ChunkHeader, check_sum_));
+}
+
 BLOCK_INDEX_TYPE KVStore::GetBlockIndex(const Slice& _value) {
-  VALUE_LEN_TYPE data_len = _value.size();
-  int block_num =
-      (RECORD_FIX_LEN + data_len + CONFIG.block_size_ - 1) / CONFIG.block_size_;
-  BLOCK_INDEX_TYPE block_index = UINT32_MAX;
+  int block_num = BlockNum(_value.size());
+  BLOCK_INDEX_TYPE block_index = INVALID_BLOCK_INDEX;
   if (!thread_local_aep_controller->New(block_num, &block_index)) {
-    block_index = UINT32_MAX;
-    std::cout << "Out of memory, when allocate an aep space." << std::endl;
-    abort();
+    return INVALID_BLOCK_INDEX;
   }
   return block_index;
 }
 
-void KVStore::Write(const Slice& _key, const Slice& _value, Entry* _entry) {
-  BLOCK_INDEX_TYPE bi = GetBlockIndex(_value);
-  size_t record_len = RECORD_FIX_LEN + _value.size();
-  char record_buffer[record_len];
-  VALUE_LEN_TYPE len = _value.size();
-  VERSION_TYPE version = 0;
-  memcpy(record_buffer + KEY_OFFSET, _key.data(), KEY_LEN);
-  memcpy(record_buffer + VAL_SIZE_OFFSET, &len, VAL_SIZE_LEN);
-  memcpy(record_buffer + VERSION_OFFSET, &version, VERSION_LEN);
-  memcpy(record_buffer + VALUE_OFFSET, _value.data(), _value.size());
-  HASH_VALUE check_sum = DJBHash(record_buffer, record_len - CHECK_SUM_LEN);
-  memcpy(record_buffer + record_len - CHECK_SUM_LEN, &check_sum, CHECK_SUM_LEN);
-  // memcpy to pmem and flush
-
-  pmem_memcpy_persist(this->aep_base_ + (uint64_t)bi * CONFIG.block_size_,
-                      record_buffer, record_len);
-
-  // Update key buffer in memory
-  KEY_INDEX_TYPE index;
-  index = current_key_index_.fetch_add(1);
-  auto oldHead = _entry->SetHead(index);
-  next_[index] = oldHead;
-  block_index_[index] = bi;
-  val_lens_[index] = _value.size();
-  memcpy(key_buffer_ + index * KEY_LEN, _key.data(), KEY_LEN);
-}
-
-void KVStore::Update(const Slice& _key, const Slice& _value,
-                     KEY_INDEX_TYPE _index) {
-  VALUE_LEN_TYPE data_len = val_lens_[_index];
-  BLOCK_INDEX_TYPE old_block_index = block_index_[_index];
-
-  BLOCK_INDEX_TYPE new_block_index = GetBlockIndex(_value);
+BLOCK_INDEX_TYPE KVStore::WriteLogRecord(char* _record, size_t _record_len) {
+  size_t size = (size_t)BlockNum(_record_len - RECORD_FIX_LEN) *
+                CONFIG.block_size_;
+  memset(_record + _record_len, 0, size - _record_len);
+  uint64_t offset;
+  if (!value_log_->Append(_record, size, &offset)) {
+    return INVALID_BLOCK_INDEX;
+  }
+  uint64_t block = offset / CONFIG.block_size_;
+  // block indexes of the value log have one bit less
+  if (block + BlockNum(_record_len - RECORD_FIX_LEN) >= block_limit()) {
+    return INVALID_BLOCK_INDEX;
+  }
+  return VALUE_LOG_TAG | (BLOCK_INDEX_TYPE)block;
+}
+
+Status KVStore::ReadLog(BLOCK_INDEX_TYPE _block_index, string* _value) {
+  char buffer[RECORD_FIX_LEN + VALUE_MAX_LEN];
+  // one read for the header and the value, short only at the end of the log
+  ssize_t n =
+      value_log_->Read(LogOffset(_block_index), buffer, sizeof(buffer));
+  if (n < VALUE_OFFSET) return IOError;
+  size_t len = *(VALUE_LEN_TYPE*)buffer;
+  if (len > VALUE_MAX_LEN || (size_t)n < VALUE_OFFSET + len) return IOError;
+  _value->assign(buffer + VALUE_OFFSET, len);
+  return Ok;
+}
+
+size_t KVStore::EncodeRecord(const Slice& _key, const Slice& _value,
+                             VERSION_TYPE _version, uint64_t _sequence,
+                             char* _buffer, VALUE_LEN_TYPE _flags) {
   size_t record_len = RECORD_FIX_LEN + _value.size();
-  char record_buffer[record_len];
-  VALUE_LEN_TYPE len = _value.size();
-  VERSION_TYPE version = versions_[_index] + 1;
-  memcpy(record_buffer + KEY_OFFSET, _key.data(), KEY_LEN);
-  memcpy(record_buffer + VAL_SIZE_OFFSET, &len, VAL_SIZE_LEN);
-  memcpy(record_buffer + VERSION_OFFSET, &version, VERSION_LEN);
-  memcpy(record_buffer + VALUE_OFFSET, _value.data(), _value.size());
-  HASH_VALUE check_sum = DJBHash(record_buffer, record_len - CHECK_SUM_LEN);
-  memcpy(record_buffer + record_len - CHECK_SUM_LEN, &check_sum, CHECK_SUM_LEN);
-  // memcpy to pmem and flush
-  pmem_memcpy_persist(
-      this->aep_base_ + (uint64_t)new_block_index * CONFIG.block_size_,
-      record_buffer, record_len);
-
-  block_index_[_index] = new_block_index;
-  versions_[_index] = version;
-  val_lens_[_index] = _value.size();
+  VALUE_LEN_TYPE len = _value.size() | _flags;
+  memcpy(_buffer + KEY_OFFSET, _key.data(), KEY_LEN);
+  memcpy(_buffer + VAL_SIZE_OFFSET, &len, VAL_SIZE_LEN);
+  memcpy(_buffer + VERSION_OFFSET, &_version, VERSION_LEN);
+  memcpy(_buffer + SEQUENCE_OFFSET, &_sequence, SEQUENCE_LEN);
+  memcpy(_buffer + VALUE_OFFSET, _value.data(), _value.size());
+  HASH_VALUE check_sum = DJBHash(_buffer, record_len - CHECK_SUM_LEN);
+  memcpy(_buffer + record_len - CHECK_SUM_LEN, &check_sum, CHECK_SUM_LEN);
+  return record_len;
+}
+
+bool KVStore::ReadChange(BLOCK_INDEX_TYPE _block_index, uint64_t _sequence,
+                         string* _key, string* _value, bool* _large) {
+  char buffer[RECORD_FIX_LEN + VALUE_MAX_LEN];
+  VALUE_LEN_TYPE stored_len;
+  VALUE_LEN_TYPE len;
+  if (_block_index & VALUE_LOG_TAG) {
+    // a short read leaves a length that fails the checks below
+    memset(buffer, 0xff, VAL_SIZE_LEN);
+    if (value_log_ == nullptr ||
+        value_log_->Read(LogOffset(_block_index), buffer, sizeof(buffer)) <
+            0) {
+      return false;
+    }
+    stored_len = *(VALUE_LEN_TYPE*)buffer;
+    len = LargeValue::RecordLen(stored_len);
+    if (len > VALUE_MAX_LEN) return false;
+  } else {
+    const char* record =
+        aep_base_ + (uint64_t)_block_index * CONFIG.block_size_;
+    stored_len = *(const VALUE_LEN_TYPE*)record;
+    len = LargeValue::RecordLen(stored_len);
+    if (len > VALUE_MAX_LEN ||
+        (uint64_t)(_block_index + BlockNum(len)) * CONFIG.block_size_ >
+            CONFIG.pool_size_) {
+      return false;
+    }
+    // the blocks may be reused while we read, check the copy
+    memcpy(buffer, record, RECORD_FIX_LEN + len);
+  }
+  size_t record_len = RECORD_FIX_LEN + len;
+  if (*(VALUE_LEN_TYPE*)buffer != stored_len ||
+      *(uint64_t*)(buffer + SEQUENCE_OFFSET) != _sequence ||
+      DJBHash(buffer, record_len - CHECK_SUM_LEN) !=
+          *(HASH_VALUE*)(buffer + record_len - CHECK_SUM_LEN)) {
+    return false;
+  }
+  _key->assign(buffer + KEY_OFFSET, KEY_LEN);
+  _value->assign(buffer + VALUE_OFFSET, len);
+  if (_large != nullptr) {
+    *_large = LargeValue::IsLarge(stored_len);
+  }
+  return true;
+}
+
+void KVStore::CopyLarge(const char* _manifest, string* _value) const {
+  ManifestHeader header;
+  memcpy(&header, _manifest, sizeof(ManifestHeader));
+  _value->resize(header.size_);
+  for (uint32_t i = 0; i < header.count_; i++) {
+    uint64_t offset = (uint64_t)i * header.chunk_len_;
+    const char* chunk = aep_base_ + (uint64_t)LargeValue::Chunk(_manifest, i) *
+                                        CONFIG.block_size_;
+    memcpy(&(*_value)[offset], chunk + sizeof(ChunkHeader),
+           std::min<uint64_t>(header.chunk_len_, header.size_ - offset));
+  }
+}
+
+Status KVStore::OpenReader(KEY_INDEX_TYPE _index, PoolValueReader* _reader) {
+  if (inline_values_ != nullptr &&
+      inline_values_->get(_index, _reader->copy())) {
+    _reader->Add(_reader->copy()->data(), _reader->copy()->size());
+    return Ok;
+  }
+  BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+  if (accessed_ != nullptr) {
+    MarkAccessed(_index);
+  }
+  if (block_index & VALUE_LOG_TAG) {
+    Status s = ReadLog(block_index, _reader->copy());
+    if (s != Ok) return s;
+    _reader->Add(_reader->copy()->data(), _reader->copy()->size());
+    return Ok;
+  }
+  const char* record = aep_base_ + (uint64_t)block_index * CONFIG.block_size_;
+  VALUE_LEN_TYPE len = *(const VALUE_LEN_TYPE*)record;
+  if (!LargeValue::IsLarge(len)) {
+    _reader->Add(record + VALUE_OFFSET, len);
+    return Ok;
+  }
+  const char* manifest = record + VALUE_OFFSET;
+  ManifestHeader header;
+  memcpy(&header, manifest, sizeof(ManifestHeader));
+  for (uint32_t i = 0; i < header.count_; i++) {
+    const char* chunk = aep_base_ + (uint64_t)LargeValue::Chunk(manifest, i) *
+                                        CONFIG.block_size_;
+    uint64_t offset = (uint64_t)i * header.chunk_len_;
+    _reader->Add(chunk + sizeof(ChunkHeader),
+                 std::min<uint64_t>(header.chunk_len_, header.size_ - offset));
+  }
+  return Ok;
+}
+
+void KVStore::RecoverKey(
+    KEY_INDEX_TYPE _index,
+    const std::function<void(BLOCK_INDEX_TYPE, uint64_t)>& _mark) {
+  if (filter_ != nullptr) {
+    filter_->Add(key(_index));
+  }
+  BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+  if (block_index & VALUE_LOG_TAG) return;
+  VALUE_LEN_TYPE len = value_len(_index);
+  _mark(block_index, BlockNum(LargeValue::RecordLen(len)));
+  if (!LargeValue::IsLarge(len)) return;
+  const char* manifest =
+      aep_base_ + (uint64_t)block_index * CONFIG.block_size_ + VALUE_OFFSET;
+  ManifestHeader header;
+  memcpy(&header, manifest, sizeof(ManifestHeader));
+  for (uint32_t i = 0; i < header.count_; i++) {
+    uint64_t offset = (uint64_t)i * header.chunk_len_;
+    _mark(LargeValue::Chunk(manifest, i),
+          LargeValue::BlockNum(
+              std::min<uint64_t>(header.chunk_len_, header.size_ - offset)));
+  }
+}
+
+BLOCK_INDEX_TYPE KVStore::WriteRecord(const Slice& _key, const Slice& _value,
+                                      VERSION_TYPE _version,
+                                      KEY_INDEX_TYPE _index) {
+  if (_value.size() > VALUE_MAX_LEN) {
+    return WriteLargeRecord(_key, _value, _version);
+  }
+  return StoreRecord(_key, _value, _version, _index, 0);
+}
+
+BLOCK_INDEX_TYPE KVStore::WriteLargeRecord(const Slice& _key,
+                                           const Slice& _value,
+                                           VERSION_TYPE _version) {
+  uint32_t chunk_len = LargeValue::ChunkLen();
+  uint32_t count = (_value.size() + chunk_len - 1) / chunk_len;
+  ManifestHeader header{_value.size(), chunk_len, count};
+  vector<char> manifest(sizeof(ManifestHeader) +
+                        header.count_ * sizeof(BLOCK_INDEX_TYPE));
+  memcpy(manifest.data(), &header, sizeof(ManifestHeader));
+  for (uint32_t i = 0; i < header.count_; i++) {
+    uint64_t offset = (uint64_t)i * chunk_len;
+    ChunkHeader local;
+    auto* chunk =
+        (ChunkHeader*)StoreBuffer(sizeof(ChunkHeader), (char*)&local);
+    *chunk = ChunkHeader{CHUNK_MARK, 0, 0,
+                         (uint32_t)std::min<uint64_t>(chunk_len,
+                                                      _value.size() - offset),
+                         0};
+    chunk->blocks_ = LargeValue::BlockNum(chunk->len_);
+    chunk->check_sum_ = LargeValue::HeaderCheckSum(*chunk);
+    BLOCK_INDEX_TYPE bi;
+    if (!thread_local_aep_controller->New(chunk->blocks_, &bi)) {
+      // nothing points at the chunks written so far, once their stores
+      // are done they can go
+      Drain();
+      RecycleChunks(manifest.data(), i);
+      return INVALID_BLOCK_INDEX;
+    }
+    char* dst = aep_base_ + (uint64_t)bi * CONFIG.block_size_;
+    Store(dst, (const char*)chunk, sizeof(ChunkHeader));
+    // the value stays put until the drain below
+    Store(dst + sizeof(ChunkHeader), _value.data() + offset, chunk->len_);
+    memcpy(manifest.data() + sizeof(ManifestHeader) +
+               i * sizeof(BLOCK_INDEX_TYPE),
+           &bi, sizeof(BLOCK_INDEX_TYPE));
+  }
+  // a durable manifest must not point at chunks that are not
+  Drain();
+  BLOCK_INDEX_TYPE bi =
+      StoreRecord(_key, Slice(manifest.data(), manifest.size()), _version,
+                  UINT32_MAX, LARGE_VALUE_FLAG);
+  if (bi == INVALID_BLOCK_INDEX) {
+    RecycleChunks(manifest.data(), header.count_);
+  }
+  return bi;
+}
+
+BLOCK_INDEX_TYPE KVStore::StoreRecord(const Slice& _key, const Slice& _value,
+                                      VERSION_TYPE _version,
+                                      KEY_INDEX_TYPE _index,
+                                      VALUE_LEN_TYPE _flags) {
+  BLOCK_INDEX_TYPE bi;
+  if (twins_ != nullptr && _index != UINT32_MAX && twins_->get(_index) != 0 &&
+      BlockNum(_value.size()) == BlockNum(val_lens_[_index]) &&
+      TwinReady(_index) &&
+      !AepMemoryController::global_memory_->backup_running()) {
+    // the twin holds an older version, a torn write leaves the live slot
+    bi = twins_->get(_index) - 1;
+    AepMemoryController::global_memory_->Touch(bi);
+  } else {
+    bi = GetBlockIndex(_value);
+    // a change without a record would stall readers of the ring, chunks
+    // are only reachable from the pool
+    if (bi == INVALID_BLOCK_INDEX && (value_log_ == nullptr || _flags != 0)) {
+      return INVALID_BLOCK_INDEX;
+    }
+  }
+  ChangeRing* ring = AepMemoryController::global_memory_->change_ring();
+  uint64_t sequence = ring->NextSequence();
+  // room for the padding of a value log record
+  size_t buffer_len = BlockNum(_value.size()) * CONFIG.block_size_;
+  char local_buffer[buffer_len];
+  char* record_buffer = StoreBuffer(buffer_len, local_buffer);
+  size_t record_len =
+      EncodeRecord(_key, _value, _version, sequence, record_buffer, _flags);
+  if (bi == INVALID_BLOCK_INDEX) {
+    // the pool is full, the record goes to the value log
+    bi = WriteLogRecord(record_buffer, record_len);
+    ring->Append(sequence, bi);
+    return bi;
+  }
+  // memcpy to pmem and flush, the caller drains
+  Store(this->aep_base_ + (uint64_t)bi * CONFIG.block_size_, record_buffer,
+        record_len);
+  ring->Append(sequence, bi);
+  return bi;
+}
+
+void KVStore::Insert(KEY_INDEX_TYPE _index, const Slice& _key,
+                     const Slice& _value, BLOCK_INDEX_TYPE _block_index,
+                     Entry* _entry) {
+  // Update key buffer in memory before the key becomes reachable
+  SetKeyInfo(_index, _key, _value, _block_index);
+  Link(_index, _entry);
+}
+
+size_t KVStore::Load(const Slice* _keys, const Slice* _values, size_t _n,
+                     KEY_INDEX_TYPE _first) {
+  ChangeRing* ring = AepMemoryController::global_memory_->change_ring();
+  char* run_begin = nullptr;
+  char* run_end = nullptr;
+  size_t i = 0;
+  for (; i < _n; i++) {
+    BLOCK_INDEX_TYPE bi = _values[i].size() > VALUE_MAX_LEN
+                              ? INVALID_BLOCK_INDEX
+                              : GetBlockIndex(_values[i]);
+    if (bi == INVALID_BLOCK_INDEX) {
+      bi = WriteRecord(_keys[i], _values[i], 0);
+      if (bi == INVALID_BLOCK_INDEX) break;
+      SetKeyInfo(_first + i, _keys[i], _values[i], bi);
+      continue;
+    }
+    char* record = this->aep_base_ + (uint64_t)bi * CONFIG.block_size_;
+    if (record != run_end) {
+      if (run_begin != nullptr) {
+        storage_->Persist(run_begin, run_end - run_begin);
+      }
+      run_begin = record;
+    }
+    // encode in place, the run is flushed as a whole
+    uint64_t sequence = ring->NextSequence();
+    EncodeRecord(_keys[i], _values[i], 0, sequence, record);
+    ring->Append(sequence, bi);
+    run_end =
+        record + (uint64_t)BlockNum(_values[i].size()) * CONFIG.block_size_;
+    SetKeyInfo(_first + i, _keys[i], _values[i], bi);
+  }
+  if (run_begin != nullptr) {
+    storage_->Persist(run_begin, run_end - run_begin);
+  }
+  // records written through WriteRecord are not drained yet, and may still
+  // be with the persist threads
+  Drain();
+  return i;
+}
+
+bool KVStore::CopyRecord(KEY_INDEX_TYPE _index, vector<char>* _buffer,
+                         BLOCK_INDEX_TYPE* _block_index) {
+  BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+  VALUE_LEN_TYPE len = value_len(_index);
+  // indexes reserved by a running BulkLoad are not filled yet, empty slots
+  // of the persistent index have none
+  if ((block_index & VALUE_LOG_TAG) || len > VALUE_MAX_LEN ||
+      (uint64_t)(block_index + BlockNum(len)) * CONFIG.block_size_ >
+          CONFIG.pool_size_) {
+    return false;
+  }
+  size_t size = (size_t)BlockNum(len) * CONFIG.block_size_;
+  size_t offset = _buffer->size();
+  _buffer->resize(offset + size);
+  char* copy = _buffer->data() + offset;
+  memcpy(copy, aep_base_ + (uint64_t)block_index * CONFIG.block_size_, size);
+  size_t record_len = RECORD_FIX_LEN + len;
+  if (*(VALUE_LEN_TYPE*)copy != len ||
+      memcmp(copy + KEY_OFFSET, key(_index), KEY_LEN) != 0 ||
+      DJBHash(copy, record_len - CHECK_SUM_LEN) !=
+          *(HASH_VALUE*)(copy + record_len - CHECK_SUM_LEN)) {
+    _buffer->resize(offset);
+    return false;
+  }
+  *_block_index = block_index;
+  return true;
+}
+
+bool KVStore::MoveToLog(KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index,
+                        uint64_t _sequence, BLOCK_INDEX_TYPE _log_block) {
+  // twin writes alternate between two slots, the block index alone may
+  // have come back to the copied one
+  if (block_index(_index) != _block_index ||
+      sequence(_block_index) != _sequence) {
+    return false;
+  }
+  int block_num = BlockNum(value_len(_index));
+  if (pmem_index_ != nullptr) {
+    pmem_index_->Update(_index, _log_block, value_len(_index),
+                        version(_index));
+  } else {
+    block_index_->set(_index, _log_block);
+  }
+  if (twins_ != nullptr && twins_->get(_index) != 0) {
+    thread_local_aep_controller->DeleteShared(block_num,
+                                              twins_->get(_index) - 1);
+    twins_->set(_index, 0);
+  }
+  thread_local_aep_controller->DeleteShared(block_num, _block_index);
+  AepMemoryController::global_memory_->change_ring()->Relocate(_sequence,
+                                                               _log_block);
+  return true;
+}
+
+void KVStore::Replace(KEY_INDEX_TYPE _index, const Slice& _value,
+                      BLOCK_INDEX_TYPE _block_index, VERSION_TYPE _version) {
+  // readers taking the copy see the new value from here on, the others
+  // from the switch of the block index
+  SetInline(_index, _value.data(), _value.size());
+  VALUE_LEN_TYPE value_len = LargeValue::StoredLen(_value.size());
+  VALUE_LEN_TYPE data_len = this->value_len(_index);
+  BLOCK_INDEX_TYPE old_block_index = block_index(_index);
+  if (pmem_index_ != nullptr) {
+    pmem_index_->Update(_index, _block_index, value_len, _version);
+    Recycle(data_len, old_block_index);
+    return;
+  }
+  block_index_->set(_index, _block_index);
+  versions_[_index] = _version;
+  val_lens_[_index] = value_len;
+  if (twins_ != nullptr) {
+    BLOCK_INDEX_TYPE twin = twins_->get(_index);
+    // a twin this write did not take was still in its grace period
+    if (twin != 0 && twin - 1 != _block_index) {
+      Recycle(data_len, twin - 1);
+    }
+    twins_->set(_index, 0);
+    if (!((old_block_index | _block_index) & VALUE_LOG_TAG) &&
+        !LargeValue::IsLarge(data_len | value_len) &&
+        BlockNum(data_len) == BlockNum(value_len)) {
+      // keep the old record as the slot for the next overwrite
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      twin_epochs_[_index] = EpochManager::current();
+      twins_->set(_index, old_block_index + 1);
+      return;
+    }
+  }
   Recycle(data_len, old_block_index);
 }
 
-HashMap::HashMap(char* _base, pFunction _hash) : hash_(_hash) {
+Status KVStore::Write(const Slice& _key, const Slice& _value,
+                      Entry* _entry) {
+  // a full key index must not leave a durable record behind
+  KEY_INDEX_TYPE index = ReserveKey(_key);
+  if (index == UINT32_MAX) return OutOfMemory;
+  BLOCK_INDEX_TYPE bi = WriteRecord(_key, _value, 0);
+  if (bi == INVALID_BLOCK_INDEX) {
+    Unreserve(index);
+    return OutOfMemory;
+  }
+  Drain();
+  Insert(index, _key, _value, bi, _entry);
+  PublishChange(bi);
+  return Ok;
+}
+
+Status KVStore::Update(const Slice& _key, const Slice& _value,
+                       KEY_INDEX_TYPE _index) {
+  VERSION_TYPE version = this->version(_index) + 1;
+  BLOCK_INDEX_TYPE bi = WriteRecord(_key, _value, version, _index);
+  if (bi == INVALID_BLOCK_INDEX) return OutOfMemory;
+  Drain();
+  Replace(_index, _value, bi, version);
+  PublishChange(bi);
+  return Ok;
+}
+
+HashMap::HashMap(char* _base, StorageBackend* _storage, pFunction _hash)
+    : hash_(_hash) {
+  buckets_ = std::min<uint64_t>(
+      std::max<uint64_t>(
+          1, CONFIG.max_keys_ * HASH_MAP_SIZE / DEFAULT_MAX_KEYS),
+      UINT32_MAX);
+  // the persistent index has buckets of its own, one keeps entry() valid
+  if (AepMemoryController::global_memory_->pmem_index() != nullptr) {
+    buckets_ = 1;
+  }
   std::allocator<Entry> entry_allocator;
-  this->entries_ = entry_allocator.allocate(HASH_MAP_SIZE);
-  for (size_t i = 0; i < HASH_MAP_SIZE; ++i) {
+  this->entries_ = entry_allocator.allocate(buckets_);
+  for (size_t i = 0; i < buckets_; ++i) {
     entry_allocator.construct(this->entries_ + i);
   }
-  kv_store_ = new KVStore(_base);
-  // Recovery(_base);
+  locks_ = new SpinLock[LOCK_NUM];
+  kv_store_ = new KVStore(_base, _storage);
 }
 
 HashMap::~HashMap() {
   std::allocator<Entry> entry_allocator;
-  entry_allocator.deallocate(this->entries_, HASH_MAP_SIZE);
+  entry_allocator.deallocate(this->entries_, buckets_);
+  delete[] locks_;
   delete kv_store_;
 }
 
 Status HashMap::Get(const Slice& _key, std::string* _value) {
-  uint32_t hash_val = DJBHash(_key.data());
-  Entry& entry = this->entry(hash_val);
-  KEY_INDEX_TYPE head = entry.GetHead();
-  if (head == UINT32_MAX) return NotFound;
-  head = kv_store_->Find(_key, head);
+  // most misses end here, before the chain on AEP is walked
+  if (!kv_store_->MayContain(_key)) return NotFound;
+  // no lock, the guard keeps the record from being reused while copied
+  EpochGuard guard;
+  KEY_INDEX_TYPE head = kv_store_->Lookup(_key, entry(DJBHash(_key.data())));
   if (head != UINT32_MAX) {
-    kv_store_->Read(head, _value);
-    return Ok;
+    return kv_store_->Read(head, _value);
   }
   return NotFound;
 }
 
+Status HashMap::GetReader(const Slice& _key,
+                          std::unique_ptr<ValueReader>* _reader) {
+  if (!kv_store_->MayContain(_key)) return NotFound;
+  // the reader's guard is entered before the head is loaded
+  std::unique_ptr<PoolValueReader> reader(new PoolValueReader);
+  KEY_INDEX_TYPE head = kv_store_->Lookup(_key, entry(DJBHash(_key.data())));
+  if (head == UINT32_MAX) return NotFound;
+  Status s = kv_store_->OpenReader(head, reader.get());
+  if (s != Ok) return s;
+  _reader->reset(reader.release());
+  return Ok;
+}
+
+bool HashMap::ReadChange(BLOCK_INDEX_TYPE _block_index, uint64_t _sequence,
+                         string* _key, string* _value) {
+  // the chunks of a manifest current after this point stay put
+  EpochGuard guard;
+  bool large = false;
+  if (!kv_store_->ReadChange(_block_index, _sequence, _key, _value, &large)) {
+    return false;
+  }
+  Slice key((char*)_key->data(), KEY_LEN);
+  KEY_INDEX_TYPE head = kv_store_->Lookup(key, entry(DJBHash(key.data())));
+  if (head == UINT32_MAX) return false;
+  BLOCK_INDEX_TYPE current = kv_store_->block_index(head);
+  // a record moved to the value log keeps its sequence number
+  if (current != _block_index && (current & VALUE_LOG_TAG) &&
+      kv_store_->sequence(current) == _sequence) {
+    return ReadChange(current, _sequence, _key, _value);
+  }
+  // a change overwritten since is skipped, the later one follows. An
+  // overwritten manifest may also list chunks that were reused, and a block
+  // that came back holds another change.
+  if (current != _block_index ||
+      kv_store_->sequence(_block_index) != _sequence) {
+    return false;
+  }
+  if (!large) return true;
+  string manifest;
+  manifest.swap(*_value);
+  kv_store_->CopyLarge(manifest.data(), _value);
+  return true;
+}
+
+bool ChangeIterator::Next() {
+  while (status_ == Ok) {
+    BLOCK_INDEX_TYPE block_index;
+    ChangeRing::SlotState state = ring_->Get(next_, &block_index);
+    if (state == ChangeRing::SlotPending) return false;
+    if (state == ChangeRing::SlotLost) {
+      status_ = NotFound;
+      return false;
+    }
+    uint64_t sequence = next_++;
+    // skip changes lost in a crash or overwritten since
+    if (block_index != INVALID_BLOCK_INDEX &&
+        hash_map_->ReadChange(block_index, sequence, &key_, &value_)) {
+      sequence_ = sequence;
+      return true;
+    }
+  }
+  return false;
+}
+
 Status HashMap::Set(const Slice& _key, const Slice& _value) {
+  if (_value.size() > LargeValue::MaxLen()) return InvalidArgument;
   uint32_t hash_val = DJBHash(_key.data());
   Entry& entry = this->entry(hash_val);
-  KEY_INDEX_TYPE head = entry.GetHead();
+  std::lock_guard<SpinLock> guard(lock(hash_val));
+  KEY_INDEX_TYPE head = kv_store_->Lookup(_key, entry);
+
+  if (head == UINT32_MAX) {
+    return kv_store_->Write(_key, _value, &entry);
+  }
+
+  return kv_store_->Update(_key, _value, head);
+}
+
+Status HashMap::ReadModifyWrite(const Slice& _key, const modify_func& _modify) {
+  uint32_t hash_val = DJBHash(_key.data());
+  Entry& entry = this->entry(hash_val);
+  std::lock_guard<SpinLock> guard(lock(hash_val));
+  KEY_INDEX_TYPE head = kv_store_->Lookup(_key, entry);
+
+  std::string old_value;
+  std::string new_value;
+  Slice old_slice;
   if (head != UINT32_MAX) {
-    head = kv_store_->Find(_key, entry.GetHead());
+    Status s = kv_store_->Read(head, &old_value);
+    if (s != Ok) return s;
+    old_slice = Slice((char*)old_value.data(), old_value.size());
   }
+  Status s = _modify(head == UINT32_MAX ? nullptr : &old_slice, &new_value);
+  if (s != Ok) return s;
+  if (new_value.size() > LargeValue::MaxLen()) return InvalidArgument;
 
+  Slice value((char*)new_value.data(), new_value.size());
   if (head == UINT32_MAX) {
-    kv_store_->Write(_key, _value, &entry);
+    return kv_store_->Write(_key, value, &entry);
+  }
+  return kv_store_->Update(_key, value, head);
+}
+
+void HashMap::MultiGet(const Slice* _keys, std::string* _values,
+                       Status* _status, size_t _n) {
+  std::vector<KEY_INDEX_TYPE> heads(_n, UINT32_MAX);
+  for (size_t i = 0; i < _n; i++) {
+    __builtin_prefetch(&entry(DJBHash(_keys[i].data())));
+  }
+  EpochGuard guard;
+  for (size_t i = 0; i < _n; i++) {
+    if (!kv_store_->MayContain(_keys[i])) continue;
+    heads[i] = kv_store_->Lookup(_keys[i], entry(DJBHash(_keys[i].data())));
+    if (heads[i] != UINT32_MAX) kv_store_->Prefetch(heads[i]);
+  }
+  for (size_t i = 0; i < _n; i++) {
+    _status[i] = heads[i] == UINT32_MAX
+                     ? NotFound
+                     : kv_store_->Read(heads[i], &_values[i]);
+  }
+}
+
+void HashMap::MultiSet(const Slice* _keys, const Slice* _values,
+                       Status* _status, size_t _n) {
+  struct Pending {
+    size_t i_;
+    Entry* entry_;
+    KEY_INDEX_TYPE index_;
+    // reserved for a new key
+    KEY_INDEX_TYPE new_index_;
+    BLOCK_INDEX_TYPE block_index_;
+    VERSION_TYPE version_;
+  };
+  std::vector<Pending> pending;
+  std::vector<SpinLock*> held;
+  pending.reserve(_n);
+  auto publish = [&]() {
+    kv_store_->Drain();
+    for (auto& p : pending) {
+      if (p.index_ == UINT32_MAX) {
+        kv_store_->Insert(p.new_index_, _keys[p.i_], _values[p.i_],
+                          p.block_index_, p.entry_);
+      } else {
+        kv_store_->Replace(p.index_, _values[p.i_], p.block_index_,
+                           p.version_);
+      }
+      kv_store_->PublishChange(p.block_index_);
+      _status[p.i_] = Ok;
+    }
+    pending.clear();
+    for (auto l : held) {
+      l->unlock();
+    }
+    held.clear();
+  };
+
+  for (size_t i = 0; i < _n; i++) {
+    if (_values[i].size() > LargeValue::MaxLen()) {
+      _status[i] = InvalidArgument;
+      continue;
+    }
+    // a key repeated in the batch must see its earlier record published
+    for (auto& p : pending) {
+      if (memcmp(_keys[p.i_].data(), _keys[i].data(), KEY_LEN) == 0) {
+        publish();
+        break;
+      }
+    }
+    uint32_t hash_val = DJBHash(_keys[i].data());
+    Entry& entry = this->entry(hash_val);
+    // never wait for a lock while holding others
+    SpinLock* l = &lock(hash_val);
+    if (std::find(held.begin(), held.end(), l) == held.end()) {
+      if (!l->try_lock()) {
+        publish();
+        l->lock();
+      }
+      held.push_back(l);
+    }
+    KEY_INDEX_TYPE head = kv_store_->Lookup(_keys[i], entry);
+    VERSION_TYPE version =
+        head == UINT32_MAX ? 0 : kv_store_->version(head) + 1;
+    KEY_INDEX_TYPE new_index =
+        head == UINT32_MAX ? kv_store_->ReserveKey(_keys[i]) : UINT32_MAX;
+    BLOCK_INDEX_TYPE bi = INVALID_BLOCK_INDEX;
+    if (head != UINT32_MAX || new_index != UINT32_MAX) {
+      bi = kv_store_->WriteRecord(_keys[i], _values[i], version, head);
+    }
+    if (bi == INVALID_BLOCK_INDEX) {
+      if (new_index != UINT32_MAX) {
+        kv_store_->Unreserve(new_index);
+      }
+      _status[i] = OutOfMemory;
+      continue;
+    }
+    pending.push_back({i, &entry, head, new_index, bi, version});
+  }
+  publish();
+}
+
+// Run _func(begin, end) over _n items split into _threads ranges
+static void ParallelRun(int _threads, size_t _n,
+                        const std::function<void(size_t, size_t)>& _func) {
+  size_t per_thread = (_n + _threads - 1) / _threads;
+  std::vector<std::thread> workers;
+  for (size_t begin = 0; begin < _n; begin += per_thread) {
+    workers.emplace_back(_func, begin, std::min(_n, begin + per_thread));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+Status HashMap::BulkLoad(const Slice* _keys, const Slice* _values, size_t _n,
+                         bool _unique_keys) {
+  for (size_t i = 0; i < _n; i++) {
+    if (_values[i].size() > LargeValue::MaxLen()) return InvalidArgument;
+  }
+  int threads = CONFIG.bulk_load_threads_ > 0
+                    ? CONFIG.bulk_load_threads_
+                    : std::max(1u, std::thread::hardware_concurrency());
+  // the persistent index places keys by hash, there is no range to reserve
+  if (!_unique_keys || kv_store_->pmem_index() != nullptr) {
+    // the first failure of each thread, pairs after it are still loaded
+    std::vector<Status> results(threads, Ok);
+    // a key always goes to the same thread, which keeps its pairs in order
+    ParallelRun(threads, threads, [&](size_t _part, size_t) {
+      std::vector<Slice> keys;
+      std::vector<Slice> values;
+      std::vector<Status> status(std::max<size_t>(1, CONFIG.async_batch_));
+      auto flush = [&]() {
+        MultiSet(keys.data(), values.data(), status.data(), keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+          if (results[_part] == Ok) results[_part] = status[i];
+        }
+        keys.clear();
+        values.clear();
+      };
+      for (size_t i = 0; i < _n; i++) {
+        if (DJBHash(_keys[i].data()) % threads != _part) continue;
+        keys.push_back(_keys[i]);
+        values.push_back(_values[i]);
+        if (keys.size() == status.size()) flush();
+      }
+      if (!keys.empty()) flush();
+    });
+    for (Status result : results) {
+      if (result != Ok) return result;
+    }
     return Ok;
   }
 
-  kv_store_->Update(_key, _value, head);
+  KEY_INDEX_TYPE first = kv_store_->ReserveKeys(_n);
+  if (first == UINT32_MAX) return OutOfMemory;
+  std::atomic<bool> full{false};
+  // keys past where a range ran out of space stay unlinked
+  std::vector<size_t> loaded(_n);
+  ParallelRun(threads, _n, [&](size_t _begin, size_t _end) {
+    size_t n = kv_store_->Load(_keys + _begin, _values + _begin,
+                               _end - _begin, first + _begin);
+    loaded[_begin] = _begin + n;
+    if (n < _end - _begin) full = true;
+  });
+  // every record is durable, link the hash chains
+  ParallelRun(threads, _n, [&](size_t _begin, size_t) {
+    for (size_t i = _begin; i < loaded[_begin]; i++) {
+      KEY_INDEX_TYPE index = first + i;
+      kv_store_->Link(index, &entry(DJBHash(kv_store_->key(index))));
+      kv_store_->PublishChange(kv_store_->block_index(index));
+    }
+  });
+  return full ? OutOfMemory : Ok;
+}
+
+size_t HashMap::MigrateCold(size_t _max, uint64_t _scan) {
+  ValueLog* value_log = kv_store_->value_log();
+  KEY_INDEX_TYPE keys = kv_store_->key_count();
+  if (keys == 0) return 0;
+  struct Copy {
+    KEY_INDEX_TYPE index_;
+    BLOCK_INDEX_TYPE block_index_;
+    size_t offset_;
+  };
+  vector<Copy> copies;
+  vector<char> buffer;
+  for (uint64_t i = 0; i < _scan && copies.size() < _max; i++) {
+    KEY_INDEX_TYPE index = clock_hand_++ % keys;
+    // second chance for a key read since the hand last passed it
+    if (kv_store_->TestAndClearAccessed(index)) continue;
+    size_t offset = buffer.size();
+    BLOCK_INDEX_TYPE block_index;
+    if (kv_store_->CopyRecord(index, &buffer, &block_index)) {
+      copies.push_back({index, block_index, offset});
+    }
+  }
+  uint64_t log_offset;
+  if (copies.empty() ||
+      !value_log->Append(buffer.data(), buffer.size(), &log_offset) ||
+      (log_offset + buffer.size()) / CONFIG.block_size_ >=
+          kv_store_->block_limit()) {
+    return 0;
+  }
+  // the copies are durable, switch the keys not written meanwhile
+  size_t moved = 0;
+  for (auto& copy : copies) {
+    const char* record = buffer.data() + copy.offset_;
+    std::lock_guard<SpinLock> guard(lock(DJBHash(record + KEY_OFFSET)));
+    BLOCK_INDEX_TYPE log_block =
+        VALUE_LOG_TAG | (log_offset + copy.offset_) / CONFIG.block_size_;
+    if (kv_store_->MoveToLog(copy.index_, copy.block_index_,
+                             *(uint64_t*)(record + SEQUENCE_OFFSET),
+                             log_block)) {
+      moved++;
+    } else {
+      value_log->AddGarbage(
+          KVStore::BlockNum(*(VALUE_LEN_TYPE*)record) * CONFIG.block_size_);
+    }
+  }
+  return moved;
+}
+
+Status HashMap::Scan(char* _base, int _threads,
+                     const ScanCallback& _callback) {
+  GlobalMemoryController* global = AepMemoryController::global_memory_;
+  if (_threads <= 0) {
+    _threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  KEY_INDEX_TYPE keys = kv_store_->key_count();
+  // one bit per key index, set by whoever passes the key on
+  std::vector<std::atomic<uint64_t>> emitted((keys + 63) / 64);
+  for (auto& word : emitted) {
+    word.store(0, std::memory_order_relaxed);
+  }
+  auto emit = [&](int _part, KEY_INDEX_TYPE _index, string* _value) {
+    uint64_t bit = 1UL << (_index % 64);
+    if (emitted[_index / 64].fetch_or(bit) & bit) return;
+    if (kv_store_->Read(_index, _value) != Ok) return;
+    char key[KEY_LEN];
+    memcpy(key, kv_store_->key(_index), KEY_LEN);
+    _callback(_part, Slice(key, KEY_LEN),
+              Slice((char*)_value->data(), _value->size()));
+  };
+
+  SEGMENT_INDEX_TYPE first = global->first_segment_index();
+  SEGMENT_INDEX_TYPE segments = global->segment_index() - first;
+  ParallelRun(_threads, _threads, [&](size_t _part, size_t) {
+    string value;
+    SEGMENT_INDEX_TYPE end = first + segments * (_part + 1) / _threads;
+    for (SEGMENT_INDEX_TYPE segment = first + segments * _part / _threads;
+         segment < end; segment++) {
+      SegmentSummary* summary = global->summary(segment);
+      if (summary->state_ != SegmentData) continue;
+      int size_class = summary->size_class_;
+      BLOCK_INDEX_TYPE step = 1u << size_class;
+      BLOCK_INDEX_TYPE begin = segment * CONFIG.block_per_segment_;
+      BLOCK_INDEX_TYPE fill =
+          begin +
+          std::min<uint64_t>(summary->fill_, CONFIG.block_per_segment_);
+      BLOCK_INDEX_TYPE offset = begin;
+      while (offset < fill) {
+        // the records under the guard are not reused while looked at
+        EpochGuard guard;
+        char* record_base = _base + (uint64_t)offset * CONFIG.block_size_;
+        VALUE_LEN_TYPE len = *(VALUE_LEN_TYPE*)(record_base);
+        if (len == CHUNK_MARK && LargeValue::ValidChunk(record_base)) {
+          uint32_t chunk_blocks = ((const ChunkHeader*)record_base)->blocks_;
+          offset += std::max<uint32_t>(step, chunk_blocks);
+          continue;
+        }
+        VALUE_LEN_TYPE record_value_len = LargeValue::RecordLen(len);
+        int block_num = KVStore::BlockNum(record_value_len);
+        if (record_value_len > VALUE_MAX_LEN || offset + block_num > fill ||
+            GlobalMemoryController::SizeClass(block_num) != size_class) {
+          offset += step;
+          continue;
+        }
+        uint32_t record_len = record_value_len + RECORD_FIX_LEN;
+        if (DJBHash(record_base, record_len - CHECK_SUM_LEN) !=
+            *(HASH_VALUE*)(record_base + (record_len - CHECK_SUM_LEN))) {
+          offset += step;
+          continue;
+        }
+        // records are published after they are durable, a key pointing
+        // here means the record is its current one and complete
+        Slice key(record_base + KEY_OFFSET, KEY_LEN);
+        KEY_INDEX_TYPE index =
+            kv_store_->Lookup(key, entry(DJBHash(key.data())));
+        if (index != UINT32_MAX && kv_store_->IsCurrent(index, offset)) {
+          emit(_part, index, &value);
+        }
+        offset += block_num;
+      }
+    }
+  });
+
+  // keys in the value log, or moved behind a thread while it scanned
+  ParallelRun(_threads, _threads, [&](size_t _part, size_t) {
+    string value;
+    KEY_INDEX_TYPE end = (uint64_t)keys * (_part + 1) / _threads;
+    for (KEY_INDEX_TYPE i = (uint64_t)keys * _part / _threads; i < end; i++) {
+      if (emitted[i / 64].load(std::memory_order_relaxed) &
+          (1UL << (i % 64))) {
+        continue;
+      }
+      EpochGuard guard;
+      // free slots of the persistent index hold no block
+      if (kv_store_->block_index(i) == INVALID_BLOCK_INDEX) continue;
+      Slice key((char*)kv_store_->key(i), KEY_LEN);
+      if (kv_store_->Lookup(key, entry(DJBHash(key.data()))) != i) continue;
+      emit(_part, i, &value);
+    }
+  });
   return Ok;
 }
 
-Status HashMap::Recovery(char* _base) {
-  size_t offset = 0;
-  char* record_base = nullptr;
-  VALUE_LEN_TYPE len = UINT16_MAX;
-  HASH_VALUE check_sum = UINT32_MAX;
-  uint16_t record_len = 0;
-
-  while (offset < FILE_SIZE / CONFIG.block_size_) {
-    // check max offset
-    record_base = _base + (uint64_t)offset * CONFIG.block_size_;
-    len = *(VALUE_LEN_TYPE*)(record_base);
-    record_len = len + RECORD_FIX_LEN;
-    HASH_VALUE check_sum_new = DJBHash(record_base, record_len - CHECK_SUM_LEN);
-    check_sum = *(HASH_VALUE*)(record_base + (record_len - CHECK_SUM_LEN));
-    if (check_sum_new == check_sum) {
-      uint32_t hash_val = DJBHash(record_base + VAL_SIZE_LEN);
+Status HashMap::Recovery(char* _base, uint64_t _size) {
+  GlobalMemoryController* global = AepMemoryController::global_memory_;
+  vector<std::pair<BLOCK_INDEX_TYPE, VALUE_LEN_TYPE>> stale;
+  // chunks of large values and their block counts, until the manifests
+  // that reference them are known
+  std::unordered_map<BLOCK_INDEX_TYPE, uint32_t> chunks;
+  uint64_t max_sequence = 0;
+  SEGMENT_INDEX_TYPE end = std::min<uint64_t>(
+      global->segment_index(), _size / GlobalMemoryController::segment_size());
+
+  for (SEGMENT_INDEX_TYPE segment = global->first_segment_index();
+       segment < end; segment++) {
+    SegmentSummary* summary = global->summary(segment);
+    if (summary->state_ != SegmentData) continue;
+    BLOCK_INDEX_TYPE begin = segment * CONFIG.block_per_segment_;
+    BLOCK_INDEX_TYPE max = begin + CONFIG.block_per_segment_;
+    if (summary->live_ == 0) {
+      global->RecoverSegment(segment, 0);
+      continue;
+    }
+    // records are aligned to the block size of the segment
+    int size_class = summary->size_class_;
+    BLOCK_INDEX_TYPE step = 1u << size_class;
+    FreeList* free_list = global->free_list(size_class);
+    // blocks past the fill pointer were never handed out
+    BLOCK_INDEX_TYPE fill =
+        begin + std::min<uint64_t>(summary->fill_, CONFIG.block_per_segment_);
+    uint64_t live = 0;
+    // free runs of the segment, dropped if the whole segment turns out free
+    vector<std::pair<BLOCK_INDEX_TYPE, size_t>> runs;
+    BLOCK_INDEX_TYPE free_begin = begin;
+    BLOCK_INDEX_TYPE offset = begin;
+    while (offset < fill) {
+      char* record_base = _base + (uint64_t)offset * CONFIG.block_size_;
+      VALUE_LEN_TYPE len = *(VALUE_LEN_TYPE*)(record_base);
+      if (len == CHUNK_MARK && LargeValue::ValidChunk(record_base)) {
+        uint32_t chunk_blocks = ((const ChunkHeader*)record_base)->blocks_;
+        if (offset + chunk_blocks <= fill &&
+            GlobalMemoryController::SizeClass(chunk_blocks) == size_class) {
+          runs.emplace_back(free_begin, offset - free_begin);
+          free_begin = offset + chunk_blocks;
+          live += chunk_blocks;
+          chunks.emplace(offset, chunk_blocks);
+          offset += chunk_blocks;
+          continue;
+        }
+      }
+      VALUE_LEN_TYPE record_value_len = LargeValue::RecordLen(len);
+      int block_num = KVStore::BlockNum(record_value_len);
+      // a record of another class is left over from an earlier use
+      if (record_value_len > VALUE_MAX_LEN || offset + block_num > fill ||
+          GlobalMemoryController::SizeClass(block_num) != size_class) {
+        offset += step;
+        continue;
+      }
+      uint32_t record_len = record_value_len + RECORD_FIX_LEN;
+      HASH_VALUE check_sum_new =
+          DJBHash(record_base, record_len - CHECK_SUM_LEN);
+      HASH_VALUE check_sum =
+          *(HASH_VALUE*)(record_base + (record_len - CHECK_SUM_LEN));
+      if (check_sum_new != check_sum) {
+        offset += step;
+        continue;
+      }
+      // blocks between two records are free
+      runs.emplace_back(free_begin, offset - free_begin);
+      free_begin = offset + block_num;
+      live += block_num;
+      max_sequence = std::max(max_sequence,
+                              *(uint64_t*)(record_base + SEQUENCE_OFFSET));
+
+      Slice key(record_base + KEY_OFFSET, KEY_LEN);
+      uint32_t hash_val = DJBHash(key.data());
       Entry& entry = this->entry(hash_val);
       KEY_INDEX_TYPE head = entry.GetHead();
       if (head != UINT32_MAX) {
-        head = kv_store_->Find(record_base + VAL_SIZE_LEN, entry.GetHead());
+        head = kv_store_->Find(key, head);
       }
       if (head == UINT32_MAX) {
-        this->kv_store_->Recovery(offset, len, record_base, &entry);
+        if (!kv_store_->Recovery(offset, len, record_base, &entry)) {
+          return OutOfMemory;
+        }
       } else {
-        this->kv_store_->UpdateKeyInfo(
-            head, offset, len, *(VERSION_TYPE*)(record_base + VERSION_OFFSET));
+        stale.clear();
+        this->kv_store_->UpdateKeyInfo(head, offset, len, record_base, &stale);
+        for (auto& record : stale) {
+          int stale_num =
+              KVStore::BlockNum(LargeValue::RecordLen(record.second));
+          if (record.first & VALUE_LOG_TAG) {
+            kv_store_->Recycle(record.second, record.first);
+          } else if (record.first >= begin) {
+            live -= stale_num;
+            runs.emplace_back(record.first, stale_num);
+          } else {
+            global->OnDelete(record.first, stale_num);
+            global->free_list(GlobalMemoryController::SizeClass(stale_num))
+                ->Push(record.first, stale_num);
+          }
+        }
+      }
+      offset += block_num;
+    }
+    runs.emplace_back(free_begin, max - free_begin);
+    if (live > 0) {
+      for (auto& run : runs) {
+        free_list->Push(run.first, run.second);
       }
-      int blockNum = (record_len + CONFIG.block_size_ - 1) / CONFIG.block_size_;
-      offset += blockNum;
-    } else {
-      // recycle
-      offset++;
     }
+    global->RecoverSegment(segment, live);
+  }
+  if (kv_store_->value_log() != nullptr &&
+      !RecoverValueLog(&max_sequence)) {
+    return OutOfMemory;
   }
+  // chunks of crashed or overwritten large values are referenced by no key
+  if (!chunks.empty()) {
+    for (KEY_INDEX_TYPE i = 0; i < kv_store_->key_count(); i++) {
+      kv_store_->ClaimChunks(i, &chunks);
+    }
+    for (auto& chunk : chunks) {
+      global->Free(chunk.first, chunk.second);
+    }
+  }
+  global->change_ring()->Recover(max_sequence);
   return Ok;
 }
 
+bool HashMap::RecoverValueLog(uint64_t* _max_sequence) {
+  GlobalMemoryController* global = AepMemoryController::global_memory_;
+  ValueLog* value_log = kv_store_->value_log();
+  uint64_t size;
+  const char* base = value_log->MapForScan(&size);
+  if (base == nullptr) return true;
+  vector<std::pair<BLOCK_INDEX_TYPE, VALUE_LEN_TYPE>> stale;
+  uint64_t offset = 0;
+  while (offset + RECORD_FIX_LEN <= size) {
+    char* record_base = (char*)base + offset;
+    VALUE_LEN_TYPE len = *(VALUE_LEN_TYPE*)(record_base);
+    uint32_t record_len = len + RECORD_FIX_LEN;
+    // appends cut short by a crash leave zeros or a torn record
+    if (len > VALUE_MAX_LEN || offset + record_len > size ||
+        DJBHash(record_base, record_len - CHECK_SUM_LEN) !=
+            *(HASH_VALUE*)(record_base + (record_len - CHECK_SUM_LEN))) {
+      offset += CONFIG.block_size_;
+      continue;
+    }
+    BLOCK_INDEX_TYPE block_index =
+        VALUE_LOG_TAG | (BLOCK_INDEX_TYPE)(offset / CONFIG.block_size_);
+    *_max_sequence = std::max(*_max_sequence,
+                              *(uint64_t*)(record_base + SEQUENCE_OFFSET));
+
+    Slice key(record_base + KEY_OFFSET, KEY_LEN);
+    Entry& entry = this->entry(DJBHash(key.data()));
+    KEY_INDEX_TYPE head = entry.GetHead();
+    if (head != UINT32_MAX) {
+      head = kv_store_->Find(key, head);
+    }
+    if (head == UINT32_MAX) {
+      if (!kv_store_->Recovery(block_index, len, record_base, &entry)) {
+        value_log->UnmapScan();
+        return false;
+      }
+    } else {
+      // a record moved here keeps its sequence number, the pool copy wins
+      stale.clear();
+      kv_store_->UpdateKeyInfo(head, block_index, len, record_base, &stale);
+      for (auto& record : stale) {
+        if (record.first & VALUE_LOG_TAG) {
+          kv_store_->Recycle(record.second, record.first);
+        } else {
+          global->Free(record.first, KVStore::BlockNum(
+                                         LargeValue::RecordLen(record.second)));
+        }
+      }
+    }
+    offset += (uint64_t)KVStore::BlockNum(len) * CONFIG.block_size_;
+  }
+  value_log->UnmapScan();
+  return true;
+}
+
+void HashMap::RecoverIndex() {
+  GlobalMemoryController* global = AepMemoryController::global_memory_;
+  PmemIndex* index = kv_store_->pmem_index();
+  BLOCK_INDEX_TYPE first =
+      (BLOCK_INDEX_TYPE)global->first_segment_index() *
+      CONFIG.block_per_segment_;
+  BLOCK_INDEX_TYPE end =
+      (BLOCK_INDEX_TYPE)global->segment_index() * CONFIG.block_per_segment_;
+  // one bit per block of the segments in use, set for the blocks of the
+  // records and chunks some key reaches, all others are free
+  auto used = (std::atomic<uint64_t>*)calloc((end - first + 63) / 64,
+                                             sizeof(uint64_t));
+  std::function<void(BLOCK_INDEX_TYPE, uint64_t)> mark =
+      [&](BLOCK_INDEX_TYPE _block_index, uint64_t _blocks) {
+        // a slot copied half written by a backup could point anywhere
+        if (_block_index < first || _block_index + _blocks > end) return;
+        for (uint64_t i = _block_index - first;
+             i < _block_index - first + _blocks; i++) {
+          used[i / 64].fetch_or(1ULL << (i % 64), std::memory_order_relaxed);
+        }
+      };
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  ParallelRun(threads, index->buckets(), [&](size_t _begin, size_t _end) {
+    index->Recover(_begin * PMEM_SLOTS_PER_BUCKET,
+                   _end * PMEM_SLOTS_PER_BUCKET,
+                   [&](KEY_INDEX_TYPE _index) {
+                     kv_store_->RecoverKey(_index, mark);
+                   });
+  });
+
+  for (SEGMENT_INDEX_TYPE segment = global->first_segment_index();
+       segment < global->segment_index(); segment++) {
+    SegmentSummary* summary = global->summary(segment);
+    if (summary->state_ != SegmentData) continue;
+    uint64_t begin = (uint64_t)segment * CONFIG.block_per_segment_ - first;
+    uint64_t max = begin + CONFIG.block_per_segment_;
+    uint64_t live = 0;
+    // free runs of the segment, dropped if the whole segment turns out free
+    vector<std::pair<BLOCK_INDEX_TYPE, size_t>> runs;
+    uint64_t free_begin = begin;
+    for (uint64_t i = begin; i < max; i++) {
+      uint64_t word = used[i / 64].load(std::memory_order_relaxed);
+      if (word == 0 && i % 64 == 0 && i + 64 <= max) {
+        i += 63;
+        continue;
+      }
+      if (!(word & (1ULL << (i % 64)))) continue;
+      if (i > free_begin) {
+        runs.emplace_back(first + free_begin, i - free_begin);
+      }
+      free_begin = i + 1;
+      live++;
+    }
+    runs.emplace_back(first + free_begin, max - free_begin);
+    if (live > 0) {
+      FreeList* free_list = global->free_list(summary->size_class_);
+      for (auto& run : runs) {
+        free_list->Push(run.first, run.second);
+      }
+    }
+    global->RecoverSegment(segment, live);
+  }
+  free(used);
+  // the newest changes are in the ring, no record is read for them
+  global->change_ring()->Recover(0);
+}
+
 void HashMap::Summary() {
   struct rusage usage {};
   getrusage(RUSAGE_SELF, &usage);
@@ -178,11 +1213,24 @@ void HashMap::Summary() {
 Status NvmEngine::CreateOrOpen(const std::string& _name, Config* _config,
                                DB** _dbptr, FILE* _log_file) {
   if (_config != nullptr) {
-    CONFIG.block_size_ = _config->block_size_;
-    CONFIG.block_per_segment_ = _config->block_per_segment_;
+    CONFIG = *_config;
+  }
+  CONFIG.block_size_classes_ =
+      std::min(std::max(1, CONFIG.block_size_classes_), MAX_SIZE_CLASSES);
+  // UINT32_MAX ends the hash chains
+  if (CONFIG.max_keys_ == 0) CONFIG.max_keys_ = DEFAULT_MAX_KEYS;
+  CONFIG.max_keys_ = std::min<uint64_t>(CONFIG.max_keys_, UINT32_MAX - 1);
+  if (CONFIG.pmem_index_) {
+    // an existing pool keeps the capacity it was created with
+    CONFIG.max_keys_ = PmemIndex::Capacity(CONFIG.max_keys_);
   }
   std::cout << "Init config block size:" << CONFIG.block_size_
-            << " block per segments:" << CONFIG.block_per_segment_ << std::endl;
+            << " size classes:" << CONFIG.block_size_classes_
+            << " block per segments:" << CONFIG.block_per_segment_
+            << " pool size:" << CONFIG.pool_size_
+            << " max keys:" << CONFIG.max_keys_
+            << " pmem index:" << CONFIG.pmem_index_
+            << " storage:" << (int)CONFIG.storage_ << std::endl;
   auto* db = new NvmEngine(_name, _log_file);
   *_dbptr = db;
   return Ok;
@@ -190,25 +1238,230 @@ Status NvmEngine::CreateOrOpen(const std::string& _name, Config* _config,
 
 NvmEngine::NvmEngine(const std::string& _name, FILE* _log_file) {
   LOG = _log_file;
-  char* base;
-  int isPmem;
-  if ((base = (char*)pmem_map_file(_name.c_str(), FILE_SIZE, PMEM_FILE_CREATE,
-                                   0666, 0, &isPmem)) == nullptr) {
+  storage_ = StorageBackend::Create(CONFIG);
+  if ((base_ = storage_->Map(_name, CONFIG.pool_size_)) == nullptr) {
     perror("Pmem map file failed");
     exit(1);
   }
-  hash_map_ = new HashMap(base);
+  bool exists = GlobalMemoryController::ReadPoolHeader(base_, &CONFIG);
+  // segments held by threads belong to a pool opened before
+  AepMemoryController::ResetAll();
+  delete AepMemoryController::global_memory_;
+  AepMemoryController::global_memory_ =
+      new GlobalMemoryController(base_, storage_, CONFIG.pool_size_);
+  auto global = AepMemoryController::global_memory_;
+  // the persistent index is sized by max keys, not by the pool
+  if (global->first_segment_index() >= global->max_segment_index()) {
+    std::cout << "Pool too small for its index, lower Config::max_keys_"
+              << std::endl;
+    exit(1);
+  }
+  bool recover = global->Open(exists);
+  hash_map_ = new HashMap(base_, storage_);
+  if (!CONFIG.value_log_path_.empty()) {
+    value_log_ = new ValueLog;
+    if (!value_log_->Open(CONFIG.value_log_path_) ||
+        (!exists && !value_log_->Truncate())) {
+      perror("Open value log failed");
+      exit(1);
+    }
+    hash_map_->kv_store_->set_value_log(value_log_);
+    // every value may have moved out of the pool
+    recover = recover || value_log_->size() > 0;
+  }
+  if (CONFIG.pmem_index_) {
+    // the index is intact, only the free space has to be found again
+    if (exists) {
+      hash_map_->RecoverIndex();
+    }
+  } else if (recover &&
+             hash_map_->Recovery(base_, CONFIG.pool_size_) != Ok) {
+    std::cout << "Key index full, raise Config::max_keys_" << std::endl;
+    exit(1);
+  }
+  if (CONFIG.persist_threads_ > 0) {
+    persist_ = new PersistExecutor(storage_, CONFIG.persist_threads_);
+    hash_map_->kv_store_->set_persist_executor(persist_);
+  }
+  if (value_log_ != nullptr) {
+    migrator_ = std::thread(&NvmEngine::RunMigrator, this);
+  }
+  if (CONFIG.async_threads_ > 0) {
+    async_ = new AsyncExecutor(hash_map_, CONFIG.async_threads_,
+                               CONFIG.async_batch_);
+  }
+  if (!CONFIG.trace_path_.empty()) {
+    trace_ = TraceRecorder::Open(CONFIG.trace_path_, CONFIG.trace_keys_);
+    if (trace_ == nullptr) {
+      perror("Open trace file failed");
+      exit(1);
+    }
+  }
 }
 
-NvmEngine::~NvmEngine() { delete this->hash_map_; }
+NvmEngine::~NvmEngine() {
+  delete this->async_;
+  delete this->trace_;
+  if (migrator_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(migrator_mutex_);
+      stop_ = true;
+    }
+    migrator_cv_.notify_one();
+    migrator_.join();
+  }
+  delete this->persist_;
+  delete this->hash_map_;
+  delete this->value_log_;
+  // threads exiting later have nothing to give back
+  AepMemoryController::ResetAll();
+  delete AepMemoryController::global_memory_;
+  AepMemoryController::global_memory_ = nullptr;
+  delete this->storage_;
+}
+
+void NvmEngine::RunMigrator() {
+  GlobalMemoryController* global = AepMemoryController::global_memory_;
+  bool migrating = false;
+  std::unique_lock<std::mutex> lock(migrator_mutex_);
+  while (!migrator_cv_.wait_for(lock, std::chrono::milliseconds(100),
+                                [this] { return stop_.load(); })) {
+    // start above the high mark and keep going down to the low one
+    migrating = global->LiveRatio() > (migrating ? CONFIG.tier_low_ratio_
+                                                 : CONFIG.tier_high_ratio_);
+    if (!migrating) continue;
+    lock.unlock();
+    // two turns of the clock at most per round, every key gets a chance
+    // to be read between them
+    uint64_t budget = 2 * (uint64_t)hash_map_->kv_store_->key_count();
+    while (budget > 0 && !stop_ &&
+           global->LiveRatio() > CONFIG.tier_low_ratio_) {
+      uint64_t scan = std::min<uint64_t>(budget, MIGRATE_BATCH * 16);
+      budget -= scan;
+      hash_map_->MigrateCold(MIGRATE_BATCH, scan);
+    }
+    lock.lock();
+  }
+}
 
 Status NvmEngine::Get(const Slice& key, std::string* value) {
-  return hash_map_->Get(key, value);
+  if (trace_ == nullptr) return hash_map_->Get(key, value);
+  uint64_t time = trace_->Now();
+  Status s = hash_map_->Get(key, value);
+  trace_->Record(TraceGet, time, key, s == Ok ? value->size() : 0);
+  return s;
+}
+
+Status NvmEngine::GetReader(const Slice& _key,
+                            std::unique_ptr<ValueReader>* _reader) {
+  return hash_map_->GetReader(_key, _reader);
 }
 
 Status NvmEngine::Set(const Slice& key, const Slice& value) {
  /* if(write_count_++%500 ==0) {
     std::cout << write_count_<<std::endl;
   }*/
-  return hash_map_->Set(key, value);
-}
\ No newline at end of file
+  if (trace_ == nullptr) return hash_map_->Set(key, value);
+  uint64_t time = trace_->Now();
+  Status s = hash_map_->Set(key, value);
+  trace_->Record(TraceSet, time, key, value.size());
+  return s;
+}
+
+void NvmEngine::MultiGet(const Slice* _keys, std::string* _values,
+                         Status* _status, size_t _n) {
+  hash_map_->MultiGet(_keys, _values, _status, _n);
+}
+
+void NvmEngine::MultiSet(const Slice* _keys, const Slice* _values,
+                         Status* _status, size_t _n) {
+  hash_map_->MultiSet(_keys, _values, _status, _n);
+}
+
+void NvmEngine::SetAsync(const Slice& _key, const Slice& _value,
+                         SetCallback _callback) {
+  if (async_ == nullptr) {
+    _callback(hash_map_->Set(_key, _value));
+    return;
+  }
+  AsyncRequest request;
+  request.is_set_ = true;
+  request.key_ = _key.to_string();
+  request.value_ = _value.to_string();
+  request.set_callback_ = std::move(_callback);
+  async_->Submit(std::move(request));
+}
+
+void NvmEngine::GetAsync(const Slice& _key, GetCallback _callback) {
+  if (async_ == nullptr) {
+    std::string value;
+    Status s = hash_map_->Get(_key, &value);
+    _callback(s, value);
+    return;
+  }
+  AsyncRequest request;
+  request.is_set_ = false;
+  request.key_ = _key.to_string();
+  request.get_callback_ = std::move(_callback);
+  async_->Submit(std::move(request));
+}
+
+Status NvmEngine::CompareAndSet(const Slice& _key, const Slice* _expected,
+                                const Slice& _desired) {
+  return hash_map_->ReadModifyWrite(
+      _key, [&](const Slice* _old, std::string* _new) {
+        if (_expected == nullptr ? _old != nullptr
+                                 : _old == nullptr || !(*_old == *_expected)) {
+          return Conflict;
+        }
+        _new->assign(_desired.data(), _desired.size());
+        return Ok;
+      });
+}
+
+Status NvmEngine::Append(const Slice& _key, const Slice& _value) {
+  return hash_map_->ReadModifyWrite(
+      _key, [&](const Slice* _old, std::string* _new) {
+        if (_old != nullptr) {
+          _new->assign(_old->data(), _old->size());
+        }
+        _new->append(_value.data(), _value.size());
+        return Ok;
+      });
+}
+
+Status NvmEngine::Merge(const Slice& _key, const Slice& _operand) {
+  if (!CONFIG.merge_operator_) return InvalidArgument;
+  return hash_map_->ReadModifyWrite(
+      _key, [&](const Slice* _old, std::string* _new) {
+        return CONFIG.merge_operator_(_old, _operand, _new);
+      });
+}
+
+Status NvmEngine::BulkLoad(const Slice* _keys, const Slice* _values,
+                           size_t _n, bool _unique_keys) {
+  return hash_map_->BulkLoad(_keys, _values, _n, _unique_keys);
+}
+
+Status NvmEngine::GetUpdatesSince(uint64_t _since,
+                                  std::unique_ptr<UpdateIterator>* _iter) {
+  ChangeRing* ring = AepMemoryController::global_memory_->change_ring();
+  uint64_t next = _since == 0 ? ring->Oldest() : _since + 1;
+  BLOCK_INDEX_TYPE block_index;
+  if (next < ring->Oldest() ||
+      ring->Get(next, &block_index) == ChangeRing::SlotLost) {
+    return NotFound;
+  }
+  _iter->reset(new ChangeIterator(hash_map_, ring, next));
+  return Ok;
+}
+
+Status NvmEngine::Backup(const std::string& _path, uint64_t _since,
+                         uint64_t* _epoch) {
+  return PoolBackup::Create(AepMemoryController::global_memory_, base_, _path,
+                            _since, _epoch);
+}
+
+Status NvmEngine::ParallelScan(int _n, const ScanCallback& _callback) {
+  return hash_map_->Scan(base_, _n, _callback);
+}
@@ -2,26 +2,40 @@
 #include <libpmem.h>
 #include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include "../include/db.hpp"
+#include "async_executor.h"
+#include "backup.h"
+#include "block_index_array.h"
 #include "define.h"
+#include "epoch.h"
+#include "export.h"
+#include "inline_value_array.h"
+#include "key_filter.h"
+#include "large_value.h"
 #include "memory_cotroller.h"
+#include "persist_executor.h"
+#include "pmem_index.h"
+#include "pool_reader.h"
+#include "storage_backend.h"
+#include "trace.h"
+#include "value_log.h"
 
 using std::atomic;
 using std::string;
 using std::vector;
 
-GlobalMemoryController* AepMemoryController::global_memory_ = new GlobalMemoryController(FILE_SIZE);
-thread_local AepMemoryController* thread_local_aep_controller =
-    new AepMemoryController;
+extern thread_local AepMemoryController* thread_local_aep_controller;
 
-thread_local size_t write_count_{0};
-
-HASH_VALUE DJBHash(const char* _str, size_t _size = 16) {
+inline HASH_VALUE DJBHash(const char* _str, size_t _size = 16) {
   unsigned int hash = 5381;
   for (unsigned int i = 0; i < _size; ++_str, ++i) {
     hash = ((hash << 5) + hash) + (*_str);
@@ -29,90 +43,478 @@ HASH_VALUE DJBHash(const char* _str, size_t _size = 16) {
   return hash;
 }
 
+class SpinLock {
+ public:
+  void lock() {
+    while (flag_.test_and_set(std::memory_order_acquire)) {
+      _mm_pause();
+    }
+  }
+  bool try_lock() { return !flag_.test_and_set(std::memory_order_acquire); }
+  void unlock() { flag_.clear(std::memory_order_release); }
+
+ private:
+  std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
 class Entry {
  public:
   Entry() : head_(UINT32_MAX){};
   ~Entry() = default;
 
   KEY_INDEX_TYPE GetHead() const {
-    return this->head_.load(std::memory_order_relaxed);
+    return this->head_.load(std::memory_order_acquire);
   }
   // Set head and return the old one
   KEY_INDEX_TYPE SetHead(const uint32_t _sn) {
     return this->head_.exchange(_sn, std::memory_order_relaxed);
   }
+  // Publish _sn as head if head is still *_expected, reload it otherwise
+  bool CompareAndSetHead(KEY_INDEX_TYPE* _expected, const uint32_t _sn) {
+    return this->head_.compare_exchange_weak(*_expected, _sn,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed);
+  }
 
  public:
   std::atomic<KEY_INDEX_TYPE> head_;
 };
 
+// Pieces of a value pinned by an epoch guard, see DB::GetReader
+class PoolValueReader : public ValueReader {
+ public:
+  uint64_t size() const override { return size_; }
+
+  size_t Read(uint64_t _offset, size_t _len, char* _buffer) override {
+    size_t done = 0;
+    for (auto& piece : pieces_) {
+      if (done == _len) break;
+      if (_offset >= piece.second) {
+        _offset -= piece.second;
+        continue;
+      }
+      size_t n = std::min<size_t>(piece.second - _offset, _len - done);
+      memcpy(_buffer + done, piece.first + _offset, n);
+      done += n;
+      _offset = 0;
+    }
+    return done;
+  }
+
+  bool NextChunk(Slice* _chunk) override {
+    if (next_ == pieces_.size()) return false;
+    auto& piece = pieces_[next_++];
+    *_chunk = Slice((char*)piece.first, piece.second);
+    return true;
+  }
+
+  void Add(const char* _data, size_t _len) {
+    pieces_.emplace_back(_data, _len);
+    size_ += _len;
+  }
+
+  // Holds a value read from the value log
+  string* copy() { return &copy_; }
+
+ private:
+  // entered before the block index of the key is loaded
+  EpochGuard guard_;
+  vector<std::pair<const char*, size_t>> pieces_;
+  size_t next_ = 0;
+  uint64_t size_ = 0;
+  string copy_;
+};
+
 class KVStore {
  public:
-  explicit KVStore(char* _memBase, bool is_allocate_aep = true)
-      : aep_base_(_memBase) {
-    is_allocate_aep_ = is_allocate_aep;
-    if (is_allocate_aep_) {
+  explicit KVStore(char* _memBase, StorageBackend* _storage,
+                   bool is_allocate_aep = true)
+      : max_keys_(CONFIG.max_keys_),
+        aep_base_(_memBase),
+        storage_(_storage),
+        pmem_index_(AepMemoryController::global_memory_->pmem_index()) {
+    // Gets of inlined values must not read the keys from AEP either
+    is_allocate_aep_ = is_allocate_aep && CONFIG.inline_value_len_ == 0;
+    if (pmem_index_ != nullptr) {
+      // keys and block indexes live in the pool's index, no twin slots
+      is_allocate_aep_ = false;
+    } else if (is_allocate_aep_) {
       BLOCK_INDEX_TYPE block_index;
       if (AepMemoryController::global_memory_->New(&block_index,
-                                                   KV_NUM_MAX * KEY_LEN)) {
+                                                   max_keys_ * KEY_LEN)) {
         this->key_buffer_ =
             _memBase + (uint64_t)block_index * CONFIG.block_size_;
       } else {
         std::cout << "reallocate memory from memory." << std::endl;
-        this->key_buffer_ = new char[KV_NUM_MAX * KEY_LEN];
+        this->key_buffer_ = new char[max_keys_ * KEY_LEN];
+        is_allocate_aep_ = false;
       }
     } else {
-      this->key_buffer_ = new char[KV_NUM_MAX * KEY_LEN];
+      this->key_buffer_ = new char[max_keys_ * KEY_LEN];
     }
 
-    this->next_ = new KEY_INDEX_TYPE[KV_NUM_MAX];
-    this->block_index_ = new BLOCK_INDEX_TYPE[KV_NUM_MAX];
-    this->val_lens_ = new VALUE_LEN_TYPE[KV_NUM_MAX];
-    this->versions_ = new VERSION_TYPE[KV_NUM_MAX]{0};
+    if (pmem_index_ == nullptr) {
+      // 4 byte block indexes as long as the pool allows
+      bool wide = CONFIG.wide_block_index_ ||
+                  CONFIG.pool_size_ / CONFIG.block_size_ >= (1ULL << 31);
+      this->next_ = new KEY_INDEX_TYPE[max_keys_];
+      this->block_index_ = new BlockIndexArray(max_keys_, wide);
+      this->val_lens_ = new VALUE_LEN_TYPE[max_keys_];
+      this->versions_ = new VERSION_TYPE[max_keys_]{0};
+      if (CONFIG.in_place_update_) {
+        this->twins_ = new BlockIndexArray(max_keys_, wide);
+        this->twin_epochs_ = (uint8_t*)calloc(max_keys_, sizeof(uint8_t));
+      }
+      if (CONFIG.inline_value_len_ > 0) {
+        this->inline_values_ =
+            new InlineValueArray(max_keys_, CONFIG.inline_value_len_);
+      }
+    }
+    if (CONFIG.key_filter_) {
+      uint64_t bytes = CONFIG.key_filter_bytes_;
+      if (bytes == 0) {
+        bytes = KeyFilter::Size(max_keys_, CONFIG.key_filter_fp_rate_);
+      }
+      this->filter_ = new KeyFilter(bytes, CONFIG.key_filter_fp_rate_);
+    }
     // TODO: ADD FREE LSIT
   };
   ~KVStore() {
     // delete this->freeList;
-    delete this->next_;
+    delete[] this->next_;
     delete this->block_index_;
-    delete this->versions_;
+    delete[] this->val_lens_;
+    delete[] this->versions_;
+    delete this->twins_;
+    free(this->twin_epochs_);
+    delete this->filter_;
+    delete this->inline_values_;
+    free(this->accessed_);
     if (is_allocate_aep_) {
       BLOCK_INDEX_TYPE block_index =
           (this->key_buffer_ - this->aep_base_) / CONFIG.block_size_;
       AepMemoryController::global_memory_->Delete(block_index,
-                                                  KV_NUM_MAX * KEY_LEN);
+                                                  max_keys_ * KEY_LEN);
     } else {
-      delete this->key_buffer_;
+      delete[] this->key_buffer_;
+    }
+  }
+
+  // Spill cold records to _value_log, see HashMap::MigrateCold
+  void set_value_log(ValueLog* _value_log) {
+    value_log_ = _value_log;
+    accessed_ = (std::atomic<uint64_t>*)calloc((max_keys_ + 63) / 64,
+                                               sizeof(uint64_t));
+  }
+
+  // Pool and value log blocks have to stay below it
+  BLOCK_INDEX_TYPE block_limit() const {
+    if (pmem_index_ != nullptr) return pmem_index_->limit();
+    return block_index_->limit();
+  }
+
+  ValueLog* value_log() const { return value_log_; }
+
+  // Hand record stores to persist threads, see Config::persist_threads_
+  void set_persist_executor(PersistExecutor* _persist) { persist_ = _persist; }
+
+  // Wait for the records written by this thread to be durable
+  void Drain() {
+    if (persist_ != nullptr) {
+      persist_->Wait();
+    }
+    // ring entries and summaries are flushed by the writer itself
+    storage_->Drain();
+  }
+
+  // Read the value of a key under an EpochGuard or the key's lock. The
+  // length comes from the record, val_lens_ may already be a newer write's.
+  Status Read(KEY_INDEX_TYPE _index, string* _value) {
+    // the migrator is welcome to the records of inlined values
+    if (inline_values_ != nullptr && inline_values_->get(_index, _value)) {
+      return Ok;
     }
+    BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+    if (accessed_ != nullptr) {
+      MarkAccessed(_index);
+    }
+    if (block_index & VALUE_LOG_TAG) {
+      return ReadLog(block_index, _value);
+    }
+    const char* record =
+        this->aep_base_ + (uint64_t)block_index * CONFIG.block_size_;
+    VALUE_LEN_TYPE len = *(const VALUE_LEN_TYPE*)record;
+    if (LargeValue::IsLarge(len)) {
+      CopyLarge(record + VALUE_OFFSET, _value);
+      return Ok;
+    }
+    _value->assign(record + VALUE_OFFSET, len);
+    return Ok;
+  }
+
+  // Start loading the record of _index into the cache
+  void Prefetch(KEY_INDEX_TYPE _index) const {
+    BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+    if (block_index & VALUE_LOG_TAG) return;
+    __builtin_prefetch(aep_base_ + (uint64_t)block_index * CONFIG.block_size_);
+  }
+
+  // Collect the value of a key into _reader, under the reader's guard
+  Status OpenReader(KEY_INDEX_TYPE _index, PoolValueReader* _reader);
+
+  // Assemble a large value from the chunks listed in _manifest
+  void CopyLarge(const char* _manifest, string* _value) const;
+
+  // Assemble a record in _buffer and return its length, _flags are or-ed
+  // into the stored value length
+  static size_t EncodeRecord(const Slice& _key, const Slice& _value,
+                             VERSION_TYPE _version, uint64_t _sequence,
+                             char* _buffer, VALUE_LEN_TYPE _flags = 0);
+
+  // Copy the record at _block_index if it is intact and still the one of
+  // change _sequence. A manifest is returned as it is and *_large set.
+  bool ReadChange(BLOCK_INDEX_TYPE _block_index, uint64_t _sequence,
+                  string* _key, string* _value, bool* _large = nullptr);
+
+  // Whether the key at _index still points at _block_index
+  bool IsCurrent(KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index) const {
+    return block_index(_index) == _block_index;
+  }
+
+  uint64_t sequence(BLOCK_INDEX_TYPE _block_index) const {
+    if (_block_index & VALUE_LOG_TAG) {
+      uint64_t sequence = 0;
+      value_log_->Read(LogOffset(_block_index) + SEQUENCE_OFFSET,
+                       (char*)&sequence, SEQUENCE_LEN);
+      return sequence;
+    }
+    return *(uint64_t*)(aep_base_ +
+                        (uint64_t)_block_index * CONFIG.block_size_ +
+                        SEQUENCE_OFFSET);
+  }
+
+  // Write kv pair to pmem, OutOfMemory if neither the pool nor the value
+  // log takes it
+  Status Write(const Slice& _key, const Slice& _value, Entry* _entry);
+
+  Status Update(const Slice& _key, const Slice& _value, KEY_INDEX_TYPE _index);
+
+  // Write and flush a record without draining, return its block index.
+  // The record becomes visible through Insert/Replace after a drain.
+  // An overwrite of _index reuses its twin slot when the size allows.
+  // A full pool sends the record to the value log, INVALID_BLOCK_INDEX if
+  // there is none. Values above VALUE_MAX_LEN are written as chunks and a
+  // manifest, which stay in the pool.
+  BLOCK_INDEX_TYPE WriteRecord(const Slice& _key, const Slice& _value,
+                               VERSION_TYPE _version,
+                               KEY_INDEX_TYPE _index = UINT32_MAX);
+
+  // Link a new key at _index, taken from ReserveKeys, whose record of
+  // _value is durable at _block_index
+  void Insert(KEY_INDEX_TYPE _index, const Slice& _key, const Slice& _value,
+              BLOCK_INDEX_TYPE _block_index, Entry* _entry);
+
+  // Point an existing key at its new durable record and recycle the old one
+  void Replace(KEY_INDEX_TYPE _index, const Slice& _value,
+               BLOCK_INDEX_TYPE _block_index, VERSION_TYPE _version);
+
+  // Hand the change of the record at _block_index to change feed readers,
+  // after Insert/Replace or Link made it current
+  void PublishChange(BLOCK_INDEX_TYPE _block_index) {
+    ChangeRing* ring = AepMemoryController::global_memory_->change_ring();
+    if (ring->capacity() > 0) ring->Publish(sequence(_block_index));
+  }
+
+  // Take a key index for the new _key, UINT32_MAX if the index is full
+  KEY_INDEX_TYPE ReserveKey(const Slice& _key) {
+    if (pmem_index_ != nullptr) return pmem_index_->Claim(_key.data());
+    return ReserveKeys(1);
+  }
+
+  // Give back an index of ReserveKey whose record could not be written,
+  // DRAM ones are not handed out again
+  void Unreserve(KEY_INDEX_TYPE _index) {
+    if (pmem_index_ != nullptr) pmem_index_->Abandon(_index);
+  }
+
+  // Reserve _n consecutive key indexes, UINT32_MAX if the index is full.
+  // Not with the persistent index, which places keys by their hash.
+  KEY_INDEX_TYPE ReserveKeys(size_t _n) {
+    KEY_INDEX_TYPE first = current_key_index_.load();
+    do {
+      if (first + _n > max_keys_) return UINT32_MAX;
+    } while (!current_key_index_.compare_exchange_weak(first, first + _n));
+    return first;
+  }
+
+  // Fill a reserved key index, the key is not reachable until Link
+  void SetKeyInfo(KEY_INDEX_TYPE _index, const Slice& _key,
+                  const Slice& _value, BLOCK_INDEX_TYPE _block_index) {
+    if (pmem_index_ != nullptr) {
+      // a reader finding the key must not be turned away by the filter
+      if (filter_ != nullptr) {
+        filter_->Add(_key.data());
+      }
+      // reachable from here on, nothing is left for Link
+      pmem_index_->Publish(_index, _key.data(), _block_index,
+                           LargeValue::StoredLen(_value.size()));
+      return;
+    }
+    SetInline(_index, _value.data(), _value.size());
+    block_index_->set(_index, _block_index);
+    val_lens_[_index] = LargeValue::StoredLen(_value.size());
+    versions_[_index] = 0;
+    memcpy(key_buffer_ + (uint64_t)_index * KEY_LEN, _key.data(), KEY_LEN);
+  }
+
+  // Publish a filled key index as the head of its bucket
+  void Link(KEY_INDEX_TYPE _index, Entry* _entry) {
+    if (pmem_index_ != nullptr) return;
+    // a reader finding the key must not be turned away by the filter
+    if (filter_ != nullptr) {
+      filter_->Add(key(_index));
+    }
+    KEY_INDEX_TYPE old_head = _entry->GetHead();
+    do {
+      next_[_index] = old_head;
+    } while (!_entry->CompareAndSetHead(&old_head, _index));
+  }
+
+  // Write the records of _n new keys into the key indexes from _first,
+  // persisting each run of consecutive blocks once. All of them are durable
+  // on return. Returns how many were written before space ran out.
+  size_t Load(const Slice* _keys, const Slice* _values, size_t _n,
+              KEY_INDEX_TYPE _first);
+
+  // every slot with the persistent index, empty ones hold no block index
+  KEY_INDEX_TYPE key_count() const {
+    if (pmem_index_ != nullptr) return pmem_index_->capacity();
+    return current_key_index_.load();
+  }
+
+  // False if _key is surely absent, see Config::key_filter_
+  bool MayContain(const Slice& _key) const {
+    return filter_ == nullptr || filter_->MayContain(_key.data());
+  }
+
+  // Clock bit of a key, set by reads and cleared as the migrator passes
+  bool TestAndClearAccessed(KEY_INDEX_TYPE _index) {
+    std::atomic<uint64_t>& word = accessed_[_index / 64];
+    uint64_t bit = 1ULL << (_index % 64);
+    if (!(word.load(std::memory_order_relaxed) & bit)) return false;
+    word.fetch_and(~bit, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Append the pool record of _index padded to whole blocks to _buffer,
+  // false if it is in the value log already or changed while copied
+  bool CopyRecord(KEY_INDEX_TYPE _index, vector<char>* _buffer,
+                  BLOCK_INDEX_TYPE* _block_index);
+
+  // Point _index at its copy at _log_block of the value log and free the
+  // pool blocks, unless the key was written since the copy. Called under
+  // the key's lock.
+  bool MoveToLog(KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index,
+                 uint64_t _sequence, BLOCK_INDEX_TYPE _log_block);
+
+  const char* key(KEY_INDEX_TYPE _index) const {
+    if (pmem_index_ != nullptr) return pmem_index_->key(_index);
+    return key_buffer_ + (uint64_t)_index * KEY_LEN;
+  }
+
+  VERSION_TYPE version(KEY_INDEX_TYPE _index) const {
+    if (pmem_index_ != nullptr) return pmem_index_->version(_index);
+    return versions_[_index];
+  }
+
+  BLOCK_INDEX_TYPE block_index(KEY_INDEX_TYPE _index) const {
+    if (pmem_index_ != nullptr) return pmem_index_->block_index(_index);
+    return block_index_->get(_index);
   }
 
-  // Read key and value according to the index of key
-  void Read(KEY_INDEX_TYPE _index, string* _value) {
-    BLOCK_INDEX_TYPE block_index = block_index_[_index];
-    _value->assign(this->aep_base_ +
-                       (uint64_t)block_index * CONFIG.block_size_ +
-                       VALUE_OFFSET,
-                   val_lens_[_index]);
+  // Stored length, with LARGE_VALUE_FLAG for a manifest
+  VALUE_LEN_TYPE value_len(KEY_INDEX_TYPE _index) const {
+    if (pmem_index_ != nullptr) return pmem_index_->value_len(_index);
+    return val_lens_[_index];
   }
 
-  // Write kv pair to pmem
-  void Write(const Slice& _key, const Slice& _value, Entry* _entry);
+  PmemIndex* pmem_index() const { return pmem_index_; }
 
-  void Update(const Slice& _key, const Slice& _value, KEY_INDEX_TYPE _index);
+  StorageBackend* storage() const { return storage_; }
+
+  // Number of blocks taken by a record with _dataLen bytes of value
+  static int BlockNum(size_t _dataLen) {
+    return (RECORD_FIX_LEN + _dataLen + CONFIG.block_size_ - 1) /
+           CONFIG.block_size_;
+  }
 
   // Recycle value according to its head index
   void Recycle(VALUE_LEN_TYPE _dataLen, BLOCK_INDEX_TYPE _index) {
-    // TODO: ADD freelist
-    int size = (RECORD_FIX_LEN + _dataLen + CONFIG.block_size_ - 1) /
-               CONFIG.block_size_;
-    thread_local_aep_controller->Delete(size, _index);
+    if (_index & VALUE_LOG_TAG) {
+      // the value log is append only, superseded records are only counted
+      value_log_->AddGarbage(BlockNum(_dataLen) * CONFIG.block_size_);
+      return;
+    }
+    if (LargeValue::IsLarge(_dataLen)) {
+      const char* manifest =
+          aep_base_ + (uint64_t)_index * CONFIG.block_size_ + VALUE_OFFSET;
+      RecycleChunks(manifest, ((const ManifestHeader*)manifest)->count_);
+    }
+    thread_local_aep_controller->Delete(
+        BlockNum(LargeValue::RecordLen(_dataLen)), _index);
+  }
+
+  // Recycle the first _count chunks listed in _manifest
+  void RecycleChunks(const char* _manifest, uint32_t _count) {
+    ManifestHeader header;
+    memcpy(&header, _manifest, sizeof(ManifestHeader));
+    for (uint32_t i = 0; i < _count; i++) {
+      uint64_t len = std::min<uint64_t>(
+          header.chunk_len_, header.size_ - (uint64_t)i * header.chunk_len_);
+      thread_local_aep_controller->Delete(LargeValue::BlockNum(len),
+                                          LargeValue::Chunk(_manifest, i));
+    }
+  }
+
+  // Drop the chunks referenced by the manifest of _index from _chunks, the
+  // ones left over after every key are orphans
+  void ClaimChunks(KEY_INDEX_TYPE _index,
+                   std::unordered_map<BLOCK_INDEX_TYPE, uint32_t>* _chunks) {
+    BLOCK_INDEX_TYPE block_index = this->block_index(_index);
+    if (!LargeValue::IsLarge(value_len(_index)) ||
+        (block_index & VALUE_LOG_TAG)) {
+      return;
+    }
+    const char* manifest =
+        aep_base_ + (uint64_t)block_index * CONFIG.block_size_ + VALUE_OFFSET;
+    uint32_t count = ((const ManifestHeader*)manifest)->count_;
+    for (uint32_t i = 0; i < count; i++) {
+      _chunks->erase(LargeValue::Chunk(manifest, i));
+    }
+  }
+
+  static uint64_t LogOffset(BLOCK_INDEX_TYPE _block_index) {
+    return (uint64_t)(_block_index & ~VALUE_LOG_TAG) * CONFIG.block_size_;
+  }
+
+  // Key index of _key in the chain from _entry, or in the persistent index.
+  // UINT32_MAX if absent.
+  KEY_INDEX_TYPE Lookup(const Slice& _key, const Entry& _entry) {
+    if (pmem_index_ != nullptr) return pmem_index_->Find(_key.data());
+    return Find(_key, _entry.GetHead());
   }
 
+  // Recovery of a pool with the persistent index: pass the pool blocks of
+  // the record of _index and of its chunks to _mark(block index, count)
+  void RecoverKey(
+      KEY_INDEX_TYPE _index,
+      const std::function<void(BLOCK_INDEX_TYPE, uint64_t)>& _mark);
+
   KEY_INDEX_TYPE Find(const Slice& _key, KEY_INDEX_TYPE _index) {
     KEY_INDEX_TYPE re = UINT32_MAX;
     while (_index != UINT32_MAX) {
       re = _index;
-      char* temp = key_buffer_ + _index * KEY_LEN;
+      char* temp = key_buffer_ + (uint64_t)_index * KEY_LEN;
       if (memcmp(temp, _key.data(), KEY_LEN) == 0) {
         return re;
       }
@@ -123,66 +525,248 @@ class KVStore {
 
   BLOCK_INDEX_TYPE GetBlockIndex(const Slice& _value);
 
-  void Recovery(BLOCK_INDEX_TYPE _block_index, VALUE_LEN_TYPE _value_len,
+  // False once the key index is full
+  bool Recovery(BLOCK_INDEX_TYPE _block_index, VALUE_LEN_TYPE _value_len,
                 char* _record, Entry* _entry) {
-    KEY_INDEX_TYPE index;
-    index = current_key_index_.fetch_add(1);
+    KEY_INDEX_TYPE index = ReserveKeys(1);
+    if (index == UINT32_MAX) return false;
     auto oldHead = _entry->SetHead(index);
     next_[index] = oldHead;
-    block_index_[index] = _block_index;
+    block_index_->set(index, _block_index);
     val_lens_[index] = _value_len;
     versions_[index] = *(VERSION_TYPE*)(_record + VERSION_OFFSET);
-    memcpy(key_buffer_ + index * KEY_LEN, _record + VAL_SIZE_LEN, KEY_LEN);
+    SetInline(index, _record + VALUE_OFFSET, _value_len);
+    memcpy(key_buffer_ + (uint64_t)index * KEY_LEN, _record + VAL_SIZE_LEN,
+           KEY_LEN);
+    if (filter_ != nullptr) {
+      filter_->Add(key(index));
+    }
+    return true;
   }
 
-  void UpdateKeyInfo(KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index,
-                     VALUE_LEN_TYPE _value_len, VERSION_TYPE _version) {
-    if (_version > versions_[_index]) {
-
-      AepMemoryController::global_memory_->Delete(block_index_[_index], );
-      block_index_[_index] = _block_index;
+  // Keep the newer one of the indexed record and _record at _block_index,
+  // an older one of the same block count becomes the twin slot. Records no
+  // longer referenced are appended to _stale as (block index, value length).
+  // Twins stay in the pool, value log records never become one.
+  void UpdateKeyInfo(
+      KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index,
+      VALUE_LEN_TYPE _value_len, const char* _record,
+      vector<std::pair<BLOCK_INDEX_TYPE, VALUE_LEN_TYPE>>* _stale) {
+    BLOCK_INDEX_TYPE older = _block_index;
+    VALUE_LEN_TYPE older_len = _value_len;
+    // sequence numbers order the writes of a key, versions wrap around
+    if (*(uint64_t*)(_record + SEQUENCE_OFFSET) >
+        sequence(block_index_->get(_index))) {
+      older = block_index_->get(_index);
+      older_len = val_lens_[_index];
+      block_index_->set(_index, _block_index);
       val_lens_[_index] = _value_len;
-      versions_[_index] = _version;
-      AepMemoryController::global_memory_->Delete()
+      versions_[_index] = *(VERSION_TYPE*)(_record + VERSION_OFFSET);
+      SetInline(_index, _record + VALUE_OFFSET, _value_len);
+      // the twin paired the replaced record, it has the same block count
+      if (twins_ != nullptr && twins_->get(_index) != 0) {
+        _stale->emplace_back(twins_->get(_index) - 1, older_len);
+        twins_->set(_index, 0);
+      }
+    }
+    if (twins_ != nullptr && twins_->get(_index) == 0 &&
+        !((older | block_index_->get(_index)) & VALUE_LOG_TAG) &&
+        !LargeValue::IsLarge(older_len | val_lens_[_index]) &&
+        BlockNum(older_len) == BlockNum(val_lens_[_index])) {
+      twins_->set(_index, older + 1);
+      return;
     }
+    _stale->emplace_back(older, older_len);
   }
 
  private:
+  // Memory to build _len bytes for Store in: the buffer the persist thread
+  // copies from, which saves a copy, or _local
+  char* StoreBuffer(size_t _len, char* _local) {
+    return persist_ != nullptr ? persist_->Buffer(_len) : _local;
+  }
+
+  // Copy a record to the pool and flush it, durable after Drain. With
+  // persist threads _record is the last StoreBuffer or memory that stays
+  // put until the drain.
+  void Store(char* _dst, const char* _record, size_t _len) {
+    if (persist_ != nullptr) {
+      persist_->Submit(_dst, _record, _len);
+    } else {
+      storage_->MemcpyNoDrain(_dst, _record, _len);
+    }
+  }
+
+  void MarkAccessed(KEY_INDEX_TYPE _index) {
+    std::atomic<uint64_t>& word = accessed_[_index / 64];
+    uint64_t bit = 1ULL << (_index % 64);
+    // skip the store, and the cache line transfer, once it is set
+    if (!(word.load(std::memory_order_relaxed) & bit)) {
+      word.fetch_or(bit, std::memory_order_relaxed);
+    }
+  }
+
+  Status ReadLog(BLOCK_INDEX_TYPE _block_index, string* _value);
+
+  // Keep or drop the DRAM copy of the value of _index, _len may be a
+  // stored length with LARGE_VALUE_FLAG
+  void SetInline(KEY_INDEX_TYPE _index, const char* _value, size_t _len) {
+    if (inline_values_ != nullptr) {
+      inline_values_->set(_index, _value, _len);
+    }
+  }
+
+  // Readers that loaded the twin before it was replaced are gone. The low
+  // byte of the epoch is kept, a wrapped one only delays the reuse.
+  bool TwinReady(KEY_INDEX_TYPE _index) {
+    if ((uint8_t)(EpochManager::current() - twin_epochs_[_index]) >= 2) {
+      return true;
+    }
+    return (uint8_t)(EpochManager::TryAdvance() - twin_epochs_[_index]) >= 2;
+  }
+
+  // Write a record padded to whole blocks to the value log and sync it,
+  // INVALID_BLOCK_INDEX on failure
+  BLOCK_INDEX_TYPE WriteLogRecord(char* _record, size_t _record_len);
+
+  // WriteRecord of a value up to VALUE_MAX_LEN, _flags go to EncodeRecord.
+  // Flagged records neither take a twin nor go to the value log.
+  BLOCK_INDEX_TYPE StoreRecord(const Slice& _key, const Slice& _value,
+                               VERSION_TYPE _version, KEY_INDEX_TYPE _index,
+                               VALUE_LEN_TYPE _flags);
+
+  // Write the chunks of a large value, drain them and write the manifest
+  BLOCK_INDEX_TYPE WriteLargeRecord(const Slice& _key, const Slice& _value,
+                                    VERSION_TYPE _version);
+
   bool is_allocate_aep_;
   std::atomic<KEY_INDEX_TYPE> current_key_index_ = {0};
+  uint64_t max_keys_;
   KEY_INDEX_TYPE* next_ = nullptr;
-  BLOCK_INDEX_TYPE* block_index_ = nullptr;
+  BlockIndexArray* block_index_ = nullptr;
   VALUE_LEN_TYPE* val_lens_ = nullptr;
-  VERSION_TYPE* versions_;
+  VERSION_TYPE* versions_ = nullptr;
+  // previous record of a key kept for in place overwrites, block index + 1
+  BlockIndexArray* twins_ = nullptr;
+  // epoch in which the twin was unlinked, low byte
+  uint8_t* twin_epochs_ = nullptr;
   char* key_buffer_ = nullptr;
   char* aep_base_ = nullptr;
+  StorageBackend* storage_ = nullptr;
+  ValueLog* value_log_ = nullptr;
+  PersistExecutor* persist_ = nullptr;
+  // clock bits of the keys, one per key index
+  std::atomic<uint64_t>* accessed_ = nullptr;
+  KeyFilter* filter_ = nullptr;
+  // DRAM copies of short values, see Config::inline_value_len_
+  InlineValueArray* inline_values_ = nullptr;
+  // keys, block indexes and lengths instead of the arrays above, see
+  // Config::pmem_index_
+  PmemIndex* pmem_index_ = nullptr;
+};
+
+class HashMap;
+
+// Walks the change ring from a sequence number, see DB::GetUpdatesSince
+class ChangeIterator : public UpdateIterator {
+ public:
+  ChangeIterator(HashMap* _hash_map, ChangeRing* _ring, uint64_t _next)
+      : hash_map_(_hash_map), ring_(_ring), next_(_next) {}
+
+  bool Next() override;
+
+  Status status() const override { return status_; }
+  uint64_t sequence() const override { return sequence_; }
+  const std::string& key() const override { return key_; }
+  const std::string& value() const override { return value_; }
+
+ private:
+  HashMap* hash_map_;
+  ChangeRing* ring_;
+  uint64_t next_;
+  uint64_t sequence_ = 0;
+  Status status_ = Ok;
+  std::string key_;
+  std::string value_;
 };
 
 typedef uint32_t (*hash_func)(const char*, size_t size);
 
+// Compute the new value from the current one (nullptr if absent)
+typedef std::function<Status(const Slice*, std::string*)> modify_func;
+
 class NvmEngine;
 class HashMap {
  public:
-  explicit HashMap(char* _base, hash_func _hash = DJBHash);
+  HashMap(char* _base, StorageBackend* _storage, hash_func _hash = DJBHash);
 
   ~HashMap();
 
   Status Get(const Slice& _key, std::string* _value);
 
+  Status GetReader(const Slice& _key, std::unique_ptr<ValueReader>* _reader);
+
   Status Set(const Slice& _key, const Slice& _value);
 
-  Status Recovery(char* _base);
+  // KVStore::ReadChange of a record that is still the current one of its
+  // key, also assembling a large value
+  bool ReadChange(BLOCK_INDEX_TYPE _block_index, uint64_t _sequence,
+                  string* _key, string* _value);
+
+  // Find, modify and write back a key under its lock: one lookup, one persist
+  Status ReadModifyWrite(const Slice& _key, const modify_func& _modify);
+
+  // Get _n keys, the buckets and then the records of all of them are
+  // prefetched before any is read
+  void MultiGet(const Slice* _keys, std::string* _values, Status* _status,
+                size_t _n);
+
+  // Set _n pairs, persisting all new records with a single drain
+  void MultiSet(const Slice* _keys, const Slice* _values, Status* _status,
+                size_t _n);
+
+  // See DB::BulkLoad
+  Status BulkLoad(const Slice* _keys, const Slice* _values, size_t _n,
+                  bool _unique_keys);
+
+  // See DB::ParallelScan. The data segments are read in order like
+  // Recovery does, a record is passed on if its key still points at it.
+  // Keys whose record was not met there are read by key index afterwards.
+  Status Scan(char* _base, int _threads, const ScanCallback& _callback);
+
+  Status Recovery(char* _base, uint64_t _size);
+
+  // Recovery of a pool with the persistent index: rebuild the free space
+  // from the blocks the keys reach, no record is read but manifests
+  void RecoverIndex();
+
+  // Move up to _max records whose keys were not read since the clock last
+  // passed them to the value log, looking at _scan keys at most. Returns
+  // how many were moved.
+  size_t MigrateCold(size_t _max, uint64_t _scan);
 
   void Summary();
 
   KVStore* kv_store_;
 
  private:
-  Entry& entry(const uint32_t _hash) { return entries_[_hash % HASH_MAP_SIZE]; }
+  Entry& entry(const uint32_t _hash) { return entries_[_hash % buckets_]; }
+
+  // Writers of a key serialize on its lock, readers never take it
+  SpinLock& lock(const uint32_t _hash) { return locks_[_hash % LOCK_NUM]; }
+
+  // Index the records of the value log after the pool's, false once the
+  // key index is full
+  bool RecoverValueLog(uint64_t* _max_sequence);
 
  private:
+  // scaled from HASH_MAP_SIZE by Config::max_keys_
+  uint64_t buckets_;
   Entry* entries_;
+  SpinLock* locks_;
   hash_func hash_;
+  // next key index the migrator looks at
+  uint64_t clock_hand_ = 0;
 };
 
 class NvmEngine : DB {
@@ -199,8 +783,56 @@ class NvmEngine : DB {
 
   Status Get(const Slice& _key, std::string* _value) override;
 
+  Status GetReader(const Slice& _key,
+                   std::unique_ptr<ValueReader>* _reader) override;
+
   Status Set(const Slice& _key, const Slice& _value) override;
 
+  void MultiGet(const Slice* _keys, std::string* _values, Status* _status,
+                size_t _n) override;
+
+  void MultiSet(const Slice* _keys, const Slice* _values, Status* _status,
+                size_t _n) override;
+
+  using DB::SetAsync;
+  using DB::GetAsync;
+
+  void SetAsync(const Slice& _key, const Slice& _value,
+                SetCallback _callback) override;
+
+  void GetAsync(const Slice& _key, GetCallback _callback) override;
+
+  Status CompareAndSet(const Slice& _key, const Slice* _expected,
+                       const Slice& _desired) override;
+
+  Status Append(const Slice& _key, const Slice& _value) override;
+
+  Status Merge(const Slice& _key, const Slice& _operand) override;
+
+  Status BulkLoad(const Slice* _keys, const Slice* _values, size_t _n,
+                  bool _unique_keys) override;
+
+  Status GetUpdatesSince(uint64_t _since,
+                         std::unique_ptr<UpdateIterator>* _iter) override;
+
+  Status Backup(const std::string& _path, uint64_t _since,
+                uint64_t* _epoch) override;
+
+  Status ParallelScan(int _n, const ScanCallback& _callback) override;
+
  private:
+  // Move cold values to the value log while the pool is short of space
+  void RunMigrator();
+
+  char* base_ = nullptr;
+  StorageBackend* storage_;
   HashMap* hash_map_;
+  AsyncExecutor* async_ = nullptr;
+  PersistExecutor* persist_ = nullptr;
+  ValueLog* value_log_ = nullptr;
+  TraceRecorder* trace_ = nullptr;
+  std::thread migrator_;
+  std::mutex migrator_mutex_;
+  std::condition_variable migrator_cv_;
+  std::atomic<bool> stop_{false};
 };
\ No newline at end of file
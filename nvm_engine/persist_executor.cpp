@@ -0,0 +1,187 @@
+#include "persist_executor.h"
+#include <emmintrin.h>
+
+std::mutex PersistExecutor::registry_mutex_;
+std::atomic<PersistRing*> PersistExecutor::rings_[MAX_RINGS];
+std::atomic<size_t> PersistExecutor::ring_count_{0};
+
+// Holds the ring of a thread, given back when the thread exits
+struct ThreadPersistRing {
+  PersistRing* ring_ = nullptr;
+  // every ring was taken, the thread stores its records itself
+  bool inline_ = false;
+  std::vector<char> buffer_;
+  ~ThreadPersistRing() {
+    if (ring_ != nullptr) PersistExecutor::Release(ring_);
+  }
+};
+
+static thread_local ThreadPersistRing thread_ring;
+
+// Spin a little, then give up the core
+static void Backoff(int _spin) {
+  if (_spin < 16) {
+    _mm_pause();
+  } else {
+    std::this_thread::yield();
+  }
+}
+
+PersistExecutor::PersistExecutor(StorageBackend* _storage, int _threads)
+    : storage_(_storage) {
+  for (int i = 0; i < _threads; i++) {
+    workers_.push_back(new Worker);
+  }
+  for (int i = 0; i < _threads; i++) {
+    workers_[i]->thread_ = std::thread(&PersistExecutor::Run, this, i);
+  }
+}
+
+PersistExecutor::~PersistExecutor() {
+  stop_ = true;
+  for (auto worker : workers_) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex_);
+    }
+    worker->cv_.notify_all();
+  }
+  for (auto worker : workers_) {
+    worker->thread_.join();
+    delete worker;
+  }
+}
+
+PersistRing* PersistExecutor::Acquire() {
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  size_t count = ring_count_.load();
+  for (size_t i = 0; i < count; i++) {
+    PersistRing* ring = rings_[i].load();
+    if (!ring->in_use_.load() && !ring->in_use_.exchange(true)) return ring;
+  }
+  if (count == MAX_RINGS) return nullptr;
+  auto* ring = new PersistRing;
+  ring->index_ = count;
+  rings_[count].store(ring);
+  ring_count_.store(count + 1, std::memory_order_release);
+  return ring;
+}
+
+PersistRing* PersistExecutor::ring() {
+  if (thread_ring.ring_ == nullptr) {
+    if (thread_ring.inline_) return nullptr;
+    thread_ring.ring_ = Acquire();
+    thread_ring.inline_ = thread_ring.ring_ == nullptr;
+    if (thread_ring.inline_) return nullptr;
+  }
+  PersistRing* ring = thread_ring.ring_;
+  uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+  // the slot is free once the persist thread is done with its last use
+  for (int spin = 0;
+       tail - ring->head_.load(std::memory_order_acquire) >=
+       PersistRing::SLOTS;
+       spin++) {
+    Backoff(spin);
+  }
+  return ring;
+}
+
+char* PersistExecutor::Buffer(size_t _len) {
+  PersistRing* ring = this->ring();
+  std::vector<char>& buffer =
+      ring == nullptr
+          ? thread_ring.buffer_
+          : ring->requests_[ring->tail_.load(std::memory_order_relaxed) %
+                            PersistRing::SLOTS]
+                .buffer_;
+  if (buffer.size() < _len) buffer.resize(_len);
+  return buffer.data();
+}
+
+void PersistExecutor::Submit(void* _dst, const void* _src, size_t _len) {
+  PersistRing* ring = this->ring();
+  if (ring == nullptr) {
+    storage_->MemcpyNoDrain(_dst, _src, _len);
+    return;
+  }
+  uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+  PersistRequest& request = ring->requests_[tail % PersistRing::SLOTS];
+  request.dst_ = _dst;
+  request.src_ = (const char*)_src;
+  request.len_ = _len;
+  // pairs with the persist thread announcing that it sleeps
+  ring->tail_.store(tail + 1, std::memory_order_seq_cst);
+  Worker* worker = workers_[ring->index_ % workers_.size()];
+  if (worker->sleeping_.load(std::memory_order_seq_cst)) {
+    {
+      std::lock_guard<std::mutex> lock(worker->mutex_);
+    }
+    worker->cv_.notify_one();
+  }
+}
+
+void PersistExecutor::Wait() {
+  PersistRing* ring = thread_ring.ring_;
+  if (ring == nullptr) return;
+  uint64_t tail = ring->tail_.load(std::memory_order_relaxed);
+  // a pass of the persist thread takes a few microseconds
+  for (int spin = 0; ring->head_.load(std::memory_order_acquire) < tail;
+       spin++) {
+    Backoff(spin);
+  }
+}
+
+bool PersistExecutor::Pending(size_t _worker) const {
+  size_t count = ring_count_.load(std::memory_order_acquire);
+  for (size_t i = _worker; i < count; i += workers_.size()) {
+    PersistRing* ring = rings_[i].load(std::memory_order_acquire);
+    if (ring->tail_.load(std::memory_order_seq_cst) !=
+        ring->head_.load(std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PersistExecutor::Run(size_t _worker) {
+  Worker* worker = workers_[_worker];
+  std::vector<std::pair<PersistRing*, uint64_t>> taken;
+  int idle = 0;
+  for (;;) {
+    size_t count = ring_count_.load(std::memory_order_acquire);
+    for (size_t i = _worker; i < count; i += workers_.size()) {
+      PersistRing* ring = rings_[i].load(std::memory_order_acquire);
+      uint64_t head = ring->head_.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail_.load(std::memory_order_acquire);
+      if (head == tail) continue;
+      for (uint64_t j = head; j < tail; j++) {
+        PersistRequest& request = ring->requests_[j % PersistRing::SLOTS];
+        storage_->MemcpyNoDrain(request.dst_, request.src_, request.len_);
+      }
+      taken.emplace_back(ring, tail);
+    }
+    if (!taken.empty()) {
+      // one drain for the records of every ring
+      storage_->Drain();
+      for (auto& ring : taken) {
+        ring.first->head_.store(ring.second, std::memory_order_release);
+      }
+      taken.clear();
+      idle = 0;
+      continue;
+    }
+    if (stop_.load()) return;
+    if (++idle < IDLE_POLLS) {
+      std::this_thread::yield();
+      continue;
+    }
+    // a writer checks sleeping_ after its tail, one of the two sees the
+    // other
+    std::unique_lock<std::mutex> lock(worker->mutex_);
+    worker->sleeping_.store(true, std::memory_order_seq_cst);
+    if (!Pending(_worker) && !stop_.load()) {
+      worker->cv_.wait(lock);
+    }
+    worker->sleeping_.store(false, std::memory_order_relaxed);
+    idle = 0;
+  }
+}
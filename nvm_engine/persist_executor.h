@@ -0,0 +1,96 @@
+//
+// Created by andyshen on 2/17/21.
+//
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "storage_backend.h"
+
+// A record on its way to the pool. _src_ is the request's own buffer or
+// memory of the writer that stays put until Wait returns.
+struct PersistRequest {
+  void* dst_ = nullptr;
+  const char* src_ = nullptr;
+  size_t len_ = 0;
+  std::vector<char> buffer_;
+};
+
+// Requests of one writer thread, taken by one persist thread: the writer
+// only moves tail_ and the persist thread only head_, neither locks. Rings
+// of exited threads are reused, they are empty once their writer waited.
+struct PersistRing {
+  static const uint64_t SLOTS = 64;
+
+  PersistRequest requests_[SLOTS];
+  // requests submitted so far
+  std::atomic<uint64_t> tail_{0};
+  // keeps the counters of the two threads on lines of their own
+  char pad_[CACHE_LINE_SIZE - sizeof(uint64_t)];
+  // requests durable so far
+  std::atomic<uint64_t> head_{0};
+  char head_pad_[CACHE_LINE_SIZE - sizeof(uint64_t)];
+  std::atomic<bool> in_use_{true};
+  // place in the registry, ring i goes to persist thread i % threads
+  size_t index_ = 0;
+};
+
+// Write delegation: AEP write bandwidth peaks at a few writers, so with
+// many client threads only a few persist threads store to the pool. Every
+// writer thread hands its records over through a ring of its own, each
+// persist thread polls the rings given to it, copies every record they
+// hold and drains once for all of them.
+class PersistExecutor {
+ public:
+  PersistExecutor(StorageBackend* _storage, int _threads);
+  ~PersistExecutor();
+
+  // Buffer of at least _len bytes to build the next record of this thread
+  // in, to Submit it without another copy. Valid until that Submit.
+  char* Buffer(size_t _len);
+
+  // Copy _len bytes of _src to _dst on a persist thread, see Wait. _src is
+  // the last Buffer or memory that stays unchanged until Wait returns.
+  void Submit(void* _dst, const void* _src, size_t _len);
+
+  // Wait until the records submitted by this thread are durable
+  void Wait();
+
+  // Take a free ring or register a new one, for a thread's first write.
+  // nullptr once MAX_RINGS threads hold one.
+  static PersistRing* Acquire();
+
+  static void Release(PersistRing* _ring) { _ring->in_use_.store(false); }
+
+ private:
+  // A persist thread and what lets it sleep while its rings are empty
+  struct Worker {
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> sleeping_{false};
+  };
+
+  // polls of empty rings before a persist thread sleeps
+  static const int IDLE_POLLS = 256;
+  static const size_t MAX_RINGS = 4096;
+
+  void Run(size_t _worker);
+
+  // Whether a ring of _worker holds requests not taken yet
+  bool Pending(size_t _worker) const;
+
+  // The ring of the calling thread, waiting for a free slot in it
+  PersistRing* ring();
+
+  StorageBackend* storage_;
+  std::vector<Worker*> workers_;
+  std::atomic<bool> stop_{false};
+
+  // rings are never freed, the persist threads read them without a lock
+  static std::mutex registry_mutex_;
+  static std::atomic<PersistRing*> rings_[MAX_RINGS];
+  static std::atomic<size_t> ring_count_;
+};
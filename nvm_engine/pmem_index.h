@@ -0,0 +1,200 @@
+//
+// Created by andyshen on 2/23/21.
+//
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "define.h"
+#include "storage_backend.h"
+
+// Slot of a key in the persistent index. word_ packs the block index of the
+// record, with the value log tag in bit 47, and the stored value length in
+// the top 16 bits. Slots never straddle a cache line, a line written back
+// with the word also carries the key stored before it.
+struct PmemSlot {
+  char key_[KEY_LEN];
+  std::atomic<uint64_t> word_;
+  VERSION_TYPE version_;
+  char pad_[6];
+};
+
+static const uint32_t PMEM_SLOTS_PER_BUCKET = 8;
+static const uint64_t PMEM_BUCKET_SIZE =
+    PMEM_SLOTS_PER_BUCKET * sizeof(PmemSlot);
+
+// Hash index kept in the pool after the change ring, see Config::pmem_index_.
+// The key index is the slot number. A key takes the first free slot from its
+// home bucket on, looking at PROBE_BUCKETS buckets at most. Keys are never
+// removed, so a lookup stops at the first empty slot. An insert claims its
+// slot with a CAS, writes the key and then stores and persists the word.
+// Claims of failed inserts are abandoned: lookups pass over them and later
+// inserts take them again. Claims left by a crash are abandoned on open.
+class PmemIndex {
+ public:
+  PmemIndex(PmemSlot* _slots, uint64_t _buckets, StorageBackend* _storage)
+      : slots_(_slots), buckets_(_buckets), storage_(_storage) {}
+
+  // Slots for _keys keys at three quarters load, in whole buckets
+  static uint64_t Capacity(uint64_t _keys) {
+    uint64_t buckets = (_keys * 4 / 3 + PMEM_SLOTS_PER_BUCKET - 1) /
+                       PMEM_SLOTS_PER_BUCKET;
+    // UINT32_MAX is no key index
+    buckets = std::min<uint64_t>(std::max<uint64_t>(1, buckets),
+                                 (UINT32_MAX - 1) / PMEM_SLOTS_PER_BUCKET);
+    return buckets * PMEM_SLOTS_PER_BUCKET;
+  }
+
+  KEY_INDEX_TYPE Find(const char* _key) const {
+    uint64_t bucket = Hash(_key) % buckets_;
+    for (uint32_t i = 0; i < PROBE_BUCKETS; i++, bucket++) {
+      uint64_t first = bucket % buckets_ * PMEM_SLOTS_PER_BUCKET;
+      for (uint64_t slot = first; slot < first + PMEM_SLOTS_PER_BUCKET;
+           slot++) {
+        uint64_t word = slots_[slot].word_.load(std::memory_order_acquire);
+        if (word == 0) return UINT32_MAX;
+        if (Valid(word) && memcmp(slots_[slot].key_, _key, KEY_LEN) == 0) {
+          return slot;
+        }
+      }
+    }
+    return UINT32_MAX;
+  }
+
+  // Claim a slot for _key, which is absent and locked by the caller.
+  // UINT32_MAX if the buckets it may go to are full.
+  KEY_INDEX_TYPE Claim(const char* _key) {
+    uint64_t bucket = Hash(_key) % buckets_;
+    for (uint32_t i = 0; i < PROBE_BUCKETS; i++, bucket++) {
+      uint64_t first = bucket % buckets_ * PMEM_SLOTS_PER_BUCKET;
+      for (uint64_t slot = first; slot < first + PMEM_SLOTS_PER_BUCKET;
+           slot++) {
+        std::atomic<uint64_t>& word = slots_[slot].word_;
+        uint64_t old_word = word.load(std::memory_order_relaxed);
+        while (old_word == 0 || old_word == ABANDONED) {
+          if (word.compare_exchange_weak(old_word, CLAIMED)) return slot;
+        }
+      }
+    }
+    return UINT32_MAX;
+  }
+
+  // Give up a claim whose record could not be written
+  void Abandon(KEY_INDEX_TYPE _index) {
+    slots_[_index].word_.store(ABANDONED, std::memory_order_release);
+  }
+
+  // Fill a claimed slot and make the key reachable, durable on return
+  void Publish(KEY_INDEX_TYPE _index, const char* _key,
+               BLOCK_INDEX_TYPE _block_index, VALUE_LEN_TYPE _len) {
+    PmemSlot& slot = slots_[_index];
+    memcpy(slot.key_, _key, KEY_LEN);
+    slot.version_ = 0;
+    slot.word_.store(Pack(_block_index, _len), std::memory_order_release);
+    storage_->Persist(&slot, sizeof(PmemSlot));
+  }
+
+  // Point a key at its new record, durable on return: the old record may
+  // be handed out again right after
+  void Update(KEY_INDEX_TYPE _index, BLOCK_INDEX_TYPE _block_index,
+              VALUE_LEN_TYPE _len, VERSION_TYPE _version) {
+    PmemSlot& slot = slots_[_index];
+    slot.version_ = _version;
+    slot.word_.store(Pack(_block_index, _len), std::memory_order_release);
+    storage_->Persist(&slot, sizeof(PmemSlot));
+  }
+
+  // Call _func(index) for every key in slots [_begin, _end) of a pool
+  // being opened, abandoning the claims of inserts cut short by a crash
+  template <typename Func>
+  void Recover(uint64_t _begin, uint64_t _end, const Func& _func) {
+    for (uint64_t i = _begin; i < _end; i++) {
+      uint64_t word = slots_[i].word_.load(std::memory_order_relaxed);
+      if (word == CLAIMED) {
+        slots_[i].word_.store(ABANDONED, std::memory_order_relaxed);
+        storage_->Flush(&slots_[i], sizeof(PmemSlot));
+      } else if (Valid(word)) {
+        _func((KEY_INDEX_TYPE)i);
+      }
+    }
+    storage_->Drain();
+  }
+
+  // INVALID_BLOCK_INDEX for a slot holding no key
+  BLOCK_INDEX_TYPE block_index(KEY_INDEX_TYPE _index) const {
+    return BlockIndex(word(_index));
+  }
+
+  VALUE_LEN_TYPE value_len(KEY_INDEX_TYPE _index) const {
+    return ValueLen(word(_index));
+  }
+
+  // Block index and length of a key as one value. Every write of the key
+  // changes it, as a new record never takes the blocks of the current one.
+  uint64_t word(KEY_INDEX_TYPE _index) const {
+    return slots_[_index].word_.load(std::memory_order_acquire);
+  }
+
+  static BLOCK_INDEX_TYPE BlockIndex(uint64_t _word) {
+    if (!Valid(_word)) return INVALID_BLOCK_INDEX;
+    BLOCK_INDEX_TYPE block_index = _word & (LOG_BIT - 1);
+    if (_word & LOG_BIT) block_index |= VALUE_LOG_TAG;
+    return block_index;
+  }
+
+  static VALUE_LEN_TYPE ValueLen(uint64_t _word) { return _word >> LEN_SHIFT; }
+
+  const char* key(KEY_INDEX_TYPE _index) const { return slots_[_index].key_; }
+
+  VERSION_TYPE version(KEY_INDEX_TYPE _index) const {
+    return slots_[_index].version_;
+  }
+
+  void Format() {
+    memset((void*)slots_, 0, size());
+    storage_->Persist(slots_, size());
+  }
+
+  uint64_t buckets() const { return buckets_; }
+
+  uint64_t capacity() const { return buckets_ * PMEM_SLOTS_PER_BUCKET; }
+
+  uint64_t size() const { return buckets_ * PMEM_BUCKET_SIZE; }
+
+  // Pool and value log blocks have to stay below it
+  BLOCK_INDEX_TYPE limit() const { return LOG_BIT; }
+
+ private:
+  static const uint32_t PROBE_BUCKETS = 16;
+  static const int LEN_SHIFT = 48;
+  static const uint64_t LOG_BIT = 1ULL << 47;
+  static const uint64_t BLOCK_MASK = (1ULL << LEN_SHIFT) - 1;
+  // block index 0 is the pool header, no record lives there
+  static const uint64_t CLAIMED = 0xffffULL << LEN_SHIFT;
+  static const uint64_t ABANDONED = 0xfffeULL << LEN_SHIFT;
+
+  static bool Valid(uint64_t _word) { return (_word & BLOCK_MASK) != 0; }
+
+  static uint64_t Pack(BLOCK_INDEX_TYPE _block_index, VALUE_LEN_TYPE _len) {
+    uint64_t word = _block_index & ~VALUE_LOG_TAG;
+    if (_block_index & VALUE_LOG_TAG) word |= LOG_BIT;
+    return word | (uint64_t)_len << LEN_SHIFT;
+  }
+
+  // Mix the two halves of the key, DJBHash only spreads the lock stripes
+  static uint64_t Hash(const char* _key) {
+    uint64_t low, high;
+    memcpy(&low, _key, sizeof(uint64_t));
+    memcpy(&high, _key + sizeof(uint64_t), sizeof(uint64_t));
+    uint64_t hash = (low * 0xbf58476d1ce4e5b9ULL) ^ high;
+    hash ^= hash >> 31;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 29;
+    return hash;
+  }
+
+  PmemSlot* slots_;
+  uint64_t buckets_;
+  StorageBackend* storage_;
+};
@@ -0,0 +1,255 @@
+#include "pool_reader.h"
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nvm_engine.hpp"
+
+Status PoolReader::Attach(const std::string& _name, Config* _config,
+                          DB** _db) {
+  int fd = open(_name.c_str(), O_RDONLY);
+  if (fd < 0) return IOError;
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(PoolHeader)) {
+    close(fd);
+    return IOError;
+  }
+  void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return IOError;
+  auto* reader = new PoolReader;
+  reader->base_ = (char*)base;
+  reader->size_ = st.st_size;
+
+  // the global CONFIG belongs to the engines open in this process
+  Config& config = reader->config_;
+  config = *_config;
+  config.pool_size_ = st.st_size;
+  // without the persistent index the keys are only in the writer's DRAM
+  if (!GlobalMemoryController::ReadPoolHeader(reader->base_, &config) ||
+      !config.pmem_index_) {
+    delete reader;
+    return InvalidArgument;
+  }
+  uint64_t index_offset =
+      GlobalMemoryController::IndexOffset(config.pool_size_, config);
+  uint64_t buckets = config.max_keys_ / PMEM_SLOTS_PER_BUCKET;
+  if (index_offset + buckets * PMEM_BUCKET_SIZE > reader->size_) {
+    delete reader;
+    return IOError;
+  }
+  // the slots are only loaded, the mapping would fault on a store
+  reader->index_ = new PmemIndex((PmemSlot*)(reader->base_ + index_offset),
+                                 buckets, nullptr);
+  reader->pool_blocks_ = config.pool_size_ / config.block_size_;
+  if (!config.value_log_path_.empty()) {
+    reader->value_log_ = new ValueLog;
+    if (!reader->value_log_->OpenReadOnly(config.value_log_path_)) {
+      delete reader;
+      return IOError;
+    }
+  }
+  *_db = reader;
+  return Ok;
+}
+
+PoolReader::~PoolReader() {
+  delete index_;
+  delete value_log_;
+  if (base_ != nullptr) {
+    munmap(base_, size_);
+  }
+}
+
+Status PoolReader::Get(const Slice& _key, std::string* _value) {
+  for (int i = 0; i < MAX_READ_TRIES; i++) {
+    KEY_INDEX_TYPE index = index_->Find(_key.data());
+    if (index == UINT32_MAX) return NotFound;
+    uint64_t word = index_->word(index);
+    BLOCK_INDEX_TYPE block_index = PmemIndex::BlockIndex(word);
+    if (block_index & VALUE_LOG_TAG) {
+      // the log is append only, its records never change
+      if (CopyLogValue(_key, block_index, _value)) return Ok;
+    } else {
+      uint64_t sequence;
+      bool copied = CopyValue(_key, block_index, PmemIndex::ValueLen(word),
+                              _value, &sequence);
+      // the checks below must not be loaded before the copy
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // a freed record is only written again after the slot moved on, and
+      // the rewrite carries a new sequence number
+      if (copied && index_->word(index) == word &&
+          *(volatile uint64_t*)(base_ +
+                                (uint64_t)block_index * config_.block_size_ +
+                                SEQUENCE_OFFSET) == sequence) {
+        return Ok;
+      }
+    }
+    _mm_pause();
+  }
+  return IOError;
+}
+
+bool PoolReader::CopyValue(const Slice& _key, BLOCK_INDEX_TYPE _block_index,
+                           VALUE_LEN_TYPE _stored_len, std::string* _value,
+                           uint64_t* _sequence) const {
+  VALUE_LEN_TYPE len = LargeValue::RecordLen(_stored_len);
+  if (len > VALUE_MAX_LEN ||
+      !InPool(_block_index, Blocks(RECORD_FIX_LEN + len))) {
+    return false;
+  }
+  char record[RECORD_FIX_LEN + VALUE_MAX_LEN];
+  size_t record_len = RECORD_FIX_LEN + len;
+  memcpy(record, base_ + (uint64_t)_block_index * config_.block_size_,
+         record_len);
+  HASH_VALUE check_sum;
+  memcpy(&check_sum, record + record_len - CHECK_SUM_LEN, CHECK_SUM_LEN);
+  if (*(VALUE_LEN_TYPE*)record != _stored_len ||
+      memcmp(record + KEY_OFFSET, _key.data(), KEY_LEN) != 0 ||
+      DJBHash(record, record_len - CHECK_SUM_LEN) != check_sum) {
+    return false;
+  }
+  memcpy(_sequence, record + SEQUENCE_OFFSET, SEQUENCE_LEN);
+  const char* value = record + VALUE_OFFSET;
+  if (!LargeValue::IsLarge(_stored_len)) {
+    _value->assign(value, len);
+    return true;
+  }
+  // chunks may be freed and reused while copied, Get checks afterwards
+  ManifestHeader header;
+  memcpy(&header, value, sizeof(ManifestHeader));
+  if (header.count_ > MAX_CHUNKS || header.chunk_len_ == 0 ||
+      header.size_ > (uint64_t)header.count_ * header.chunk_len_) {
+    return false;
+  }
+  _value->resize(header.size_);
+  for (uint32_t i = 0; i < header.count_; i++) {
+    uint64_t offset = (uint64_t)i * header.chunk_len_;
+    uint64_t chunk_len =
+        std::min<uint64_t>(header.chunk_len_, header.size_ - offset);
+    BLOCK_INDEX_TYPE chunk = LargeValue::Chunk(value, i);
+    if (!InPool(chunk, Blocks(sizeof(ChunkHeader) + chunk_len))) return false;
+    const char* data = base_ + (uint64_t)chunk * config_.block_size_;
+    memcpy(&(*_value)[offset], data + sizeof(ChunkHeader), chunk_len);
+  }
+  return true;
+}
+
+bool PoolReader::CopyLogValue(const Slice& _key, BLOCK_INDEX_TYPE _block_index,
+                              std::string* _value) const {
+  if (value_log_ == nullptr) return false;
+  char record[RECORD_FIX_LEN + VALUE_MAX_LEN];
+  uint64_t offset =
+      (uint64_t)(_block_index & ~VALUE_LOG_TAG) * config_.block_size_;
+  ssize_t n = value_log_->Read(offset, record, sizeof(record));
+  if (n < RECORD_FIX_LEN) return false;
+  VALUE_LEN_TYPE len = *(VALUE_LEN_TYPE*)record;
+  size_t record_len = RECORD_FIX_LEN + len;
+  if (len > VALUE_MAX_LEN || (size_t)n < record_len) return false;
+  HASH_VALUE check_sum;
+  memcpy(&check_sum, record + record_len - CHECK_SUM_LEN, CHECK_SUM_LEN);
+  if (memcmp(record + KEY_OFFSET, _key.data(), KEY_LEN) != 0 ||
+      DJBHash(record, record_len - CHECK_SUM_LEN) != check_sum) {
+    return false;
+  }
+  _value->assign(record + VALUE_OFFSET, len);
+  return true;
+}
+
+Status PoolReader::GetReader(const Slice& _key,
+                             std::unique_ptr<ValueReader>* _reader) {
+  // pool memory can be reused under a reader, it gets a copy
+  std::unique_ptr<PoolValueReader> reader(new PoolValueReader);
+  Status s = Get(_key, reader->copy());
+  if (s != Ok) return s;
+  reader->Add(reader->copy()->data(), reader->copy()->size());
+  *_reader = std::move(reader);
+  return Ok;
+}
+
+Status PoolReader::Set(const Slice&, const Slice&) {
+  return InvalidArgument;
+}
+
+void PoolReader::MultiGet(const Slice* _keys, std::string* _values,
+                          Status* _status, size_t _n) {
+  for (size_t i = 0; i < _n; i++) {
+    _status[i] = Get(_keys[i], &_values[i]);
+  }
+}
+
+void PoolReader::MultiSet(const Slice*, const Slice*, Status* _status,
+                          size_t _n) {
+  for (size_t i = 0; i < _n; i++) {
+    _status[i] = InvalidArgument;
+  }
+}
+
+void PoolReader::SetAsync(const Slice&, const Slice&, SetCallback _callback) {
+  _callback(InvalidArgument);
+}
+
+void PoolReader::GetAsync(const Slice& _key, GetCallback _callback) {
+  std::string value;
+  Status s = Get(_key, &value);
+  _callback(s, value);
+}
+
+Status PoolReader::CompareAndSet(const Slice&, const Slice*, const Slice&) {
+  return InvalidArgument;
+}
+
+Status PoolReader::Append(const Slice&, const Slice&) {
+  return InvalidArgument;
+}
+
+Status PoolReader::Merge(const Slice&, const Slice&) {
+  return InvalidArgument;
+}
+
+Status PoolReader::BulkLoad(const Slice*, const Slice*, size_t, bool) {
+  return InvalidArgument;
+}
+
+Status PoolReader::Backup(const std::string&, uint64_t, uint64_t*) {
+  return InvalidArgument;
+}
+
+Status PoolReader::GetUpdatesSince(uint64_t,
+                                   std::unique_ptr<UpdateIterator>*) {
+  return InvalidArgument;
+}
+
+Status PoolReader::ParallelScan(int _n, const ScanCallback& _callback) {
+  if (_n <= 0) _n = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t slots = index_->capacity();
+  std::vector<std::thread> threads;
+  std::atomic<bool> failed{false};
+  for (int part = 0; part < _n; part++) {
+    threads.emplace_back([&, part]() {
+      std::string value;
+      uint64_t end = slots * (part + 1) / _n;
+      for (uint64_t i = slots * part / _n; i < end; i++) {
+        if (index_->block_index(i) == INVALID_BLOCK_INDEX) continue;
+        char key[KEY_LEN];
+        memcpy(key, index_->key(i), KEY_LEN);
+        Slice key_slice(key, KEY_LEN);
+        // the slot may have been taken by another key since, which the
+        // thread of the other key's slot passes on
+        if (index_->Find(key) != i) continue;
+        Status s = Get(key_slice, &value);
+        if (s == NotFound) continue;
+        if (s != Ok) {
+          failed = true;
+          return;
+        }
+        _callback(part, key_slice, Slice((char*)value.data(), value.size()));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return failed ? IOError : Ok;
+}
@@ -0,0 +1,98 @@
+//
+// Created by andyshen on 2/25/21.
+//
+#pragma once
+#include <string>
+#include "../include/db.hpp"
+#include "define.h"
+#include "pmem_index.h"
+#include "value_log.h"
+
+// Read only view of a pool written by another process, see
+// DB::AttachReadOnly. The writer's persistent index lives in the shared
+// mapping, so the reader looks keys up in it directly and builds nothing.
+// It cannot hold back the writer's reuse of freed blocks: a Get copies the
+// record the key's slot points at, then checks that the slot and the
+// record's sequence number are still the same and copies again otherwise.
+class PoolReader : public DB {
+ public:
+  static Status Attach(const std::string& _name, Config* _config, DB** _db);
+
+  ~PoolReader() override;
+
+  Status Get(const Slice& _key, std::string* _value) override;
+
+  Status GetReader(const Slice& _key,
+                   std::unique_ptr<ValueReader>* _reader) override;
+
+  // Writes are the writer's, they all return InvalidArgument
+  Status Set(const Slice& _key, const Slice& _value) override;
+
+  void MultiGet(const Slice* _keys, std::string* _values, Status* _status,
+                size_t _n) override;
+
+  void MultiSet(const Slice* _keys, const Slice* _values, Status* _status,
+                size_t _n) override;
+
+  using DB::SetAsync;
+  using DB::GetAsync;
+
+  void SetAsync(const Slice& _key, const Slice& _value,
+                SetCallback _callback) override;
+
+  // Runs inline, there are no engine threads
+  void GetAsync(const Slice& _key, GetCallback _callback) override;
+
+  Status CompareAndSet(const Slice& _key, const Slice* _expected,
+                       const Slice& _desired) override;
+
+  Status Append(const Slice& _key, const Slice& _value) override;
+
+  Status Merge(const Slice& _key, const Slice& _operand) override;
+
+  Status BulkLoad(const Slice* _keys, const Slice* _values, size_t _n,
+                  bool _unique_keys) override;
+
+  Status Backup(const std::string& _path, uint64_t _since,
+                uint64_t* _epoch) override;
+
+  Status GetUpdatesSince(uint64_t _since,
+                         std::unique_ptr<UpdateIterator>* _iter) override;
+
+  // Threads split the index slots and Get the keys they hold
+  Status ParallelScan(int _n, const ScanCallback& _callback) override;
+
+ private:
+  PoolReader() = default;
+
+  // Copy the value of the record at _block_index for _key and its
+  // sequence number, false if the copy is not an intact record of _key
+  bool CopyValue(const Slice& _key, BLOCK_INDEX_TYPE _block_index,
+                 VALUE_LEN_TYPE _stored_len, std::string* _value,
+                 uint64_t* _sequence) const;
+
+  bool CopyLogValue(const Slice& _key, BLOCK_INDEX_TYPE _block_index,
+                    std::string* _value) const;
+
+  // Blocks taken by _len bytes of a record or chunk
+  uint64_t Blocks(uint64_t _len) const {
+    return (_len + config_.block_size_ - 1) / config_.block_size_;
+  }
+
+  // Blocks [_block_index, +_blocks) are inside the pool
+  bool InPool(BLOCK_INDEX_TYPE _block_index, uint64_t _blocks) const {
+    return _block_index < pool_blocks_ &&
+           _blocks <= pool_blocks_ - _block_index;
+  }
+
+  // a key rewritten faster than it can be copied gives up after this many
+  static const int MAX_READ_TRIES = 1000;
+
+  // geometry of the attached pool, which may differ from CONFIG
+  Config config_;
+  char* base_ = nullptr;
+  uint64_t size_ = 0;
+  uint64_t pool_blocks_ = 0;
+  PmemIndex* index_ = nullptr;
+  ValueLog* value_log_ = nullptr;
+};
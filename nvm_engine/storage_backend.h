@@ -0,0 +1,361 @@
+//
+// Created by andyshen on 2/3/21.
+//
+#pragma once
+#include <emmintrin.h>
+#include <fcntl.h>
+#include <libpmem.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../include/db.hpp"
+
+static const uint64_t CACHE_LINE_SIZE = 64;
+
+// Storage under the pool: map a file, flush cache lines, wait for them.
+class StorageBackend {
+ public:
+  StorageBackend() = default;
+  virtual ~StorageBackend() = default;
+
+  // Map _size bytes of _path and return the base address, nullptr on failure
+  virtual char* Map(const std::string& _path, uint64_t _size) = 0;
+  virtual void Unmap() = 0;
+  // Start writing back [_addr, _addr + _len) without waiting
+  virtual void Flush(const void* _addr, size_t _len) = 0;
+  // Wait for all flushes issued by this thread
+  virtual void Drain() = 0;
+
+  virtual void MemcpyNoDrain(void* _dst, const void* _src, size_t _len) {
+    memcpy(_dst, _src, _len);
+    Flush(_dst, _len);
+  }
+
+  void Persist(const void* _addr, size_t _len) {
+    Flush(_addr, _len);
+    Drain();
+  }
+
+  void MemcpyPersist(void* _dst, const void* _src, size_t _len) {
+    MemcpyNoDrain(_dst, _src, _len);
+    Drain();
+  }
+
+  bool is_pmem() const { return is_pmem_; }
+
+  // Bytes flushed or copied to the pool by all threads so far
+  uint64_t persisted_bytes() const {
+    uint64_t bytes = 0;
+    for (auto& stripe : persisted_) {
+      bytes += stripe.bytes_.load(std::memory_order_relaxed);
+    }
+    return bytes;
+  }
+
+  static StorageBackend* Create(const Config& _config);
+
+ protected:
+  // Called by every Flush and by copies that do not go through Flush.
+  // Threads add to their own stripe, so writers never share the line.
+  void CountPersisted(size_t _len) {
+    static std::atomic<uint32_t> next_stripe{0};
+    static thread_local uint32_t stripe =
+        next_stripe.fetch_add(1) % PERSISTED_STRIPES;
+    persisted_[stripe].bytes_.fetch_add(_len, std::memory_order_relaxed);
+  }
+
+  char* base_ = nullptr;
+  uint64_t size_ = 0;
+  bool is_pmem_ = false;
+
+ private:
+  static const uint32_t PERSISTED_STRIPES = 64;
+  struct PersistedStripe {
+    std::atomic<uint64_t> bytes_{0};
+    char pad_[CACHE_LINE_SIZE - sizeof(uint64_t)];
+  };
+  PersistedStripe persisted_[PERSISTED_STRIPES];
+};
+
+// Real AEP through libpmem.
+class PmemBackend : public StorageBackend {
+ public:
+  ~PmemBackend() override { Unmap(); }
+
+  char* Map(const std::string& _path, uint64_t _size) override {
+    int is_pmem;
+    base_ = (char*)pmem_map_file(_path.c_str(), _size, PMEM_FILE_CREATE, 0666,
+                                 0, &is_pmem);
+    size_ = _size;
+    is_pmem_ = is_pmem;
+    return base_;
+  }
+
+  void Unmap() override {
+    if (base_ != nullptr) {
+      pmem_unmap(base_, size_);
+      base_ = nullptr;
+    }
+  }
+
+  void Flush(const void* _addr, size_t _len) override {
+    CountPersisted(_len);
+    pmem_flush(_addr, _len);
+  }
+
+  void Drain() override { pmem_drain(); }
+
+  void MemcpyNoDrain(void* _dst, const void* _src, size_t _len) override {
+    CountPersisted(_len);
+    pmem_memcpy_nodrain(_dst, _src, _len);
+  }
+};
+
+// Regular file through mmap, made durable with clflush or msync.
+class MmapBackend : public StorageBackend {
+ public:
+  explicit MmapBackend(bool _use_msync) : use_msync_(_use_msync) {}
+  ~MmapBackend() override { Unmap(); }
+
+  char* Map(const std::string& _path, uint64_t _size) override {
+    int fd = open(_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) return nullptr;
+    if (ftruncate(fd, _size) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    void* base =
+        mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return nullptr;
+    base_ = (char*)base;
+    size_ = _size;
+    return base_;
+  }
+
+  void Unmap() override {
+    if (base_ != nullptr) {
+      munmap(base_, size_);
+      base_ = nullptr;
+    }
+  }
+
+  void Flush(const void* _addr, size_t _len) override {
+    CountPersisted(_len);
+    if (use_msync_) {
+      // msync wants a page aligned address
+      uintptr_t page = sysconf(_SC_PAGESIZE);
+      uintptr_t begin = (uintptr_t)_addr & ~(page - 1);
+      msync((void*)begin, (uintptr_t)_addr + _len - begin, MS_SYNC);
+      return;
+    }
+    uintptr_t line = (uintptr_t)_addr & ~(CACHE_LINE_SIZE - 1);
+    for (; line < (uintptr_t)_addr + _len; line += CACHE_LINE_SIZE) {
+      _mm_clflush((const void*)line);
+    }
+  }
+
+  void Drain() override { _mm_sfence(); }
+
+ private:
+  bool use_msync_;
+};
+
+// DRAM pretending to be Optane: every drain costs a fixed write latency plus
+// the time the flushed bytes take at the configured bandwidth, which is
+// shared by all threads.
+class DramBackend : public StorageBackend {
+ public:
+  DramBackend(uint64_t _write_latency_ns, uint64_t _bandwidth_mb)
+      : write_latency_ns_(_write_latency_ns),
+        ns_per_kb_(_bandwidth_mb == 0 ? 0 : 1000000000.0 / 1024 /
+                                                _bandwidth_mb) {}
+  ~DramBackend() override { Unmap(); }
+
+  char* Map(const std::string&, uint64_t _size) override {
+    void* base = mmap(nullptr, _size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return nullptr;
+    base_ = (char*)base;
+    size_ = _size;
+    return base_;
+  }
+
+  void Unmap() override {
+    if (base_ != nullptr) {
+      munmap(base_, size_);
+      base_ = nullptr;
+    }
+  }
+
+  void Flush(const void*, size_t _len) override {
+    CountPersisted(_len);
+    pending_bytes() += _len;
+  }
+
+  void Drain() override {
+    uint64_t bytes = pending_bytes();
+    pending_bytes() = 0;
+    uint64_t now = NowNs();
+    uint64_t done = now + write_latency_ns_;
+    if (ns_per_kb_ > 0 && bytes > 0) {
+      // reserve a slot on the shared media
+      uint64_t cost = bytes * ns_per_kb_ / 1024;
+      uint64_t busy = busy_until_ns_.load(std::memory_order_relaxed);
+      uint64_t start;
+      do {
+        start = busy > now ? busy : now;
+      } while (!busy_until_ns_.compare_exchange_weak(busy, start + cost));
+      if (start + cost + write_latency_ns_ > done) {
+        done = start + cost + write_latency_ns_;
+      }
+    }
+    while (NowNs() < done) {
+      _mm_pause();
+    }
+  }
+
+ private:
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static uint64_t& pending_bytes() {
+    static thread_local uint64_t bytes = 0;
+    return bytes;
+  }
+
+  uint64_t write_latency_ns_;
+  double ns_per_kb_;
+  std::atomic<uint64_t> busy_until_ns_{0};
+};
+
+// Regular file behind a private mapping, for crash tests. Stores only reach
+// the file when a drain writes back the lines flushed before it, so a killed
+// process loses what a power failure would. The _crash_after-th copy kills
+// the process halfway: a random prefix of its lines and a random part of the
+// thread's flushes not drained yet reach the file first.
+class CrashBackend : public StorageBackend {
+ public:
+  CrashBackend(uint64_t _crash_after, uint64_t _seed)
+      : crash_after_(_crash_after), random_(_seed * 2654435761ULL + 1) {}
+  ~CrashBackend() override { Unmap(); }
+
+  char* Map(const std::string& _path, uint64_t _size) override {
+    fd_ = open(_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd_ < 0) return nullptr;
+    if (ftruncate(fd_, _size) != 0) {
+      Unmap();
+      return nullptr;
+    }
+    void* base =
+        mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_, 0);
+    if (base == MAP_FAILED) {
+      Unmap();
+      return nullptr;
+    }
+    base_ = (char*)base;
+    size_ = _size;
+    return base_;
+  }
+
+  void Unmap() override {
+    if (base_ != nullptr) {
+      munmap(base_, size_);
+      base_ = nullptr;
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  void Flush(const void* _addr, size_t _len) override {
+    CountPersisted(_len);
+    uintptr_t begin = (uintptr_t)_addr & ~(CACHE_LINE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)_addr + _len + CACHE_LINE_SIZE - 1) &
+                    ~(CACHE_LINE_SIZE - 1);
+    pending_lines().emplace_back(begin, end);
+  }
+
+  void Drain() override {
+    for (auto& lines : pending_lines()) {
+      WriteBack(lines.first, lines.second);
+    }
+    pending_lines().clear();
+  }
+
+  void MemcpyNoDrain(void* _dst, const void* _src, size_t _len) override {
+    memcpy(_dst, _src, _len);
+    if (crash_after_ > 0 && copies_.fetch_add(1) + 1 == crash_after_) {
+      Crash(_dst, _len);
+    }
+    Flush(_dst, _len);
+  }
+
+ private:
+  // Lines flushed by this thread since its last drain
+  static std::vector<std::pair<uintptr_t, uintptr_t>>& pending_lines() {
+    static thread_local std::vector<std::pair<uintptr_t, uintptr_t>> lines;
+    return lines;
+  }
+
+  void WriteBack(uintptr_t _begin, uintptr_t _end) {
+    _end = std::min<uintptr_t>(_end, (uintptr_t)base_ + size_);
+    while (_begin < _end) {
+      ssize_t n = pwrite(fd_, (const void*)_begin, _end - _begin,
+                         _begin - (uintptr_t)base_);
+      if (n <= 0) return;
+      _begin += n;
+    }
+  }
+
+  uint64_t Random() {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    return random_;
+  }
+
+  void Crash(void* _dst, size_t _len) {
+    for (auto& lines : pending_lines()) {
+      if (Random() % 2 == 0) WriteBack(lines.first, lines.second);
+    }
+    uintptr_t begin = (uintptr_t)_dst & ~(CACHE_LINE_SIZE - 1);
+    uintptr_t lines = ((uintptr_t)_dst + _len - begin + CACHE_LINE_SIZE - 1) /
+                      CACHE_LINE_SIZE;
+    WriteBack(begin, begin + Random() % lines * CACHE_LINE_SIZE);
+    kill(getpid(), SIGKILL);
+  }
+
+  int fd_ = -1;
+  uint64_t crash_after_;
+  std::atomic<uint64_t> copies_{0};
+  // only the crashing thread draws from it
+  uint64_t random_;
+};
+
+inline StorageBackend* StorageBackend::Create(const Config& _config) {
+  switch (_config.storage_) {
+    case StorageMmap:
+      return new MmapBackend(_config.msync_);
+    case StorageDram:
+      return new DramBackend(_config.emulated_write_latency_ns_,
+                             _config.emulated_bandwidth_mb_);
+    case StorageCrash:
+      return new CrashBackend(_config.crash_after_copies_,
+                              _config.crash_seed_);
+    case StoragePmem:
+    default:
+      return new PmemBackend();
+  }
+}
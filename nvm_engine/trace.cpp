@@ -0,0 +1,144 @@
+#include "trace.h"
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+// The recorder a thread last traced to and its buffer there
+struct TraceThread {
+  uint64_t recorder_ = 0;
+  TraceBuffer* buffer_ = nullptr;
+};
+
+static thread_local TraceThread trace_thread;
+static std::atomic<uint64_t> recorder_ids{0};
+
+TraceRecorder* TraceRecorder::Open(const std::string& _path,
+                                   bool _full_keys) {
+  FILE* file = fopen(_path.c_str(), "wb");
+  if (file == nullptr) return nullptr;
+  // a failed write leaves nothing buffered that could land later
+  setvbuf(file, nullptr, _IONBF, 0);
+  TraceHeader header{TRACE_MAGIC, _full_keys ? TRACE_FULL_KEYS : 0, 0};
+  if (fwrite(&header, sizeof(TraceHeader), 1, file) != 1) {
+    fclose(file);
+    return nullptr;
+  }
+  return new TraceRecorder(file, _path, _full_keys);
+}
+
+TraceRecorder::TraceRecorder(FILE* _file, const std::string& _path,
+                             bool _full_keys)
+    : file_(_file),
+      path_(_path),
+      full_keys_(_full_keys),
+      id_(++recorder_ids),
+      start_(std::chrono::steady_clock::now()) {
+  writer_ = std::thread(&TraceRecorder::Run, this);
+}
+
+TraceRecorder::~TraceRecorder() {
+  for (auto buffer : current_) {
+    full_.Push(std::move(buffer));
+  }
+  full_.Stop();
+  writer_.join();
+  if (fclose(file_) != 0 && error_ == 0) error_ = errno;
+  if (error_ != 0) {
+    fprintf(stderr, "Trace %s cut short, %llu records not written: %s\n",
+            path_.c_str(), (unsigned long long)lost_, strerror(error_));
+  }
+  for (auto buffer : free_) {
+    delete buffer;
+  }
+}
+
+TraceBuffer* TraceRecorder::NewBuffer(uint32_t _thread) {
+  TraceBuffer* buffer;
+  if (free_.empty()) {
+    buffer = new TraceBuffer;
+  } else {
+    buffer = free_.back();
+    free_.pop_back();
+  }
+  buffer->thread_ = _thread;
+  buffer->count_ = 0;
+  return buffer;
+}
+
+TraceBuffer* TraceRecorder::buffer() {
+  if (trace_thread.recorder_ == id_) return trace_thread.buffer_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  TraceBuffer* buffer = NewBuffer(current_.size());
+  current_.push_back(buffer);
+  trace_thread.recorder_ = id_;
+  trace_thread.buffer_ = buffer;
+  return buffer;
+}
+
+void TraceRecorder::Record(TraceOp _op, uint64_t _time_ns, const Slice& _key,
+                           uint32_t _value_len) {
+  TraceBuffer* buffer = this->buffer();
+  TraceRecord& record = buffer->records_[buffer->count_++];
+  record.time_ns_ = _time_ns;
+  record.op_ = _op;
+  memset(record.reserved_, 0, sizeof(record.reserved_));
+  record.value_len_ = _value_len;
+  if (full_keys_) {
+    memcpy(record.key_, _key.data(), KEY_LEN);
+  } else {
+    uint64_t low, high;
+    memcpy(&low, _key.data(), sizeof(uint64_t));
+    memcpy(&high, _key.data() + sizeof(uint64_t), sizeof(uint64_t));
+    uint64_t hash = (low * 0xbf58476d1ce4e5b9ULL) ^ high;
+    hash ^= hash >> 31;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 29;
+    memset(record.key_, 0, KEY_LEN);
+    memcpy(record.key_, &hash, sizeof(uint64_t));
+  }
+  if (buffer->count_ < TRACE_BUFFER_RECORDS) return;
+  TraceBuffer* next;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    next = NewBuffer(buffer->thread_);
+    current_[buffer->thread_] = next;
+  }
+  trace_thread.buffer_ = next;
+  full_.Push(std::move(buffer));
+}
+
+void TraceRecorder::Run() {
+  std::vector<TraceBuffer*> buffers;
+  while (full_.PopAll(&buffers)) {
+    for (auto buffer : buffers) {
+      if (buffer->count_ == 0) continue;
+      if (error_ != 0 || !Write(buffer)) lost_ += buffer->count_;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.insert(free_.end(), buffers.begin(), buffers.end());
+    }
+    buffers.clear();
+  }
+}
+
+bool TraceRecorder::Write(const TraceBuffer* _buffer) {
+  TraceBlockHeader header{_buffer->thread_, _buffer->count_};
+  if (fwrite(&header, sizeof(TraceBlockHeader), 1, file_) == 1 &&
+      fwrite(_buffer->records_, sizeof(TraceRecord), _buffer->count_,
+             file_) == _buffer->count_) {
+    size_ += sizeof(TraceBlockHeader) + sizeof(TraceRecord) * _buffer->count_;
+    written_ += _buffer->count_;
+    return true;
+  }
+  error_ = errno;
+  // drop the partial block, a replay reads the whole ones before it
+  if (ftruncate(fileno(file_), size_) != 0) {
+    // a replay rejects the whole file, the records in it are lost too
+    error_ = errno;
+    lost_ += written_;
+    written_ = 0;
+  }
+  return false;
+}
@@ -0,0 +1,114 @@
+//
+// Created by andyshen on 2/28/21.
+//
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/db.hpp"
+#include "async_executor.h"
+#include "define.h"
+
+static const uint64_t TRACE_MAGIC = 0x31305f4543415254UL;  // "TRACE_01"
+// records a thread collects before they go to the writer thread
+static const uint32_t TRACE_BUFFER_RECORDS = 4096;
+// flags_ of TraceHeader
+static const uint32_t TRACE_FULL_KEYS = 1;
+
+enum TraceOp : uint8_t {
+  TraceGet = 1,
+  TraceSet = 2,
+};
+
+// A trace file is this header followed by blocks, each one a
+// TraceBlockHeader and its records. The blocks of a thread are in the order
+// the thread filled them, those of different threads interleave.
+struct TraceHeader {
+  uint64_t magic_;
+  uint32_t flags_;
+  uint32_t reserved_;
+};
+
+struct TraceBlockHeader {
+  // threads are numbered in the order of their first traced op
+  uint32_t thread_;
+  uint32_t count_;
+};
+
+struct TraceRecord {
+  // when the op started, since the engine was opened
+  uint64_t time_ns_;
+  uint8_t op_;
+  uint8_t reserved_[3];
+  // of the value set, or of the value got and 0 for a miss
+  uint32_t value_len_;
+  // the key, or without TRACE_FULL_KEYS an 8 byte hash of it and zeros
+  char key_[KEY_LEN];
+};
+
+struct TraceBuffer {
+  uint32_t thread_;
+  uint32_t count_;
+  TraceRecord records_[TRACE_BUFFER_RECORDS];
+};
+
+// Records the Gets and Sets of NvmEngine, see Config::trace_path_. Every
+// thread fills a buffer of its own without locks and hands it to a writer
+// thread once full, which appends it to the file.
+class TraceRecorder {
+ public:
+  // nullptr if _path cannot be created
+  static TraceRecorder* Open(const std::string& _path, bool _full_keys);
+
+  // Writes what the threads have not handed over yet, no op may run.
+  // Reports a trace cut short by a failed write.
+  ~TraceRecorder();
+
+  uint64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start_)
+        .count();
+  }
+
+  void Record(TraceOp _op, uint64_t _time_ns, const Slice& _key,
+              uint32_t _value_len);
+
+ private:
+  TraceRecorder(FILE* _file, const std::string& _path, bool _full_keys);
+
+  // Buffer of the calling thread, registered on its first op
+  TraceBuffer* buffer();
+
+  // An empty buffer, one written out before if there is one
+  TraceBuffer* NewBuffer(uint32_t _thread);
+
+  void Run();
+
+  // Append the block of _buffer, false if the write failed
+  bool Write(const TraceBuffer* _buffer);
+
+  FILE* file_;
+  std::string path_;
+  bool full_keys_;
+  // tells the thread locals of a recorder from those of an earlier one
+  uint64_t id_;
+  std::chrono::steady_clock::time_point start_;
+  std::mutex mutex_;
+  // the buffer each thread is filling, by thread number
+  std::vector<TraceBuffer*> current_;
+  // written out, reused so that buffers are not faulted in again
+  std::vector<TraceBuffer*> free_;
+  SubmissionQueue<TraceBuffer*> full_;
+  std::thread writer_;
+  // bytes of whole blocks in the file, set by the writer thread
+  uint64_t size_ = sizeof(TraceHeader);
+  // records in those blocks
+  uint64_t written_ = 0;
+  // errno of the first failed write, the records after it are dropped, or
+  // of the failed truncate after it
+  int error_ = 0;
+  uint64_t lost_ = 0;
+};
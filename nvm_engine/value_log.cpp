@@ -0,0 +1,75 @@
+#include "value_log.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ValueLog::~ValueLog() {
+  UnmapScan();
+  if (fd_ >= 0) close(fd_);
+}
+
+bool ValueLog::Open(const std::string& _path) {
+  fd_ = open(_path.c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd_ < 0) return false;
+  struct stat st {};
+  if (fstat(fd_, &st) != 0) return false;
+  size_ = st.st_size;
+  return true;
+}
+
+bool ValueLog::OpenReadOnly(const std::string& _path) {
+  fd_ = open(_path.c_str(), O_RDONLY);
+  return fd_ >= 0;
+}
+
+bool ValueLog::Truncate() {
+  if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) return false;
+  size_ = 0;
+  garbage_ = 0;
+  return true;
+}
+
+bool ValueLog::Append(const char* _data, size_t _len, uint64_t* _offset) {
+  // concurrent appends take disjoint ranges, a crash leaves a hole of
+  // zeros that recovery skips like a torn record
+  uint64_t offset = size_.fetch_add(_len);
+  size_t done = 0;
+  while (done < _len) {
+    ssize_t n = pwrite(fd_, _data + done, _len - done, offset + done);
+    if (n <= 0) return false;
+    done += n;
+  }
+  if (fdatasync(fd_) != 0) return false;
+  *_offset = offset;
+  return true;
+}
+
+ssize_t ValueLog::Read(uint64_t _offset, char* _buffer, size_t _len) const {
+  size_t done = 0;
+  while (done < _len) {
+    ssize_t n = pread(fd_, _buffer + done, _len - done, _offset + done);
+    if (n < 0) return -1;
+    if (n == 0) break;
+    done += n;
+  }
+  return done;
+}
+
+const char* ValueLog::MapForScan(uint64_t* _size) {
+  *_size = size_.load();
+  if (*_size == 0) return nullptr;
+  void* base = mmap(nullptr, *_size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (base == MAP_FAILED) return nullptr;
+  madvise(base, *_size, MADV_SEQUENTIAL);
+  scan_base_ = (char*)base;
+  scan_size_ = *_size;
+  return scan_base_;
+}
+
+void ValueLog::UnmapScan() {
+  if (scan_base_ != nullptr) {
+    munmap(scan_base_, scan_size_);
+    scan_base_ = nullptr;
+  }
+}
@@ -0,0 +1,48 @@
+//
+// Created by andyshen on 2/16/21.
+//
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Append-only file of records spilled from the pool, the cold tier. Records
+// keep the pool layout and are padded to whole blocks, an offset in blocks
+// tagged with VALUE_LOG_TAG takes the place of a block index.
+class ValueLog {
+ public:
+  ValueLog() = default;
+  ~ValueLog();
+
+  // Open or create the log at _path, false on failure
+  bool Open(const std::string& _path);
+
+  // Open the log of a pool attached by DB::AttachReadOnly, only for Read
+  bool OpenReadOnly(const std::string& _path);
+
+  // Drop every record, for a freshly formatted pool
+  bool Truncate();
+
+  // Write _len bytes at the end and sync them, *_offset is where they start
+  bool Append(const char* _data, size_t _len, uint64_t* _offset);
+
+  // Read _len bytes at _offset, short at the end of the log
+  ssize_t Read(uint64_t _offset, char* _buffer, size_t _len) const;
+
+  // Map the whole log read only for recovery, nullptr if it is empty
+  const char* MapForScan(uint64_t* _size);
+  void UnmapScan();
+
+  // Bytes of records superseded since the log was opened
+  void AddGarbage(size_t _bytes) { garbage_.fetch_add(_bytes); }
+  uint64_t garbage() const { return garbage_.load(); }
+
+  uint64_t size() const { return size_.load(); }
+
+ private:
+  int fd_ = -1;
+  std::atomic<uint64_t> size_{0};
+  std::atomic<uint64_t> garbage_{0};
+  char* scan_base_ = nullptr;
+  uint64_t scan_size_ = 0;
+};
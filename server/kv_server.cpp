@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+#include "db.hpp"
+#include "protocol.h"
+
+using namespace std;
+
+// Serves one pool to the processes of the host over a Unix domain socket.
+// Every worker thread has its own epoll set and owns the connections it
+// accepts. The requests a connection has sent are run together: runs of
+// Gets through DB::MultiGet, runs of Sets through DB::MultiSet with one
+// drain, and the responses go back in request order.
+
+// config for server
+string POOL_PATH = "/dev/shm/kv_server_pool";
+string SOCKET_PATH = "/tmp/kv_server.sock";
+int NUM_THREADS = 0;
+bool PIN_THREADS = false;
+Config config;
+
+DB* db = nullptr;
+std::atomic<bool> stop{false};
+
+// bytes read from a connection before its requests are run
+static const size_t MAX_READ = 1 << 20;
+static const size_t READ_SIZE = 64 << 10;
+// a connection is not read while this much output waits
+static const size_t MAX_OUTPUT = 4 << 20;
+// requests handed to one MultiGet or MultiSet
+static const size_t MAX_BATCH = 256;
+
+struct Connection {
+  int fd_;
+  // received bytes not yet run, a partial request at the end
+  std::string in_;
+  std::string out_;
+  size_t out_offset_ = 0;
+  // waiting for EPOLLOUT instead of EPOLLIN
+  bool writing_ = false;
+  // why the connection is closed, empty when the client hung up
+  std::string error_;
+};
+
+class Worker {
+ public:
+  explicit Worker(int _listen_fd) : listen_fd_(_listen_fd) {
+    epoll_fd_ = epoll_create1(0);
+    epoll_event event{};
+    // wake one worker per incoming connection
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = nullptr;
+    if (epoll_fd_ < 0 ||
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event) != 0) {
+      perror("epoll failed");
+      exit(1);
+    }
+  }
+
+  ~Worker() { close(epoll_fd_); }
+
+  void Run();
+
+ private:
+  void Accept();
+
+  // Read, run and answer what _conn sent, false to close it
+  bool OnReadable(Connection* _conn);
+
+  // Run the received requests and write the responses until the socket
+  // is full or all complete requests are answered, false to close _conn
+  bool Serve(Connection* _conn);
+
+  // Write pending output, false to close _conn
+  bool Flush(Connection* _conn);
+
+  // Run the complete requests of _conn, false on a malformed one
+  bool Dispatch(Connection* _conn);
+
+  void RunBatch(uint8_t _op, std::string* _out);
+
+  // Wait for _conn to become writable or readable, false to close it
+  bool Watch(Connection* _conn, bool _writing);
+
+  // Close _conn, reporting its error if there is one
+  void Close(Connection* _conn);
+
+  int listen_fd_;
+  int epoll_fd_;
+  std::vector<Connection*> connections_;
+  // reused by every batch
+  std::vector<Slice> keys_;
+  std::vector<Slice> values_;
+  std::vector<std::string> get_values_{MAX_BATCH};
+  std::vector<Status> status_{MAX_BATCH};
+};
+
+void Worker::Run() {
+  epoll_event events[64];
+  while (!stop) {
+    int n = epoll_wait(epoll_fd_, events, 64, 100);
+    for (int i = 0; i < n; i++) {
+      auto* conn = (Connection*)events[i].data.ptr;
+      if (conn == nullptr) {
+        Accept();
+        continue;
+      }
+      bool ok = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0 ||
+                (events[i].events & EPOLLIN);
+      if (!ok && (events[i].events & EPOLLERR)) conn->error_ = "socket error";
+      if (ok) ok = conn->writing_ ? Serve(conn) : OnReadable(conn);
+      if (!ok) Close(conn);
+    }
+  }
+  for (auto conn : connections_) {
+    close(conn->fd_);
+    delete conn;
+  }
+}
+
+void Worker::Accept() {
+  int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+  // another worker took it
+  if (fd < 0) return;
+  auto* conn = new Connection;
+  conn->fd_ = fd;
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    perror("watch connection failed");
+    close(fd);
+    delete conn;
+    return;
+  }
+  connections_.push_back(conn);
+}
+
+bool Worker::OnReadable(Connection* _conn) {
+  size_t read_bytes = 0;
+  while (read_bytes < MAX_READ) {
+    size_t size = _conn->in_.size();
+    _conn->in_.resize(size + READ_SIZE);
+    ssize_t n = read(_conn->fd_, &_conn->in_[size], READ_SIZE);
+    _conn->in_.resize(size + std::max<ssize_t>(n, 0));
+    if (n == 0) return false;
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EINTR) continue;
+      _conn->error_ = strerror(errno);
+      return false;
+    }
+    read_bytes += n;
+  }
+  return Serve(_conn);
+}
+
+bool Worker::Serve(Connection* _conn) {
+  while (true) {
+    size_t pending = _conn->in_.size();
+    if (!Dispatch(_conn) || !Flush(_conn)) return false;
+    if (_conn->out_offset_ < _conn->out_.size()) return Watch(_conn, true);
+    // Dispatch stops at MAX_OUTPUT with requests left
+    if (_conn->in_.size() == pending) break;
+  }
+  return Watch(_conn, false);
+}
+
+bool Worker::Dispatch(Connection* _conn) {
+  const char* data = _conn->in_.data();
+  size_t size = _conn->in_.size();
+  size_t pos = 0;
+  while (_conn->out_.size() - _conn->out_offset_ < MAX_OUTPUT) {
+    // the longest run of complete requests of one op
+    keys_.clear();
+    values_.clear();
+    uint8_t op = 0;
+    size_t end = pos;
+    while (keys_.size() < MAX_BATCH && size - end >= sizeof(RequestHeader)) {
+      RequestHeader header;
+      memcpy(&header, data + end, sizeof(RequestHeader));
+      if ((header.op_ != OpGet && header.op_ != OpSet) ||
+          header.value_len_ > PROTOCOL_MAX_VALUE_LEN ||
+          (header.op_ == OpGet && header.value_len_ != 0)) {
+        _conn->error_ = "malformed request";
+        return false;
+      }
+      if (size - end - sizeof(RequestHeader) < header.value_len_) break;
+      if (!keys_.empty() && header.op_ != op) break;
+      op = header.op_;
+      const char* request = data + end;
+      keys_.emplace_back((char*)request + offsetof(RequestHeader, key_),
+                         PROTOCOL_KEY_LEN);
+      values_.emplace_back((char*)request + sizeof(RequestHeader),
+                           header.value_len_);
+      end += sizeof(RequestHeader) + header.value_len_;
+    }
+    if (keys_.empty()) break;
+    RunBatch(op, &_conn->out_);
+    pos = end;
+  }
+  _conn->in_.erase(0, pos);
+  return true;
+}
+
+void Worker::RunBatch(uint8_t _op, std::string* _out) {
+  size_t n = keys_.size();
+  if (_op == OpSet) {
+    db->MultiSet(keys_.data(), values_.data(), status_.data(), n);
+    for (size_t i = 0; i < n; i++) {
+      EncodeResponse(status_[i], nullptr, 0, _out);
+    }
+    return;
+  }
+  db->MultiGet(keys_.data(), get_values_.data(), status_.data(), n);
+  for (size_t i = 0; i < n; i++) {
+    if (status_[i] == Ok) {
+      EncodeResponse(Ok, get_values_[i].data(), get_values_[i].size(), _out);
+    } else {
+      EncodeResponse(status_[i], nullptr, 0, _out);
+    }
+  }
+}
+
+bool Worker::Flush(Connection* _conn) {
+  while (_conn->out_offset_ < _conn->out_.size()) {
+    ssize_t n = send(_conn->fd_, _conn->out_.data() + _conn->out_offset_,
+                     _conn->out_.size() - _conn->out_offset_, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      if (errno == EINTR) continue;
+      _conn->error_ = strerror(errno);
+      return false;
+    }
+    _conn->out_offset_ += n;
+  }
+  _conn->out_.clear();
+  _conn->out_offset_ = 0;
+  return true;
+}
+
+bool Worker::Watch(Connection* _conn, bool _writing) {
+  if (_conn->writing_ == _writing) return true;
+  _conn->writing_ = _writing;
+  epoll_event event{};
+  event.events = _writing ? EPOLLOUT : EPOLLIN;
+  event.data.ptr = _conn;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, _conn->fd_, &event) != 0) {
+    _conn->error_ = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void Worker::Close(Connection* _conn) {
+  if (!_conn->error_.empty()) {
+    fprintf(stderr, "connection %d closed: %s\n", _conn->fd_,
+            _conn->error_.c_str());
+  }
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, _conn->fd_, nullptr);
+  close(_conn->fd_);
+  connections_.erase(
+      std::find(connections_.begin(), connections_.end(), _conn));
+  delete _conn;
+}
+
+void on_signal(int) { stop = true; }
+
+void config_parse(int argc, char* argv[]) {
+  int opt = 0;
+
+  while ((opt = getopt(argc, argv, "hf:s:t:ap:b:ik:")) != -1) {
+    switch (opt) {
+      case 'h': {
+        printf(
+            "Usage: \n"
+            "-f :pool file, tmpfs or regular file. \n"
+            "-s :unix socket path.\n"
+            "-t :worker threads, 0 for one per core.\n"
+            "-a :pin worker i to core i.\n"
+            "-p :pool size in MB.\n"
+            "-b :storage backend (pmem, mmap, msync, dram).\n"
+            "-i :keep the key index in the pool.\n"
+            "-k :max keys.\n");
+        exit(0);
+      }
+      case 'f':
+        POOL_PATH = optarg;
+        break;
+      case 's':
+        SOCKET_PATH = optarg;
+        break;
+      case 't':
+        NUM_THREADS = atoi(optarg);
+        break;
+      case 'a':
+        PIN_THREADS = true;
+        break;
+      case 'p':
+        config.pool_size_ = atoll(optarg) << 20;
+        break;
+      case 'b':
+        if (strcmp(optarg, "mmap") == 0) {
+          config.storage_ = StorageMmap;
+        } else if (strcmp(optarg, "msync") == 0) {
+          config.storage_ = StorageMmap;
+          config.msync_ = true;
+        } else if (strcmp(optarg, "dram") == 0) {
+          config.storage_ = StorageDram;
+        } else {
+          config.storage_ = StoragePmem;
+        }
+        break;
+      case 'i':
+        config.pmem_index_ = true;
+        break;
+      case 'k':
+        config.max_keys_ = atoll(optarg);
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  config_parse(argc, argv);
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  if (NUM_THREADS <= 0) NUM_THREADS = cores;
+
+  if (DB::CreateOrOpen(POOL_PATH, &config, &db) != Ok) {
+    fprintf(stderr, "open %s failed\n", POOL_PATH.c_str());
+    return 1;
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (listen_fd < 0 || SOCKET_PATH.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "bad socket %s\n", SOCKET_PATH.c_str());
+    return 1;
+  }
+  strcpy(addr.sun_path, SOCKET_PATH.c_str());
+  unlink(SOCKET_PATH.c_str());
+  if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 1024) != 0) {
+    perror("listen failed");
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<Worker*> workers;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    workers.push_back(new Worker(listen_fd));
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    threads.emplace_back(&Worker::Run, workers[i]);
+    if (PIN_THREADS) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(i % cores, &set);
+      pthread_setaffinity_np(threads.back().native_handle(), sizeof(set),
+                             &set);
+    }
+  }
+  fprintf(stderr, "serving %s on %s with %d threads\n", POOL_PATH.c_str(),
+          SOCKET_PATH.c_str(), NUM_THREADS);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto worker : workers) {
+    delete worker;
+  }
+  close(listen_fd);
+  unlink(SOCKET_PATH.c_str());
+  delete db;
+  return 0;
+}
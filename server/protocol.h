@@ -0,0 +1,63 @@
+//
+// Created by andyshen on 2/27/21.
+//
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// Wire format of kv_server, little endian as on the host. A client writes
+// any number of requests without waiting, the server answers each one in
+// the order they were sent, so no request ids are needed. The server stops
+// reading a connection while its responses are not read, a client writing
+// many requests at once has to read while it writes.
+//
+// request:  RequestHeader | value (value_len_ bytes, Sets only)
+// response: ResponseHeader | value (value_len_ bytes, Gets that found it)
+
+static const uint32_t PROTOCOL_KEY_LEN = 16;
+// larger values are refused and the connection is closed
+static const uint32_t PROTOCOL_MAX_VALUE_LEN = 64 << 20;
+
+enum RequestOp : uint8_t {
+  OpGet = 1,
+  OpSet = 2,
+};
+
+struct RequestHeader {
+  uint8_t op_;
+  uint8_t reserved_[3];
+  uint32_t value_len_;
+  char key_[PROTOCOL_KEY_LEN];
+};
+
+// status_ holds a Status of db.hpp
+struct ResponseHeader {
+  uint8_t status_;
+  uint8_t reserved_[3];
+  uint32_t value_len_;
+};
+
+static_assert(sizeof(RequestHeader) == 24, "request header is packed");
+static_assert(sizeof(ResponseHeader) == 8, "response header is packed");
+
+// Append a request to _out
+inline void EncodeRequest(RequestOp _op, const char* _key, const char* _value,
+                          uint32_t _value_len, std::string* _out) {
+  RequestHeader header{};
+  header.op_ = _op;
+  header.value_len_ = _value_len;
+  memcpy(header.key_, _key, PROTOCOL_KEY_LEN);
+  _out->append((const char*)&header, sizeof(RequestHeader));
+  _out->append(_value, _value_len);
+}
+
+// Append a response to _out
+inline void EncodeResponse(uint8_t _status, const char* _value,
+                           uint32_t _value_len, std::string* _out) {
+  ResponseHeader header{};
+  header.status_ = _status;
+  header.value_len_ = _value_len;
+  _out->append((const char*)&header, sizeof(ResponseHeader));
+  _out->append(_value, _value_len);
+}
@@ -1,6 +1,10 @@
+#include <sys/wait.h>
+#include <unistd.h>
 #include <atomic>
 #include <iostream>
+#include <map>
 #include <mutex>
+#include <thread>
 #include <vector>
 #include "../include/db.hpp"
 
@@ -177,4 +181,624 @@ void test4() {
   db->Get(slice_key, &b);
   std::cout << b << std::endl;
 }
-int main() { test3(); }
+// ---------------- behavior tests of the DB interface ----------------
+
+const char* POOL = "./test_pool";
+int failures = 0;
+
+// Count and report a failed expectation
+void expect(bool ok, const char* what, int mode) {
+  if (!ok) {
+    failures++;
+    printf("FAILED: %s (mode %d)\n", what, mode);
+  }
+}
+
+// Key index kinds every test runs with
+enum TestMode { DramIndex, PmemIndex, InlineValues, NumModes };
+
+Config test_config(int mode) {
+  Config config;
+  config.storage_ = StorageMmap;
+  config.pool_size_ = 256UL << 20;
+  config.block_per_segment_ = 4096;
+  config.max_keys_ = 1 << 16;
+  config.change_ring_size_ = 1 << 16;
+  config.bulk_load_threads_ = 4;
+  config.key_filter_ = true;
+  config.pmem_index_ = mode == PmemIndex;
+  config.inline_value_len_ = mode == InlineValues ? 32 : 0;
+  return config;
+}
+
+DB* open_db(Config* config, bool fresh) {
+  if (fresh) unlink(POOL);
+  DB* db = nullptr;
+  if (DB::CreateOrOpen(POOL, config, &db) != Ok) return nullptr;
+  return db;
+}
+
+std::string make_key(int i) {
+  char key[17] = {0};
+  snprintf(key, sizeof(key), "key%08d", i);
+  return std::string(key, 16);
+}
+
+std::string make_value(int i, size_t len) {
+  std::string value(len, 0);
+  for (size_t j = 0; j < len; j++) {
+    value[j] = (char)('a' + (i * 7 + j) % 26);
+  }
+  return value;
+}
+
+Slice slice(const std::string& s) { return Slice((char*)s.data(), s.size()); }
+
+bool has_value(DB* db, const std::string& key, const std::string& want) {
+  std::string got;
+  return db->Get(slice(key), &got) == Ok && got == want;
+}
+
+void test_set_get(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  expect(db != nullptr, "open", mode);
+  std::vector<std::string> values(1000);
+  for (int i = 0; i < 1000; i++) {
+    values[i] = make_value(i, 1 + i % 300);
+    expect(db->Set(slice(make_key(i)), slice(values[i])) == Ok, "set", mode);
+  }
+  // overwrites of the same and of another block count
+  for (int i = 0; i < 1000; i += 2) {
+    values[i] = make_value(i + 1, i % 4 == 0 ? values[i].size() : 1000);
+    db->Set(slice(make_key(i)), slice(values[i]));
+  }
+  std::string got;
+  expect(db->Get(slice(make_key(5000)), &got) == NotFound, "absent", mode);
+  for (int i = 0; i < 1000; i++) {
+    expect(has_value(db, make_key(i), values[i]), "get", mode);
+  }
+  delete db;
+  db = open_db(&config, false);
+  for (int i = 0; i < 1000; i++) {
+    expect(has_value(db, make_key(i), values[i]), "get after reopen", mode);
+  }
+  delete db;
+}
+
+// Whole value through GetReader chunk by chunk
+Status read_chunks(DB* db, const std::string& key, std::string* value) {
+  std::unique_ptr<ValueReader> reader;
+  Status s = db->GetReader(slice(key), &reader);
+  if (s != Ok) return s;
+  value->clear();
+  Slice chunk;
+  while (reader->NextChunk(&chunk)) {
+    value->append(chunk.data(), chunk.size());
+  }
+  return value->size() == reader->size() ? Ok : IOError;
+}
+
+void test_large_value(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::string large = make_value(1, 200000);
+  std::string small = make_value(2, 20);
+  expect(db->Set(slice(make_key(1)), slice(large)) == Ok, "set large", mode);
+  expect(db->Set(slice(make_key(2)), slice(small)) == Ok, "set small", mode);
+  expect(has_value(db, make_key(1), large), "get large", mode);
+
+  std::unique_ptr<ValueReader> reader;
+  expect(db->GetReader(slice(make_key(1)), &reader) == Ok, "reader", mode);
+  expect(reader->size() == large.size(), "reader size", mode);
+  char range[1000];
+  expect(reader->Read(123456, sizeof(range), range) == sizeof(range) &&
+             memcmp(range, large.data() + 123456, sizeof(range)) == 0,
+         "reader range", mode);
+  expect(reader->Read(large.size() - 10, sizeof(range), range) == 10,
+         "reader range at the end", mode);
+  reader.reset();
+
+  std::string chunks;
+  expect(read_chunks(db, make_key(1), &chunks) == Ok && chunks == large,
+         "reader chunks of large", mode);
+  expect(read_chunks(db, make_key(2), &chunks) == Ok && chunks == small,
+         "reader chunks of small", mode);
+  expect(read_chunks(db, make_key(3), &chunks) == NotFound, "reader absent",
+         mode);
+
+  // a large value replaced by a small one and the other way around
+  db->Set(slice(make_key(1)), slice(small));
+  db->Set(slice(make_key(2)), slice(large));
+  expect(has_value(db, make_key(1), small), "large to small", mode);
+  expect(has_value(db, make_key(2), large), "small to large", mode);
+  std::string too_large(64 << 20, 'x');
+  expect(db->Set(slice(make_key(4)), slice(too_large)) == InvalidArgument,
+         "too large", mode);
+  delete db;
+  db = open_db(&config, false);
+  expect(read_chunks(db, make_key(2), &chunks) == Ok && chunks == large,
+         "reader after reopen", mode);
+  delete db;
+}
+
+void test_multi(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  for (int i = 0; i < 100; i++) {
+    keys.push_back(make_key(i));
+    values.push_back(make_value(i, 10 + i * 3));
+  }
+  // a later pair of a key wins
+  keys.push_back(make_key(5));
+  values.push_back(make_value(500, 40));
+  std::vector<Slice> key_slices;
+  std::vector<Slice> value_slices;
+  for (size_t i = 0; i < keys.size(); i++) {
+    key_slices.push_back(slice(keys[i]));
+    value_slices.push_back(slice(values[i]));
+  }
+  std::vector<Status> status(keys.size());
+  db->MultiSet(key_slices.data(), value_slices.data(), status.data(),
+               keys.size());
+  for (Status s : status) {
+    expect(s == Ok, "multi set", mode);
+  }
+
+  // the last key is absent
+  key_slices.back() = slice(keys.back() = make_key(1000));
+  std::vector<std::string> got(keys.size());
+  db->MultiGet(key_slices.data(), got.data(), status.data(), keys.size());
+  for (int i = 0; i < 100; i++) {
+    std::string want = i == 5 ? make_value(500, 40) : values[i];
+    expect(status[i] == Ok && got[i] == want, "multi get", mode);
+  }
+  expect(status.back() == NotFound, "multi get absent", mode);
+  delete db;
+}
+
+void test_async(int mode, int threads) {
+  Config config = test_config(mode);
+  config.async_threads_ = threads;
+  DB* db = open_db(&config, true);
+  std::vector<std::future<Status>> sets;
+  for (int i = 0; i < 1000; i++) {
+    sets.push_back(db->SetAsync(slice(make_key(i)),
+                                slice(make_value(i, 16 + i % 100))));
+  }
+  for (auto& set : sets) {
+    expect(set.get() == Ok, "set async", mode);
+  }
+  std::atomic<int> found{0};
+  std::atomic<int> missed{0};
+  for (int i = 0; i < 1000; i++) {
+    std::string want = make_value(i, 16 + i % 100);
+    db->GetAsync(slice(make_key(i)),
+                 [&found, want](Status s, const std::string& value) {
+                   if (s == Ok && value == want) found++;
+                 });
+  }
+  db->GetAsync(slice(make_key(5000)), [&missed](Status s, const std::string&) {
+    if (s == NotFound) missed++;
+  });
+  auto result = db->GetAsync(slice(make_key(7))).get();
+  expect(result.first == Ok && result.second == make_value(7, 23),
+         "get async future", mode);
+  // the callbacks run before the engine threads stop
+  delete db;
+  expect(found == 1000 && missed == 1, "get async callbacks", mode);
+}
+
+// Adds the decimal operand to the decimal value
+Status add_operator(const Slice* existing, const Slice& operand,
+                    std::string* new_value) {
+  long long sum = atoll(operand.to_string().c_str());
+  if (existing != nullptr) sum += atoll(existing->to_string().c_str());
+  *new_value = std::to_string(sum);
+  return Ok;
+}
+
+void test_read_modify_write(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::string key = make_key(1);
+  std::string a = "first";
+  std::string b = "second";
+  Slice a_slice = slice(a);
+  Slice b_slice = slice(b);
+  expect(db->CompareAndSet(slice(key), &a_slice, slice(b)) == Conflict,
+         "cas on absent", mode);
+  expect(db->CompareAndSet(slice(key), nullptr, slice(a)) == Ok,
+         "cas create", mode);
+  expect(db->CompareAndSet(slice(key), nullptr, slice(b)) == Conflict,
+         "cas create existing", mode);
+  expect(db->CompareAndSet(slice(key), &b_slice, slice(b)) == Conflict,
+         "cas mismatch", mode);
+  expect(db->CompareAndSet(slice(key), &a_slice, slice(b)) == Ok, "cas", mode);
+  expect(has_value(db, key, b), "cas value", mode);
+
+  // appends growing past a single record into chunks
+  std::string appended;
+  for (int i = 0; i < 30; i++) {
+    std::string part = make_value(i, 100);
+    appended += part;
+    expect(db->Append(slice(make_key(2)), slice(part)) == Ok, "append", mode);
+  }
+  expect(has_value(db, make_key(2), appended), "append value", mode);
+
+  std::string one = "1";
+  expect(db->Merge(slice(make_key(3)), slice(one)) == InvalidArgument,
+         "merge without operator", mode);
+  delete db;
+
+  config.merge_operator_ = add_operator;
+  db = open_db(&config, false);
+  std::string five = "5";
+  db->Merge(slice(make_key(3)), slice(one));
+  expect(db->Merge(slice(make_key(3)), slice(five)) == Ok, "merge", mode);
+  expect(has_value(db, make_key(3), "6"), "merge value", mode);
+  expect(has_value(db, make_key(2), appended), "append after reopen", mode);
+  delete db;
+}
+
+void test_bulk_load(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  for (int i = 0; i < 5000; i++) {
+    keys.push_back(make_key(i));
+    values.push_back(make_value(i, 10 + i % 200));
+  }
+  std::vector<Slice> key_slices;
+  std::vector<Slice> value_slices;
+  for (int i = 0; i < 5000; i++) {
+    key_slices.push_back(slice(keys[i]));
+    value_slices.push_back(slice(values[i]));
+  }
+  expect(db->BulkLoad(key_slices.data(), value_slices.data(), 5000, true) ==
+             Ok,
+         "bulk load unique", mode);
+  for (int i = 0; i < 5000; i++) {
+    expect(has_value(db, keys[i], values[i]), "bulk loaded", mode);
+  }
+  // keys repeat, the last pair of each wins
+  for (int i = 0; i < 3000; i++) {
+    key_slices[i] = slice(keys[i % 1000]);
+  }
+  expect(db->BulkLoad(key_slices.data(), value_slices.data(), 3000, false) ==
+             Ok,
+         "bulk load", mode);
+  for (int i = 0; i < 1000; i++) {
+    expect(has_value(db, keys[i], values[i + 2000]), "bulk overwritten",
+           mode);
+  }
+  delete db;
+
+  // more keys than the index holds
+  config.max_keys_ = 1024;
+  for (int unique = 0; unique < 2; unique++) {
+    db = open_db(&config, true);
+    for (int i = 0; i < 5000; i++) {
+      key_slices[i] = slice(keys[i]);
+    }
+    expect(db->BulkLoad(key_slices.data(), value_slices.data(), 5000,
+                        unique) == OutOfMemory,
+           "bulk load out of keys", mode);
+    delete db;
+  }
+}
+
+// Values loaded by a process that dies right after BulkLoad returns
+void test_bulk_load_recovery(int mode, int persist_threads) {
+  Config config = test_config(mode);
+  config.persist_threads_ = persist_threads;
+  std::vector<std::string> keys;
+  std::vector<std::string> values;
+  std::vector<Slice> key_slices;
+  std::vector<Slice> value_slices;
+  for (int i = 0; i < 64; i++) {
+    keys.push_back(make_key(i));
+    // chunks and a manifest for every other value, the last of each range
+    values.push_back(make_value(i, i % 2 == 1 ? 3000 + i * 100 : 100));
+  }
+  for (int i = 0; i < 64; i++) {
+    key_slices.push_back(slice(keys[i]));
+    value_slices.push_back(slice(values[i]));
+  }
+  unlink(POOL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the pool only gets what was drained, the exit drops the rest
+    Config crash_config = config;
+    crash_config.storage_ = StorageCrash;
+    DB* db = nullptr;
+    if (DB::CreateOrOpen(POOL, &crash_config, &db) != Ok) _exit(1);
+    Status s = db->BulkLoad(key_slices.data(), value_slices.data(), 64, true);
+    _exit(s == Ok ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  expect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "crashed bulk load",
+         mode);
+  DB* db = open_db(&config, false);
+  for (int i = 0; i < 64; i++) {
+    expect(has_value(db, keys[i], values[i]), "bulk loaded before crash",
+           mode);
+  }
+  delete db;
+}
+
+void test_backup_restore(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  for (int i = 0; i < 1000; i++) {
+    db->Set(slice(make_key(i)), slice(make_value(i, 50)));
+  }
+  uint64_t epoch = 0;
+  expect(db->Backup("./test_backup0", 0, &epoch) == Ok, "full backup", mode);
+  for (int i = 500; i < 1500; i++) {
+    db->Set(slice(make_key(i)), slice(make_value(i + 1, 60)));
+  }
+  uint64_t next_epoch = 0;
+  expect(db->Backup("./test_backup1", epoch, &next_epoch) == Ok,
+         "incremental backup", mode);
+  delete db;
+
+  std::vector<std::string> backups = {"./test_backup0"};
+  expect(DB::Restore(backups, "./test_restored", &config, &db) == Ok,
+         "restore full", mode);
+  std::string got;
+  for (int i = 0; i < 1000; i++) {
+    expect(has_value(db, make_key(i), make_value(i, 50)), "restored full",
+           mode);
+  }
+  expect(db->Get(slice(make_key(1200)), &got) == NotFound,
+         "restored full absent", mode);
+  delete db;
+
+  backups.push_back("./test_backup1");
+  expect(DB::Restore(backups, "./test_restored", &config, &db) == Ok,
+         "restore incremental", mode);
+  for (int i = 0; i < 1500; i++) {
+    std::string want = i < 500 ? make_value(i, 50) : make_value(i + 1, 60);
+    expect(has_value(db, make_key(i), want), "restored incremental", mode);
+  }
+  delete db;
+  unlink("./test_backup0");
+  unlink("./test_backup1");
+  unlink("./test_restored");
+}
+
+void test_change_feed(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::string a = "a value";
+  std::string b = "b value";
+  std::string c = "c value";
+  db->Set(slice(make_key(1)), slice(a));
+  db->Set(slice(make_key(2)), slice(b));
+  db->Set(slice(make_key(1)), slice(c));
+
+  std::unique_ptr<UpdateIterator> iter;
+  expect(db->GetUpdatesSince(0, &iter) == Ok, "updates", mode);
+  // the first change of key 1 was overwritten and is skipped
+  expect(iter->Next() && iter->key() == make_key(2) && iter->value() == b,
+         "first update", mode);
+  uint64_t sequence = iter->sequence();
+  expect(iter->Next() && iter->key() == make_key(1) && iter->value() == c &&
+             iter->sequence() > sequence,
+         "second update", mode);
+  expect(!iter->Next(), "no more updates", mode);
+  db->Set(slice(make_key(3)), slice(a));
+  expect(iter->Next() && iter->key() == make_key(3), "tailed update", mode);
+  sequence = iter->sequence();
+
+  expect(db->GetUpdatesSince(sequence, &iter) == Ok && !iter->Next(),
+         "updates since the last", mode);
+  // the ring drops the oldest changes
+  for (int i = 0; i < 70000; i++) {
+    db->Set(slice(make_key(i % 100)), slice(a));
+  }
+  expect(db->GetUpdatesSince(1, &iter) == NotFound, "updates dropped", mode);
+  delete db;
+}
+
+// A reader tailing concurrent writers of new keys gets every change
+void test_change_feed_tail(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::unique_ptr<UpdateIterator> iter;
+  expect(db->GetUpdatesSince(0, &iter) == Ok, "tail updates", mode);
+  const int writers = 4;
+  const int per_writer = 10000;
+  std::atomic<int> running{writers};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < writers; t++) {
+    threads.emplace_back([db, t, &running]() {
+      for (int i = t * per_writer; i < (t + 1) * per_writer; i++) {
+        db->Set(slice(make_key(i)), slice(make_value(i, 10 + i % 100)));
+      }
+      running--;
+    });
+  }
+  std::vector<bool> seen(writers * per_writer);
+  int delivered = 0;
+  bool ordered = true;
+  uint64_t last = 0;
+  while (true) {
+    // the writers are done before the last look at the ring
+    bool done = running == 0;
+    while (iter->Next()) {
+      int i = atoi(iter->key().c_str() + 3);
+      if (iter->sequence() <= last || seen[i] ||
+          iter->value() != make_value(i, 10 + i % 100)) {
+        ordered = false;
+      }
+      last = iter->sequence();
+      seen[i] = true;
+      delivered++;
+    }
+    if (done || iter->status() != Ok) break;
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  expect(iter->status() == Ok && ordered, "tailed in order", mode);
+  expect(delivered == writers * per_writer, "tailed every change", mode);
+  delete db;
+}
+
+// Every key and value passed by ParallelScan, false on a duplicate
+bool scan_all(DB* db, std::map<std::string, std::string>* pairs) {
+  std::mutex mutex;
+  bool unique = true;
+  Status s = db->ParallelScan(
+      4, [&](int, const Slice& key, const Slice& value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pairs->emplace(key.to_string(), value.to_string()).second) {
+          unique = false;
+        }
+      });
+  return s == Ok && unique;
+}
+
+void test_scan_export_import(int mode) {
+  Config config = test_config(mode);
+  DB* db = open_db(&config, true);
+  std::map<std::string, std::string> want;
+  for (int i = 0; i < 3000; i++) {
+    want[make_key(i)] = make_value(i, i % 1000 == 0 ? 50000 : 10 + i % 300);
+  }
+  for (auto& pair : want) {
+    db->Set(slice(pair.first), slice(pair.second));
+  }
+  // overwritten records are not passed
+  for (int i = 0; i < 3000; i += 3) {
+    want[make_key(i)] = make_value(i + 1, 20);
+    db->Set(slice(make_key(i)), slice(want[make_key(i)]));
+  }
+  std::map<std::string, std::string> scanned;
+  expect(scan_all(db, &scanned) && scanned == want, "scan", mode);
+  expect(db->Export("./test_export", 4) == Ok, "export", mode);
+  delete db;
+
+  db = open_db(&config, true);
+  expect(db->Import("./test_export", true) == Ok, "import", mode);
+  for (auto& pair : want) {
+    expect(has_value(db, pair.first, pair.second), "imported", mode);
+  }
+  FILE* file = fopen("./test_export", "w");
+  fprintf(file, "not an export file");
+  fclose(file);
+  expect(db->Import("./test_export", false) == InvalidArgument,
+         "import other file", mode);
+  expect(db->Import("./test_missing", false) == IOError, "import missing",
+         mode);
+  delete db;
+  unlink("./test_export");
+}
+
+void test_attach_read_only() {
+  // a pool without the persistent index cannot be attached to
+  Config config = test_config(DramIndex);
+  delete open_db(&config, true);
+  rename(POOL, "./test_pool_dram");
+  // a pool of another block size to attach to next to the open db
+  config = test_config(PmemIndex);
+  config.block_size_ = 64;
+  DB* db = open_db(&config, true);
+  for (int i = 0; i < 100; i++) {
+    db->Set(slice(make_key(i)), slice(make_value(i + 1, 500)));
+  }
+  delete db;
+  rename(POOL, "./test_pool_wide");
+  config = test_config(PmemIndex);
+  db = open_db(&config, true);
+  std::string large = make_value(1, 100000);
+  for (int i = 0; i < 1000; i++) {
+    db->Set(slice(make_key(i)), slice(make_value(i, 10 + i % 300)));
+  }
+  db->Set(slice(make_key(1)), slice(large));
+
+  // a process either opens pools or attaches to them
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the exit status reports the failures of this process only
+    failures = 0;
+    DB* reader = nullptr;
+    Config attach_config;
+    expect(DB::AttachReadOnly("./test_pool_dram", &attach_config, &reader) ==
+               InvalidArgument,
+           "attach without index", PmemIndex);
+    expect(DB::AttachReadOnly(POOL, &attach_config, &reader) == Ok, "attach",
+           PmemIndex);
+    for (int i = 0; i < 1000; i++) {
+      std::string want = i == 1 ? large : make_value(i, 10 + i % 300);
+      expect(has_value(reader, make_key(i), want), "attached get", PmemIndex);
+    }
+    std::string chunks;
+    expect(read_chunks(reader, make_key(1), &chunks) == Ok && chunks == large,
+           "attached reader", PmemIndex);
+    std::map<std::string, std::string> scanned;
+    expect(scan_all(reader, &scanned) && scanned.size() == 1000,
+           "attached scan", PmemIndex);
+    expect(reader->Set(slice(make_key(1)), slice(large)) == InvalidArgument,
+           "attached set", PmemIndex);
+    delete reader;
+    _exit(failures == 0 ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  expect(WIFEXITED(status) && WEXITSTATUS(status) == 0, "attached process",
+         PmemIndex);
+
+  DB* reader = nullptr;
+  Config attach_config;
+  expect(DB::AttachReadOnly("./test_pool_wide", &attach_config, &reader) ==
+             Ok,
+         "attach next to a db", PmemIndex);
+  for (int i = 0; i < 100; i++) {
+    expect(has_value(reader, make_key(i), make_value(i + 1, 500)),
+           "attached get next to a db", PmemIndex);
+  }
+  // the db keeps its own block size
+  std::string value = make_value(2, 300);
+  expect(db->Set(slice(make_key(2)), slice(value)) == Ok &&
+             has_value(db, make_key(2), value) &&
+             has_value(db, make_key(1), large),
+         "db next to an attached pool", PmemIndex);
+  delete reader;
+  delete db;
+  unlink("./test_pool_dram");
+  unlink("./test_pool_wide");
+}
+
+int main(int argc, char* argv[]) {
+  // the fill test of the contest on /mnt/pmem
+  if (argc > 1 && strcmp(argv[1], "fill") == 0) {
+    test3();
+    return 0;
+  }
+  for (int mode = 0; mode < NumModes; mode++) {
+    test_set_get(mode);
+    test_large_value(mode);
+    test_multi(mode);
+    test_async(mode, 2);
+    test_read_modify_write(mode);
+    test_bulk_load(mode);
+    test_bulk_load_recovery(mode, 0);
+    test_bulk_load_recovery(mode, 2);
+    test_backup_restore(mode);
+    test_change_feed(mode);
+    test_change_feed_tail(mode);
+    test_scan_export_import(mode);
+  }
+  test_async(DramIndex, 0);
+  test_attach_read_only();
+  unlink(POOL);
+  printf("%s, %d failures\n", failures == 0 ? "passed" : "FAILED", failures);
+  return failures == 0 ? 0 : 1;
+}